@@ -0,0 +1,78 @@
+#include "common.h"
+#include "capture.h"
+#include <time.h>
+
+#define CAPTURE_STDIO_BUFFER (1 << 20)
+
+// Creates the capture file and writes its header. Returns 0 on success, -1 on error.
+int capture_open(Capture *cap, const char *path, const char *role) {
+    memset(cap, 0, sizeof(*cap));
+    cap->file = fopen(path, "wb");
+    if (cap->file == NULL) return -1;
+    // Records are small; a large stdio buffer keeps the hot path free of system calls
+    setvbuf(cap->file, NULL, _IOFBF, CAPTURE_STDIO_BUFFER);
+
+    CaptureHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CAPTURE_MAGIC, sizeof(header.magic));
+    header.version = CAPTURE_VERSION;
+    strncpy(header.role, role, sizeof(header.role) - 1);
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    header.start_unix_ms = (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+
+    if (fwrite(&header, sizeof(header), 1, cap->file) != 1) {
+        fclose(cap->file);
+        cap->file = NULL;
+        return -1;
+    }
+    cap->start_us = monotonic_us();
+    return 0;
+}
+
+// Appends one record. Does nothing if the capture is not open.
+void capture_write(Capture *cap, uint32_t conn_id, int event, const char *data, size_t len) {
+    if (cap->file == NULL) return;
+    if (len > UINT16_MAX) len = UINT16_MAX;
+
+    CaptureRecord record = {
+        .time_us = monotonic_us() - cap->start_us,
+        .conn_id = conn_id,
+        .event = (uint8_t)event,
+        .len = (uint16_t)len,
+    };
+    fwrite(&record, sizeof(record), 1, cap->file);
+    if (len > 0) fwrite(data, 1, len, cap->file);
+    cap->records++;
+}
+
+void capture_flush(Capture *cap) {
+    if (cap->file != NULL) fflush(cap->file);
+}
+
+void capture_close(Capture *cap) {
+    if (cap->file == NULL) return;
+    fclose(cap->file);
+    cap->file = NULL;
+}
+
+// Reads and checks the header of a capture file. Returns 0 on success, -1 if it is not a capture.
+int capture_read_header(FILE *file, CaptureHeader *header) {
+    if (fread(header, sizeof(*header), 1, file) != 1) return -1;
+    if (memcmp(header->magic, CAPTURE_MAGIC, sizeof(header->magic)) != 0) return -1;
+    if (header->version != CAPTURE_VERSION) return -1;
+    header->role[sizeof(header->role) - 1] = '\0';
+    return 0;
+}
+
+// Reads the next record and its NUL-terminated payload (truncated to payload_size - 1 bytes).
+// Returns 1 if a record was read, 0 at the end of the file and -1 on a truncated record.
+int capture_read_record(FILE *file, CaptureRecord *record, char *payload, size_t payload_size) {
+    if (fread(record, sizeof(*record), 1, file) != 1) return 0;
+
+    size_t keep = record->len < payload_size ? record->len : payload_size - 1;
+    if (keep > 0 && fread(payload, 1, keep, file) != keep) return -1;
+    payload[keep] = '\0';
+    if (record->len > keep && fseek(file, (long)(record->len - keep), SEEK_CUR) != 0) return -1;
+    return 1;
+}
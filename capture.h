@@ -0,0 +1,51 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Binary wire-traffic capture: a CaptureHeader followed by CaptureRecords, each one followed by
+// len payload bytes. Integers are stored in host byte order. The server records every inbound
+// client and peer message, plus the replies sent to clients, so a run can be replayed later.
+#define CAPTURE_MAGIC "SRVCAP1"  // 7 characters and the terminating NUL
+#define CAPTURE_VERSION 1
+#define CAPTURE_FLUSH_MS 1000     // Buffered records are written out at least this often
+#define CAPTURE_PEER_CONN 0       // Connection ID of the peer link; clients count from 1
+
+// Record events
+#define CAPTURE_OPEN 1    // Client connection accepted, payload: remote address
+#define CAPTURE_RECV 2    // Inbound message (without its newline)
+#define CAPTURE_REPLY 3   // Message sent to the client (without its newline)
+#define CAPTURE_CLOSE 4   // Client connection closed, no payload
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    char role[4];              // "SS" or "SL"
+    uint64_t start_unix_ms;    // Wall-clock start of the capture
+} CaptureHeader;
+
+typedef struct {
+    uint64_t time_us;          // Microseconds since the start of the capture
+    uint32_t conn_id;
+    uint8_t event;
+    uint8_t reserved;
+    uint16_t len;              // Payload bytes following the record
+} CaptureRecord;
+
+typedef struct {
+    FILE *file;
+    uint64_t start_us;
+    uint64_t records;
+} Capture;
+
+int capture_open(Capture *cap, const char *path, const char *role);
+void capture_write(Capture *cap, uint32_t conn_id, int event, const char *data, size_t len);
+void capture_flush(Capture *cap);
+void capture_close(Capture *cap);
+
+int capture_read_header(FILE *file, CaptureHeader *header);
+int capture_read_record(FILE *file, CaptureRecord *record, char *payload, size_t payload_size);
+
+#endif // CAPTURE_H
@@ -1,4 +1,10 @@
 #include "common.h"
+#include <poll.h> // For poll
+#include <errno.h>
+#include <time.h> // For clock_gettime
+#ifdef __SSE2__
+#include <emmintrin.h> // SSE2 intrinsics for sensor ID decoding
+#endif
 
 // Prints an error message
 void log_error(const char *msg) {
@@ -11,12 +17,13 @@ void log_info(const char *msg) {
     fflush(stdout);
 }
 
-// Builds a control message in the "code payload" format
+// Builds a control message in the "code payload" format, terminated by a newline
+// so several messages can share one stream read
 void build_control_message(char *buffer, size_t buffer_size, int code, const char *payload) {
     if (payload != NULL && strlen(payload) > 0) {
-        snprintf(buffer, buffer_size, "%d %s", code, payload);
+        snprintf(buffer, buffer_size, "%d %s\n", code, payload);
     } else {
-        snprintf(buffer, buffer_size, "%d ", code);
+        snprintf(buffer, buffer_size, "%d \n", code);
     }
 }
 
@@ -52,3 +59,297 @@ int parse_message(const char *buffer, int *code, char *payload_buffer, size_t pa
 
     return 0; // Parsing failed
 }
+
+// Empties a message buffer
+void message_buffer_reset(MessageBuffer *mb) {
+    mb->len = 0;
+}
+
+// Appends received stream data. Returns 0 on success, -1 if the buffer would overflow
+// (a peer sending a line longer than any valid message).
+int message_buffer_append(MessageBuffer *mb, const char *data, size_t len) {
+    if (len > sizeof(mb->data) - mb->len) return -1;
+    memcpy(mb->data + mb->len, data, len);
+    mb->len += len;
+    return 0;
+}
+
+// Extracts the next complete message (without its newline) into out.
+// Returns 1 if a message was extracted, 0 if no complete message is buffered yet.
+int message_buffer_next(MessageBuffer *mb, char *out, size_t out_size) {
+    while (mb->len > 0) {
+        char *newline = memchr(mb->data, '\n', mb->len);
+        if (newline == NULL) return 0;
+
+        size_t line_len = newline - mb->data;
+        size_t copy_len = line_len;
+        if (copy_len > 0 && mb->data[copy_len - 1] == '\r') copy_len--;
+        if (copy_len > out_size - 1) copy_len = out_size - 1;
+        memcpy(out, mb->data, copy_len);
+        out[copy_len] = '\0';
+
+        mb->len -= line_len + 1;
+        memmove(mb->data, newline + 1, mb->len);
+        if (copy_len > 0) return 1; // Skip empty lines
+    }
+    return 0;
+}
+
+// Blocks until the next complete message from fd is available and copies it into out.
+// Returns the message length, 0 if the connection was closed, or -1 on error/overflow.
+ssize_t read_message(int fd, MessageBuffer *mb, char *out, size_t out_size) {
+    while (!message_buffer_next(mb, out, out_size)) {
+        if (mb->len == sizeof(mb->data)) return -1;
+        ssize_t bytes_read = read(fd, mb->data + mb->len, sizeof(mb->data) - mb->len);
+        if (bytes_read <= 0) return bytes_read;
+        mb->len += bytes_read;
+    }
+    return (ssize_t)strlen(out);
+}
+
+// Milliseconds from a monotonic clock (not affected by wall-clock changes)
+uint64_t monotonic_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+// Monotonic clock in microseconds. CLOCK_MONOTONIC is shared by all processes on a host,
+// so timestamps taken by the sensor and both servers can be compared directly.
+uint64_t monotonic_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+// Milliseconds since the Unix epoch, for timestamps that are shown to or given by users
+uint64_t wall_clock_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+static uint64_t rng_state = 0x9E3779B97F4A7C15ull;
+
+// Restarts the generator; equal seeds give equal sequences
+void rng_seed(uint64_t seed) {
+    rng_state = (seed + 1) * 0x9E3779B97F4A7C15ull;
+    if (rng_state == 0) rng_state = 0x9E3779B97F4A7C15ull; // Zero is the one state xorshift never leaves
+}
+
+// xorshift64*: fast, and its high 32 bits pass the usual statistical tests
+uint32_t rng_next(void) {
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return (uint32_t)((rng_state * 0x2545F4914F6CDD1Dull) >> 32);
+}
+
+// Returns a number from 0 to n - 1
+int rng_below(int n) {
+    return (int)(((uint64_t)rng_next() * (uint32_t)n) >> 32);
+}
+
+// Region of each location ID (index 0 is unused)
+static const int location_regions[NUM_LOCATIONS + 1] = {-1, 0, 0, 0, 1, 1, 2, 2, 3, 3, 3};
+static const char *region_names[NUM_REGIONS] = {"Norte", "Sul", "Leste", "Oeste"};
+
+// Returns the region (0 to NUM_REGIONS - 1) of a location, or -1 for an invalid location.
+int location_region(int loc_id) {
+    if (loc_id < 1 || loc_id > NUM_LOCATIONS) return -1;
+    return location_regions[loc_id];
+}
+
+// Returns the name of a region, or NULL for an invalid region.
+const char *region_name(int region) {
+    if (region < 0 || region >= NUM_REGIONS) return NULL;
+    return region_names[region];
+}
+
+// Decodes a sensor ID of exactly SENSOR_ID_DIGITS ASCII digits into its packed key
+// (the decimal value with SENSOR_KEY_TAG set). Returns SENSOR_KEY_NONE if the length is
+// wrong or any character is not a digit.
+uint64_t sensor_id_decode(const char *text, size_t len) {
+    if (len != SENSOR_ID_DIGITS) return SENSOR_KEY_NONE;
+#ifdef __SSE2__
+    // Right-align the digits in a 16-byte lane, padding with '0' so the padding adds nothing
+    char lane[16];
+    memset(lane, '0', sizeof(lane) - SENSOR_ID_DIGITS);
+    memcpy(lane + sizeof(lane) - SENSOR_ID_DIGITS, text, SENSOR_ID_DIGITS);
+
+    __m128i digits = _mm_sub_epi8(_mm_loadu_si128((const __m128i *)lane), _mm_set1_epi8('0'));
+    __m128i invalid = _mm_or_si128(_mm_cmplt_epi8(digits, _mm_setzero_si128()),
+                                   _mm_cmpgt_epi8(digits, _mm_set1_epi8(9)));
+    if (_mm_movemask_epi8(invalid) != 0) return SENSOR_KEY_NONE;
+
+    // Combine digit pairs, then pairs of pairs, leaving four 4-digit groups
+    __m128i tens = _mm_set_epi16(1, 10, 1, 10, 1, 10, 1, 10);
+    __m128i pairs_lo = _mm_madd_epi16(_mm_unpacklo_epi8(digits, _mm_setzero_si128()), tens);
+    __m128i pairs_hi = _mm_madd_epi16(_mm_unpackhi_epi8(digits, _mm_setzero_si128()), tens);
+    __m128i hundreds = _mm_set_epi16(1, 100, 1, 100, 1, 100, 1, 100);
+    __m128i groups = _mm_madd_epi16(_mm_packs_epi32(pairs_lo, pairs_hi), hundreds);
+
+    uint32_t g[4];
+    _mm_storeu_si128((__m128i *)g, groups);
+    uint64_t value = (((uint64_t)g[0] * 10000 + g[1]) * 10000 + g[2]) * 10000 + g[3];
+#else
+    uint64_t value = 0;
+    for (size_t i = 0; i < SENSOR_ID_DIGITS; i++) {
+        if (text[i] < '0' || text[i] > '9') return SENSOR_KEY_NONE;
+        value = value * 10 + (uint64_t)(text[i] - '0');
+    }
+#endif
+    return value | SENSOR_KEY_TAG;
+}
+
+// Decodes a NUL-terminated sensor ID. Returns SENSOR_KEY_NONE if it is not a valid ID.
+uint64_t sensor_id_parse(const char *text) {
+    return sensor_id_decode(text, strnlen(text, SENSOR_ID_DIGITS + 1));
+}
+
+// Formats a packed key back into its 10-digit ID (out needs SENSOR_ID_STR_SIZE bytes)
+void sensor_id_format(uint64_t key, char *out, size_t out_size) {
+    snprintf(out, out_size, "%010llu", (unsigned long long)(key & ~SENSOR_KEY_TAG));
+}
+
+// Returns 1 if the address uses the "unix:<path>" scheme, 0 for an IPv4 address.
+int transport_is_unix(const char *address) {
+    return address != NULL && strncmp(address, UNIX_ADDR_PREFIX, strlen(UNIX_ADDR_PREFIX)) == 0;
+}
+
+// Fills a sockaddr_un from a "unix:<path>" address. Returns 0 on success, -1 if the path is too long.
+static int fill_unix_addr(const char *address, struct sockaddr_un *addr) {
+    const char *path = address + strlen(UNIX_ADDR_PREFIX);
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) == 0 || strlen(path) >= sizeof(addr->sun_path)) return -1;
+    strcpy(addr->sun_path, path);
+    return 0;
+}
+
+// Creates a listening stream socket.
+// "unix:<path>" listens on a Unix domain socket (a stale socket file is removed first);
+// otherwise the socket listens on all IPv4 interfaces at the given port.
+// Returns the listening descriptor, or -1 on failure (errno is preserved).
+int transport_listen(const char *address, int port, int backlog) {
+    int fd;
+    int rc;
+    if (transport_is_unix(address)) {
+        struct sockaddr_un addr;
+        if (fill_unix_addr(address, &addr) < 0) {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) return -1;
+        unlink(addr.sun_path);
+        rc = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+    } else {
+        struct sockaddr_in addr;
+        int opt = 1;
+        if ((fd = socket(AF_INET, SOCK_STREAM, 0)) == -1) return -1;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = INADDR_ANY;
+        addr.sin_port = htons(port);
+        rc = setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+        if (rc == 0) rc = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+    }
+    if (rc == 0) rc = listen(fd, backlog);
+    if (rc < 0) {
+        int saved_errno = errno;
+        close(fd);
+        errno = saved_errno;
+        return -1;
+    }
+    return fd;
+}
+
+// Connects a stream socket to "unix:<path>" or to an IPv4 address and port.
+// Returns the connected descriptor, or -1 on failure (errno is preserved).
+int transport_connect(const char *address, int port) {
+    int fd;
+    int rc;
+    if (transport_is_unix(address)) {
+        struct sockaddr_un addr;
+        if (fill_unix_addr(address, &addr) < 0) {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) return -1;
+        rc = connect(fd, (struct sockaddr *)&addr, sizeof(addr));
+    } else {
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        if (inet_pton(AF_INET, address, &addr.sin_addr) <= 0) {
+            errno = EINVAL;
+            return -1;
+        }
+        if ((fd = socket(AF_INET, SOCK_STREAM, 0)) == -1) return -1;
+        rc = connect(fd, (struct sockaddr *)&addr, sizeof(addr));
+    }
+    if (rc < 0) {
+        int saved_errno = errno;
+        close(fd);
+        errno = saved_errno;
+        return -1;
+    }
+    return fd;
+}
+
+// Writes a printable description of the remote end of a connected socket ("ip:port" or "unix").
+void transport_describe_peer(int fd, char *out, size_t out_size) {
+    struct sockaddr_storage addr;
+    socklen_t addr_len = sizeof(addr);
+    if (getpeername(fd, (struct sockaddr *)&addr, &addr_len) < 0) {
+        snprintf(out, out_size, "unknown");
+    } else if (addr.ss_family == AF_INET) {
+        struct sockaddr_in *in = (struct sockaddr_in *)&addr;
+        char ip[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &in->sin_addr, ip, sizeof(ip));
+        snprintf(out, out_size, "%s:%d", ip, ntohs(in->sin_port));
+    } else {
+        snprintf(out, out_size, "unix");
+    }
+}
+
+// Removes the socket file of a "unix:<path>" listener. No-op for IPv4 addresses.
+void transport_cleanup(const char *address) {
+    if (transport_is_unix(address)) {
+        unlink(address + strlen(UNIX_ADDR_PREFIX));
+    }
+}
+
+// Sends a request datagram and waits for the response, retransmitting on timeout.
+// Stale datagrams left over from earlier retransmissions are discarded before sending.
+// Returns the number of bytes received (response is null-terminated), or -1 on failure.
+ssize_t udp_query(int udp_fd, const struct sockaddr_in *server_addr, const char *request,
+                  char *response_buffer, size_t response_buffer_size) {
+    while (recv(udp_fd, response_buffer, response_buffer_size - 1, MSG_DONTWAIT) >= 0) {
+        // Drop late answers to previous queries
+    }
+
+    for (int attempt = 0; attempt < UDP_QUERY_RETRIES; attempt++) {
+        if (sendto(udp_fd, request, strlen(request), 0,
+                   (const struct sockaddr *)server_addr, sizeof(*server_addr)) < 0) {
+            return -1;
+        }
+
+        struct pollfd pfd = { .fd = udp_fd, .events = POLLIN };
+        int ready = poll(&pfd, 1, UDP_QUERY_TIMEOUT_MS);
+        if (ready < 0) {
+            return -1;
+        }
+        if (ready == 0) {
+            continue; // Timeout: retransmit
+        }
+
+        ssize_t bytes_read = recv(udp_fd, response_buffer, response_buffer_size - 1, 0);
+        if (bytes_read >= 0) {
+            response_buffer[bytes_read] = '\0';
+            return bytes_read;
+        }
+    }
+    return -1;
+}
@@ -2,17 +2,32 @@
 #define COMMON_H
 
 #include <stdio.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>     // For read, write, close
 #include <arpa/inet.h>  // For inet_addr, htons, etc.
 #include <sys/socket.h> // For socket, bind, listen, accept, connect
 #include <netinet/in.h> // For sockaddr_in
+#include <sys/un.h>     // For sockaddr_un
 
 #define MAX_MSG_SIZE 500    // Maximum message size
 #define SERVER_BACKLOG 5    // Number of pending connections the listen call can queue
 #define MAX_PIDS_LENGTH 50  // Maximum length for a Peer ID (PidS)
 
+#define UNIX_ADDR_PREFIX "unix:" // Address scheme selecting an AF_UNIX stream socket
+
+#define UDP_QUERY_TIMEOUT_MS 300 // Time to wait for a UDP response before retransmitting
+#define UDP_QUERY_RETRIES 3      // Number of UDP transmissions before giving up
+
+#define SENSOR_ID_DIGITS 10                   // Sensor IDs are exactly 10 ASCII digits
+#define SENSOR_ID_STR_SIZE (SENSOR_ID_DIGITS + 1)
+#define SENSOR_KEY_NONE 0                     // Packed key of "no sensor"; never produced by a valid ID
+#define SENSOR_KEY_TAG (1ULL << 63)           // Set in every packed key so "0000000000" differs from SENSOR_KEY_NONE
+
+#define NUM_LOCATIONS 10 // Valid location IDs are 1 to NUM_LOCATIONS
+#define NUM_REGIONS 4    // Norte, Sul, Leste, Oeste
+
 // --- Control Messages ---
 #define REQ_CONNPEER 20
 #define RES_CONNPEER 21
@@ -20,6 +35,8 @@
 #define REQ_CONNSEN 23
 #define RES_CONNSEN 24
 #define REQ_DISCSEN 25
+#define REQ_HEARTBEAT 26    // Liveness probe, answered with RES_HEARTBEAT
+#define RES_HEARTBEAT 27
 
 // --- Data Messages ---
 #define REQ_CHECKALERT 36
@@ -30,6 +47,20 @@
 #define RES_SENSSTATUS 41
 #define REQ_LOCLIST 42
 #define RES_LOCLIST 43
+#define REQ_REGIONSUM 44    // Sensor and alert counts per region and location
+#define RES_REGIONSUM 45
+#define REQ_REPLSYNC 46     // SS->SL: send the registry changes after "<epoch>,<last_seq>"
+#define RES_REPLSYNC 47     // SL->SS: "<epoch>,<seq>,<F|I>", full snapshot or incremental replay follows
+#define REPL_DELTA 48       // SL->SS: "<seq>,<R|D>,<SensorID>,<LocId>" registry change
+#define REQ_LOCUPDATE 49    // Sensor->SL: "<LocId>", new location of the sending sensor; only errors are answered
+#define REQ_P2PSHM 50       // SS->SL: "<handoff socket>", offer of a shared-memory P2P transport
+#define RES_P2PSHM 51       // SL->SS: "1" accepted (the SL now sends through the rings) or "0" declined
+#define REQ_READING 52      // Sensor->SS: "<value>", latest measurement of the sending sensor; only errors are answered
+#define REQ_HISTORY 53      // "<SensorID>,<risk|location|reading>,<from_ms>,<to_ms>", unix ms, to 0 meaning now
+#define RES_HISTORY 54      // "<ts>:<value>,...", oldest first; truncated to one message, continue from the last ts + 1
+#define BACKOFF_HINT 55     // Server->client: "<ms>", pause before the next request; sent ahead of the reply while overloaded
+#define REQ_ALERTLIST 56    // Client->SS: "[<LocId>|<Region>]", sensors in alert, optionally at one location or region
+#define RES_ALERTLIST 57    // "<count>;<SensorID>:<LocId>,...", count of all matches; whole entries up to one message, LocId 0 if unknown
 
 // --- Confirmation and Error Messages ---
 #define OK_MSG 0
@@ -47,6 +78,14 @@
 
 #define SENSOR_LIMIT_EXCEEDED 9
 #define SENSOR_NOT_FOUND 10
+#define SERVER_OVERLOADED 11    // The request waited too long in the server's queue and was dropped
+#define REPLICA_NOT_SYNCED 12   // The SS has no copy of the SL's sensor locations yet; retry later
+
+// Accumulates stream data and splits it into newline-terminated messages
+typedef struct {
+    char data[2 * MAX_MSG_SIZE];
+    size_t len;
+} MessageBuffer;
 
 // --- Utility Functions ---
 void log_error(const char *msg);
@@ -55,4 +94,37 @@ void log_info(const char *msg);
 void build_control_message(char *buffer, size_t buffer_size, int code, const char *payload);
 int parse_message(const char *buffer, int *code, char *payload_buffer, size_t payload_buffer_size);
 
+void message_buffer_reset(MessageBuffer *mb);
+int message_buffer_append(MessageBuffer *mb, const char *data, size_t len);
+int message_buffer_next(MessageBuffer *mb, char *out, size_t out_size);
+ssize_t read_message(int fd, MessageBuffer *mb, char *out, size_t out_size);
+
+uint64_t monotonic_ms(void);
+uint64_t monotonic_us(void);
+uint64_t wall_clock_ms(void);
+
+// --- Seeded pseudo-random numbers, so runs can be reproduced (--seed) ---
+void rng_seed(uint64_t seed);
+uint32_t rng_next(void);
+int rng_below(int n);
+
+// --- Regions ---
+int location_region(int loc_id);
+const char *region_name(int region);
+
+// --- Sensor IDs ---
+uint64_t sensor_id_decode(const char *text, size_t len);
+uint64_t sensor_id_parse(const char *text);
+void sensor_id_format(uint64_t key, char *out, size_t out_size);
+
+// --- Transport (TCP or Unix domain stream sockets) ---
+int transport_is_unix(const char *address);
+int transport_listen(const char *address, int port, int backlog);
+int transport_connect(const char *address, int port);
+void transport_describe_peer(int fd, char *out, size_t out_size);
+void transport_cleanup(const char *address);
+
+ssize_t udp_query(int udp_fd, const struct sockaddr_in *server_addr, const char *request,
+                  char *response_buffer, size_t response_buffer_size);
+
 #endif // COMMON_H
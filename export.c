@@ -0,0 +1,79 @@
+#include "common.h"
+#include "export.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+
+// Opens the destination of a snapshot: a "unix:<path>" socket some tool listens on, or a file.
+// Returns the descriptor, or -1 on error.
+int export_open(const char *target) {
+    if (transport_is_unix(target)) return transport_connect(target, 0);
+    return open(target, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+}
+
+// Writes value in decimal, zero-padded to min_digits, and returns the number of characters
+static size_t format_decimal(char *out, long long value, int min_digits) {
+    char digits[24];
+    size_t n = 0, len = 0;
+    unsigned long long magnitude = value < 0 ? 0ULL - (unsigned long long)value : (unsigned long long)value;
+    do {
+        digits[n++] = (char)('0' + magnitude % 10);
+        magnitude /= 10;
+    } while (magnitude != 0 || (int)n < min_digits);
+    if (value < 0) out[len++] = '-';
+    while (n > 0) out[len++] = digits[--n];
+    return len;
+}
+
+// Formats the CSV header line or the binary header into out (at least EXPORT_RECORD_MAX bytes).
+// Returns the number of bytes.
+size_t export_format_header(char *out, ExportFormat format, const char *role, uint32_t count) {
+    if (format == EXPORT_CSV) {
+        static const char line[] = "sensor_id,slot,location,risk,age_ms\n";
+        memcpy(out, line, sizeof(line) - 1);
+        return sizeof(line) - 1;
+    }
+
+    ExportHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, EXPORT_MAGIC, sizeof(header.magic));
+    header.version = EXPORT_VERSION;
+    strncpy(header.role, role, sizeof(header.role) - 1);
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    header.snapshot_unix_ms = (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+    header.count = count;
+    memcpy(out, &header, sizeof(header));
+    return sizeof(header);
+}
+
+// Formats one sensor into out (at least EXPORT_RECORD_MAX bytes). Returns the number of bytes.
+size_t export_format_record(char *out, ExportFormat format, const ExportRecord *record) {
+    if (format == EXPORT_BINARY) {
+        memcpy(out, record, sizeof(*record));
+        return sizeof(*record);
+    }
+    size_t len = format_decimal(out, (long long)record->sensor_id, SENSOR_ID_DIGITS);
+    out[len++] = ',';
+    len += format_decimal(out + len, record->slot, 1);
+    out[len++] = ',';
+    len += format_decimal(out + len, record->location_id, 1);
+    out[len++] = ',';
+    len += format_decimal(out + len, record->risk_status, 1);
+    out[len++] = ',';
+    len += format_decimal(out + len, record->age_ms, 1);
+    out[len++] = '\n';
+    return len;
+}
+
+// Writes len bytes, retrying short and interrupted writes. Returns 0 on success, -1 on error.
+int export_write_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        data += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
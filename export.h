@@ -0,0 +1,41 @@
+#ifndef EXPORT_H
+#define EXPORT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Registry snapshots for operators. The server forks and the child writes the copy-on-write image
+// of its registry, so the event loop never walks the client table for an export.
+// The server may run a P2P link thread, so the child only calls async-signal-safe functions: the
+// snapshot is formatted into a buffer without stdio and written with plain write calls.
+// CSV: a "sensor_id,slot,location,risk,age_ms" header line and one line per sensor.
+// Binary: an ExportHeader followed by count ExportRecords, integers in host byte order.
+#define EXPORT_MAGIC "SRVREG1"   // 7 characters and the terminating NUL
+#define EXPORT_VERSION 1
+#define EXPORT_RECORD_MAX 64     // Bytes of the longest formatted record (and of the CSV header line)
+
+typedef enum { EXPORT_CSV, EXPORT_BINARY } ExportFormat;
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    char role[4];              // "SS" or "SL"
+    uint64_t snapshot_unix_ms; // Wall-clock time of the snapshot
+    uint32_t count;            // Records following the header
+    uint32_t reserved;
+} ExportHeader;
+
+typedef struct {
+    uint64_t sensor_id;        // The 10-digit ID as a number
+    uint32_t age_ms;           // Time since the sensor's connection was accepted
+    uint16_t slot;
+    int8_t location_id;
+    int8_t risk_status;
+} ExportRecord;
+
+int export_open(const char *target);
+size_t export_format_header(char *out, ExportFormat format, const char *role, uint32_t count);
+size_t export_format_record(char *out, ExportFormat format, const ExportRecord *record);
+int export_write_all(int fd, const char *data, size_t len);
+
+#endif // EXPORT_H
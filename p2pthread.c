@@ -0,0 +1,143 @@
+#include "common.h"
+#include "p2pthread.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+
+// Writes out as much of out[*off..len) as the socket takes without blocking.
+// Returns 0 on success (or a full socket buffer), -1 if the socket failed.
+static int flush_out(int fd, const char *out, size_t len, size_t *off) {
+    while (*off < len) {
+        ssize_t n = send(fd, out + *off, len - *off, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n > 0) {
+            *off += (size_t)n;
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else {
+            return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
+    }
+    return 0;
+}
+
+// Writes what the reactor queued before asking the thread to stop (e.g. a final OK(01)),
+// waiting for the socket at most P2P_THREAD_FLUSH_MS
+static void flush_on_stop(P2PThread *pt, char *out, size_t len, size_t off) {
+    uint64_t deadline = monotonic_ms() + P2P_THREAD_FLUSH_MS;
+    for (;;) {
+        if (off == len) {
+            len = shm_link_recv(&pt->link, out, P2P_THREAD_CHUNK);
+            off = 0;
+            if (len == 0) return;
+        }
+        if (flush_out(pt->socket_fd, out, len, &off) < 0) return;
+        uint64_t now = monotonic_ms();
+        if (off < len) {
+            if (now >= deadline) return;
+            struct pollfd pfd = { .fd = pt->socket_fd, .events = POLLOUT };
+            poll(&pfd, 1, (int)(deadline - now));
+        }
+    }
+}
+
+static void *p2p_thread_main(void *arg) {
+    P2PThread *pt = arg;
+    char in[P2P_THREAD_CHUNK];
+    size_t in_len = 0;                   // Received but not pushed to the reactor yet (its ring was full)
+    char out[P2P_THREAD_CHUNK];
+    size_t out_len = 0, out_off = 0;     // Taken from the ring but not written to the socket yet
+
+    while (!atomic_load(&pt->stop)) {
+        // Reactor -> peer
+        shm_link_clear_wakeup(&pt->link);
+        if (out_off == out_len) {
+            out_len = shm_link_recv(&pt->link, out, sizeof(out));
+            out_off = 0;
+        }
+        if (flush_out(pt->socket_fd, out, out_len, &out_off) < 0) break;
+        if (out_off == out_len && shm_link_pending(&pt->link)) continue;
+
+        // Peer -> reactor
+        if (in_len > 0 && shm_link_send(&pt->link, in, in_len) == 0) in_len = 0;
+        if (in_len == 0) {
+            ssize_t n = recv(pt->socket_fd, in, sizeof(in), MSG_DONTWAIT);
+            if (n > 0) {
+                in_len = (size_t)n;
+                if (shm_link_send(&pt->link, in, in_len) == 0) in_len = 0;
+                continue;
+            }
+            if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) break;
+        }
+
+        struct pollfd pfds[2] = {
+            { .fd = pt->socket_fd, .events = (in_len == 0 ? POLLIN : 0) | (out_off < out_len ? POLLOUT : 0) },
+            { .fd = pt->link.rx_eventfd, .events = POLLIN },
+        };
+        poll(pfds, 2, in_len > 0 ? P2P_THREAD_RETRY_MS : -1);
+    }
+
+    if (atomic_load(&pt->stop)) {
+        flush_on_stop(pt, out, out_len, out_off);
+        return NULL;
+    }
+    // The socket is done: tell the reactor, which drains the ring and then closes the link
+    atomic_store(&pt->closed, 1);
+    uint64_t one = 1;
+    if (write(pt->link.tx_eventfd, &one, sizeof(one)) < 0) {
+        // EAGAIN: a wakeup is already pending
+    }
+    return NULL;
+}
+
+// Creates the link (reactor_end is the reactor's end) and starts the thread on the socket.
+// Returns 0 on success, -1 on error (the socket is then left to the caller).
+int p2p_thread_start(P2PThread *pt, int socket_fd, ShmLink *reactor_end) {
+    memset(pt, 0, sizeof(*pt));
+    if (shm_link_create(reactor_end) < 0) return -1;
+
+    int fds[SHM_LINK_FDS];
+    int ok = 1;
+    for (int i = 0; i < SHM_LINK_FDS; i++) {
+        fds[i] = fcntl(reactor_end->fds[i], F_DUPFD_CLOEXEC, 0);
+        if (fds[i] < 0) ok = 0;
+    }
+    if (!ok) {
+        for (int i = 0; i < SHM_LINK_FDS; i++) {
+            if (fds[i] >= 0) close(fds[i]);
+        }
+        shm_link_close(reactor_end);
+        return -1;
+    }
+    if (shm_link_attach(&pt->link, fds) < 0) {
+        shm_link_close(reactor_end);
+        return -1;
+    }
+
+    pt->socket_fd = socket_fd;
+    if (pthread_create(&pt->thread, NULL, p2p_thread_main, pt) != 0) {
+        shm_link_close(&pt->link);
+        shm_link_close(reactor_end);
+        return -1;
+    }
+    pt->running = 1;
+    return 0;
+}
+
+// Stops the thread after it wrote out what was queued for the peer, and releases its end of the
+// link. The socket stays open; the reactor's end of the link is closed by the caller.
+void p2p_thread_stop(P2PThread *pt) {
+    if (!pt->running) return;
+    atomic_store(&pt->stop, 1);
+    uint64_t one = 1;
+    if (write(pt->link.rx_eventfd, &one, sizeof(one)) < 0) {
+        // EAGAIN: a wakeup is already pending
+    }
+    pthread_join(pt->thread, NULL);
+    shm_link_close(&pt->link);
+    pt->running = 0;
+}
+
+// Returns 1 once the thread found the socket closed or failed
+int p2p_thread_closed(const P2PThread *pt) {
+    return pt->running && atomic_load(&pt->closed);
+}
@@ -0,0 +1,28 @@
+#ifndef P2PTHREAD_H
+#define P2PTHREAD_H
+
+#include <pthread.h>
+#include "shmring.h"
+
+// Dedicated thread for the socket of the P2P link. It owns the socket once the handshake is done
+// and bridges it to an in-process ShmLink: the SPSC rings carry the byte stream in each direction
+// and their eventfds wake the reactor or the thread, so neither side ever waits on the other's I/O.
+// The reactor keeps parsing and handling the peer's messages, since they update the registry.
+#define P2P_THREAD_CHUNK 4096        // Bytes moved between the socket and a ring at a time
+#define P2P_THREAD_RETRY_MS 1        // Retry interval while the ring to the reactor is full
+#define P2P_THREAD_FLUSH_MS 500      // Time a stopping thread spends writing out what is still queued
+
+typedef struct {
+    ShmLink link;                    // The thread's end of the link
+    int socket_fd;
+    pthread_t thread;
+    int running;
+    _Atomic int stop;                // Set by the reactor to end the thread
+    _Atomic int closed;              // Set by the thread when the socket failed or the peer closed it
+} P2PThread;
+
+int p2p_thread_start(P2PThread *pt, int socket_fd, ShmLink *reactor_end);
+void p2p_thread_stop(P2PThread *pt);
+int p2p_thread_closed(const P2PThread *pt);
+
+#endif // P2PTHREAD_H
@@ -0,0 +1,314 @@
+#include "common.h"
+#include "capture.h"
+#include <errno.h>
+#include <poll.h>
+
+// Re-drives the traffic of a capture file (recorded with the server's --capture option) against a
+// server, at the original timing or as fast as possible, and compares throughput and reply latency
+// with the recording.
+
+#define REPLAY_MAX_INFLIGHT 256    // Requests awaiting a reply on one connection
+#define REPLAY_DRAIN_MS 2000       // Time to wait for outstanding replies after the last message
+
+// One captured record
+typedef struct {
+    CaptureRecord rec;
+    char *payload;
+    int reply;             // RECV only: index of the reply it got in the recording, or -1
+} ReplayEvent;
+
+// One replayed connection
+typedef struct {
+    int fd;                // -1 when not (or no longer) connected
+    MessageBuffer rx;
+    uint64_t sent_us[REPLAY_MAX_INFLIGHT];
+    int expected[REPLAY_MAX_INFLIGHT];
+    unsigned head, tail;   // FIFO of requests awaiting a reply
+} ReplayConn;
+
+ReplayEvent *events = NULL;
+size_t num_events = 0;
+ReplayConn *conns = NULL;
+uint32_t num_conns = 0;    // Highest connection ID + 1
+
+uint64_t *recorded_latency = NULL;
+size_t num_recorded_latency = 0;
+uint64_t *replay_latency = NULL;
+size_t num_replay_latency = 0;
+
+int replies_missing = 0;
+int replies_differing = 0;
+int failed_connections = 0;
+int unsent_messages = 0;
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+// Logs count, median, 99th percentile and maximum of a latency sample
+void report_latency(const char *what, uint64_t *samples, size_t n) {
+    char log_msg[200];
+    if (n == 0) {
+        sprintf(log_msg, "%s: no replies.", what);
+        log_info(log_msg);
+        return;
+    }
+    qsort(samples, n, sizeof(samples[0]), compare_u64);
+    sprintf(log_msg, "%s: n=%zu p50=%llu us p99=%llu us max=%llu us", what, n,
+            (unsigned long long)samples[n / 2], (unsigned long long)samples[(n * 99) / 100],
+            (unsigned long long)samples[n - 1]);
+    log_info(log_msg);
+}
+
+// Returns 1 if a server message is a heartbeat probe, which is not a reply to any request
+static int is_heartbeat(const char *message) {
+    int code;
+    return sscanf(message, "%d", &code) == 1 && code == REQ_HEARTBEAT;
+}
+
+// Loads every record of the capture and pairs each request with the reply it got in the recording.
+// Returns 0 on success, -1 if the file is unreadable.
+int load_capture(const char *path, CaptureHeader *header) {
+    FILE *file = fopen(path, "rb");
+    if (file == NULL || capture_read_header(file, header) < 0) {
+        if (file != NULL) fclose(file);
+        return -1;
+    }
+
+    size_t capacity = 1024;
+    events = malloc(capacity * sizeof(events[0]));
+    char payload[UINT16_MAX + 1];
+    CaptureRecord rec;
+    int rc;
+    while ((rc = capture_read_record(file, &rec, payload, sizeof(payload))) == 1) {
+        if (num_events == capacity) {
+            capacity *= 2;
+            events = realloc(events, capacity * sizeof(events[0]));
+        }
+        events[num_events].rec = rec;
+        events[num_events].payload = strdup(payload);
+        events[num_events].reply = -1;
+        num_events++;
+        if (rec.conn_id >= num_conns) num_conns = rec.conn_id + 1;
+    }
+    fclose(file);
+    if (rc < 0) log_info("Capture file is truncated; replaying the complete records only.");
+
+    // A reply answers the latest unanswered request of its connection
+    int *last_request = malloc(num_conns * sizeof(int));
+    for (uint32_t c = 0; c < num_conns; c++) last_request[c] = -1;
+    recorded_latency = malloc((num_events + 1) * sizeof(uint64_t));
+    for (size_t e = 0; e < num_events; e++) {
+        CaptureRecord *r = &events[e].rec;
+        if (r->event == CAPTURE_RECV) {
+            last_request[r->conn_id] = (int)e;
+        } else if (r->event == CAPTURE_REPLY && !is_heartbeat(events[e].payload) && last_request[r->conn_id] >= 0) {
+            ReplayEvent *request = &events[last_request[r->conn_id]];
+            request->reply = (int)e;
+            recorded_latency[num_recorded_latency++] = r->time_us - request->rec.time_us;
+            last_request[r->conn_id] = -1;
+        }
+    }
+    free(last_request);
+    return 0;
+}
+
+// Handles one message received on a replayed connection
+void handle_reply(ReplayConn *conn, const char *message, uint64_t now_us) {
+    if (is_heartbeat(message)) return;
+    if (conn->head == conn->tail) return; // Unsolicited, or the reply to an untracked request
+
+    unsigned slot = conn->head++ % REPLAY_MAX_INFLIGHT;
+    replay_latency[num_replay_latency++] = now_us - conn->sent_us[slot];
+    if (strcmp(message, events[conn->expected[slot]].payload) != 0) replies_differing++;
+}
+
+// Closes a replayed connection; requests still awaiting a reply are counted as missing
+void close_conn(ReplayConn *conn) {
+    if (conn->fd < 0) return;
+    close(conn->fd);
+    conn->fd = -1;
+    replies_missing += (int)(conn->tail - conn->head);
+    conn->head = conn->tail = 0;
+}
+
+// Reads whatever the server sent on a replayed connection
+void read_conn(ReplayConn *conn) {
+    char buffer[MAX_MSG_SIZE];
+    char message[MAX_MSG_SIZE + 1];
+    ssize_t n = read(conn->fd, buffer, sizeof(buffer));
+    if (n <= 0 || message_buffer_append(&conn->rx, buffer, (size_t)n) < 0) {
+        close_conn(conn);
+        return;
+    }
+    uint64_t now_us = monotonic_us();
+    while (message_buffer_next(&conn->rx, message, sizeof(message))) {
+        handle_reply(conn, message, now_us);
+    }
+}
+
+// Waits up to timeout_ms for server data and processes it. Returns the number of open connections.
+int poll_conns(int timeout_ms) {
+    static struct pollfd *fds = NULL;
+    static uint32_t *ids = NULL;
+    if (fds == NULL) {
+        fds = malloc(num_conns * sizeof(fds[0]));
+        ids = malloc(num_conns * sizeof(ids[0]));
+    }
+
+    int n = 0;
+    for (uint32_t c = 0; c < num_conns; c++) {
+        if (conns[c].fd < 0) continue;
+        fds[n].fd = conns[c].fd;
+        fds[n].events = POLLIN;
+        ids[n++] = c;
+    }
+    if (poll(fds, (nfds_t)n, timeout_ms) > 0) {
+        for (int k = 0; k < n; k++) {
+            if (fds[k].revents & (POLLIN | POLLHUP | POLLERR)) read_conn(&conns[ids[k]]);
+        }
+    }
+    return n;
+}
+
+// Applies one captured event to the server
+void replay_event(size_t e, const char *server_ip, int client_port, int peer_port) {
+    ReplayEvent *ev = &events[e];
+    ReplayConn *conn = &conns[ev->rec.conn_id];
+
+    if (ev->rec.event == CAPTURE_OPEN ||
+        (ev->rec.event == CAPTURE_RECV && ev->rec.conn_id == CAPTURE_PEER_CONN && conn->fd < 0 && peer_port > 0)) {
+        // Peer traffic has no OPEN record: the peer link is opened by its first message
+        int port = ev->rec.conn_id == CAPTURE_PEER_CONN ? peer_port : client_port;
+        conn->fd = transport_connect(server_ip, port);
+        message_buffer_reset(&conn->rx);
+        conn->head = conn->tail = 0;
+        if (conn->fd < 0) failed_connections++;
+    }
+
+    if (ev->rec.event == CAPTURE_RECV) {
+        if (conn->fd < 0) {
+            unsent_messages++;
+            return;
+        }
+        char line[UINT16_MAX + 2];
+        size_t len = (size_t)snprintf(line, sizeof(line), "%s\n", ev->payload);
+        uint64_t now_us = monotonic_us();
+        if (write(conn->fd, line, len) != (ssize_t)len) {
+            unsent_messages++;
+            close_conn(conn);
+            return;
+        }
+        if (ev->reply >= 0 && conn->tail - conn->head < REPLAY_MAX_INFLIGHT) {
+            unsigned slot = conn->tail++ % REPLAY_MAX_INFLIGHT;
+            conn->sent_us[slot] = now_us;
+            conn->expected[slot] = ev->reply;
+        }
+    } else if (ev->rec.event == CAPTURE_CLOSE) {
+        // Replies the client read before closing in the recording are still in flight here
+        if (conn->fd >= 0 && conn->head != conn->tail) poll_conns(REPLAY_DRAIN_MS);
+        close_conn(conn);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 4) {
+        fprintf(stderr, "Usage: %s <capture_file> <server_ip> <client_port> [--fast] [--speed <x>] [--peer-port <p2p_port>]\n",
+                argv[0]);
+        fprintf(stderr, "  --fast              Send every message as soon as possible instead of at the recorded time.\n");
+        fprintf(stderr, "  --speed <x>         Play the recorded timing <x> times faster (default 1).\n");
+        fprintf(stderr, "  --peer-port <port>  Also replay the recorded peer messages on a connection to <port>.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    const char *capture_path = argv[1];
+    const char *server_ip = argv[2];
+    int client_port = atoi(argv[3]);
+    int fast = 0;
+    double speed = 1.0;
+    int peer_port = 0;
+    for (int a = 4; a < argc; a++) {
+        if (strcmp(argv[a], "--fast") == 0) {
+            fast = 1;
+        } else if (strcmp(argv[a], "--speed") == 0 && a + 1 < argc && atof(argv[a + 1]) > 0) {
+            speed = atof(argv[++a]);
+        } else if (strcmp(argv[a], "--peer-port") == 0 && a + 1 < argc && atoi(argv[a + 1]) > 0) {
+            peer_port = atoi(argv[++a]);
+        } else {
+            fprintf(stderr, "Error: Unknown option '%s'.\n", argv[a]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    char log_msg[200];
+    CaptureHeader header;
+    if (load_capture(capture_path, &header) < 0) {
+        fprintf(stderr, "Error: '%s' is not a readable capture file.\n", capture_path);
+        exit(EXIT_FAILURE);
+    }
+    if (num_conns == 0) num_conns = 1;
+    conns = calloc(num_conns, sizeof(conns[0]));
+    for (uint32_t c = 0; c < num_conns; c++) conns[c].fd = -1;
+    replay_latency = malloc((num_events + 1) * sizeof(uint64_t));
+
+    size_t num_messages = 0;
+    uint32_t num_clients = 0;
+    for (size_t e = 0; e < num_events; e++) {
+        if (events[e].rec.event == CAPTURE_RECV &&
+            (events[e].rec.conn_id != CAPTURE_PEER_CONN || peer_port > 0)) num_messages++;
+        if (events[e].rec.event == CAPTURE_OPEN) num_clients++;
+    }
+    uint64_t recorded_us = num_events > 0 ? events[num_events - 1].rec.time_us - events[0].rec.time_us : 0;
+
+    sprintf(log_msg, "Replaying %s capture: %zu messages on %u client connections, recorded over %.3f s.",
+            header.role, num_messages, num_clients, recorded_us / 1e6);
+    log_info(log_msg);
+
+    uint64_t start_us = monotonic_us();
+    uint64_t first_us = num_events > 0 ? events[0].rec.time_us : 0;
+    for (size_t e = 0; e < num_events; e++) {
+        if (events[e].rec.conn_id == CAPTURE_PEER_CONN && peer_port == 0) continue;
+        if (!fast) {
+            uint64_t due_us = start_us + (uint64_t)((events[e].rec.time_us - first_us) / speed);
+            for (uint64_t now_us = monotonic_us(); now_us < due_us; now_us = monotonic_us()) {
+                poll_conns((int)((due_us - now_us + 999) / 1000));
+            }
+        }
+        replay_event(e, server_ip, client_port, peer_port);
+        if (fast) poll_conns(0);
+    }
+    uint64_t sent_us = monotonic_us();
+
+    // Wait for the replies still in flight
+    uint64_t drain_deadline_ms = monotonic_ms() + REPLAY_DRAIN_MS;
+    for (;;) {
+        int awaiting = 0;
+        for (uint32_t c = 0; c < num_conns; c++) {
+            if (conns[c].fd >= 0 && conns[c].head != conns[c].tail) awaiting = 1;
+        }
+        uint64_t now_ms = monotonic_ms();
+        if (!awaiting || now_ms >= drain_deadline_ms) break;
+        poll_conns((int)(drain_deadline_ms - now_ms));
+    }
+    uint64_t replay_us = monotonic_us() - start_us;
+    for (uint32_t c = 0; c < num_conns; c++) close_conn(&conns[c]);
+
+    double recorded_rate = recorded_us > 0 ? num_messages / (recorded_us / 1e6) : 0;
+    double replay_rate = sent_us > start_us ? num_messages / ((sent_us - start_us) / 1e6) : 0;
+    sprintf(log_msg, "Recorded throughput: %.1f msg/s. Replay throughput: %.1f msg/s (%.2fx), finished in %.3f s.",
+            recorded_rate, replay_rate, recorded_rate > 0 ? replay_rate / recorded_rate : 0, replay_us / 1e6);
+    log_info(log_msg);
+    report_latency("Recorded reply latency (server-side)", recorded_latency, num_recorded_latency);
+    report_latency("Replay reply latency (client-side)", replay_latency, num_replay_latency);
+    sprintf(log_msg, "Replies missing: %d, differing from the recording: %d. Failed connections: %d, unsent messages: %d.",
+            replies_missing, replies_differing, failed_connections, unsent_messages);
+    log_info(log_msg);
+
+    for (size_t e = 0; e < num_events; e++) free(events[e].payload);
+    free(events);
+    free(conns);
+    free(recorded_latency);
+    free(replay_latency);
+    return 0;
+}
@@ -0,0 +1,17 @@
+#include "riskrules.h"
+#include <math.h>
+
+int risk_rules_enabled(const RiskRules *rules) {
+    return rules->has_max || rules->has_min || rules->has_rate;
+}
+
+// Sets alert[i] to 1 if a rule fires for sensor i, 0 otherwise
+void risk_rules_evaluate(const RiskRules *rules, const float *value, const float *rate, size_t n, uint8_t *alert) {
+    // Disabled rules get bounds no reading can cross
+    float max_value = rules->has_max ? rules->max_value : INFINITY;
+    float min_value = rules->has_min ? rules->min_value : -INFINITY;
+    float max_rate = rules->has_rate ? rules->max_rate : INFINITY;
+    for (size_t i = 0; i < n; i++) {
+        alert[i] = value[i] > max_value || value[i] < min_value || fabsf(rate[i]) > max_rate;
+    }
+}
@@ -0,0 +1,20 @@
+#ifndef RISKRULES_H
+#define RISKRULES_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Risk rules over sensor readings, kept in columns (one array per field, indexed by sensor).
+// A sensor is at risk when any enabled rule fires:
+//   value > max_value, value < min_value, |rate of change per second| > max_rate.
+typedef struct {
+    int has_max, has_min, has_rate;
+    float max_value;
+    float min_value;
+    float max_rate;
+} RiskRules;
+
+int risk_rules_enabled(const RiskRules *rules);
+void risk_rules_evaluate(const RiskRules *rules, const float *value, const float *rate, size_t n, uint8_t *alert);
+
+#endif // RISKRULES_H
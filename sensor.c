@@ -1,44 +1,136 @@
 #include "common.h"
-#include <ctype.h> // For isdigit
+#include "trace.h"
 #include <time.h>  // For rand
+#include <errno.h>
+#include <sys/select.h>
+
+#define MAX_SL_REPLICAS 4 // Read replicas of the SL a sensor can spread its queries over
 
 // ID received from the servers
 char my_sensor_id[MAX_PIDS_LENGTH] = "";
 int initial_loc_id = -1;
 
+// Partial messages received from each server
+MessageBuffer ss_rx;
+MessageBuffer sl_rx;
+
+// Read replicas of the SL (--sl-replica): 'locate' and 'diagnose' rotate over the SL and these
+int sl_replica_fds[MAX_SL_REPLICAS];
+MessageBuffer sl_replica_rx[MAX_SL_REPLICAS];
+int num_sl_replicas = 0;
+unsigned next_sl_reader = 0;
+
+// Tracing (--trace <file>): every request sent over TCP starts a new trace, and the servers
+// tag their work and their reply with its trace ID
+const char *trace_path = NULL;
+uint64_t pending_trace_id = 0;
+uint64_t pending_trace_start_us = 0;
+int pending_trace_code = 0;
+
+// Backpressure: a BACKOFF_HINT from an overloaded server holds back the next command until the
+// pause it asks for is over, so scripted senders slow down with the server. The main loop keeps
+// answering heartbeats while a command waits.
+uint64_t backoff_until_ms[FD_SETSIZE];
+
+// Sends a request to a server, starting a new trace when tracing is enabled
+ssize_t send_request(int sockfd, const char *msg) {
+    if (trace_path == NULL) return write(sockfd, msg, strlen(msg));
+
+    char traced[MAX_MSG_SIZE + TRACE_PREFIX_LEN];
+    pending_trace_id = trace_new_id();
+    pending_trace_code = atoi(msg);
+    trace_prefix(traced, sizeof(traced), pending_trace_id, msg);
+    pending_trace_start_us = monotonic_us();
+    return write(sockfd, traced, strlen(traced));
+}
+
+// Answers a REQ_HEARTBEAT from a server. Returns 1 if the message was a heartbeat (request or reply).
+int handle_heartbeat(int sockfd, const char *message) {
+    int code;
+    char payload[MAX_MSG_SIZE];
+    if (!parse_message(message, &code, payload, sizeof(payload))) return 0;
+    if (code == REQ_HEARTBEAT) {
+        char reply[MAX_MSG_SIZE];
+        build_control_message(reply, sizeof(reply), RES_HEARTBEAT, NULL);
+        if (write(sockfd, reply, strlen(reply)) < 0) {
+            log_error("Failed to send RES_HEARTBEAT");
+        }
+        return 1;
+    }
+    return code == RES_HEARTBEAT;
+}
+
+// Records a BACKOFF_HINT from a server. Returns 1 if the message was one.
+int handle_backoff_hint(int sockfd, const char *message) {
+    char log_msg[150];
+    int code;
+    char payload[MAX_MSG_SIZE];
+    if (!parse_message(message, &code, payload, sizeof(payload)) || code != BACKOFF_HINT) return 0;
+
+    int pause_ms = atoi(payload);
+    if (pause_ms > 0 && sockfd >= 0 && sockfd < FD_SETSIZE) {
+        backoff_until_ms[sockfd] = monotonic_ms() + (uint64_t)pause_ms;
+        sprintf(log_msg, "Server overloaded: next request delayed by %d ms.", pause_ms);
+        log_info(log_msg);
+    }
+    return 1;
+}
+
+// Blocks until the next message from a server that is not a heartbeat or a backoff hint.
+// Returns the message length, 0 if the server closed the connection, or -1 on error.
+ssize_t read_server_message(int sockfd, MessageBuffer *rx, char *out, size_t out_size) {
+    ssize_t len;
+    while ((len = read_message(sockfd, rx, out, out_size)) > 0 &&
+           (handle_heartbeat(sockfd, out) || handle_backoff_hint(sockfd, out))) {
+    }
+    if (len > 0 && out[0] == TRACE_PREFIX_CHAR) {
+        uint64_t trace_id = trace_strip(out);
+        if (trace_id != 0 && trace_id == pending_trace_id) {
+            trace_span(trace_id, "request", pending_trace_code, pending_trace_start_us, monotonic_us());
+            pending_trace_id = 0;
+        }
+        len = (ssize_t)strlen(out);
+    }
+    return len;
+}
+
+// Handles unsolicited data from a server while the sensor is idle (heartbeats, backoff hints).
+// Returns 0 if the server closed the connection or failed, 1 otherwise.
+int service_server_socket(const char *server_type_name, int sockfd, MessageBuffer *rx) {
+    char buffer[MAX_MSG_SIZE];
+    char message[MAX_MSG_SIZE + 1];
+    char log_msg[150];
+
+    ssize_t bytes_read = read(sockfd, buffer, sizeof(buffer));
+    if (bytes_read <= 0 || message_buffer_append(rx, buffer, bytes_read) < 0) {
+        sprintf(log_msg, "%s server closed the connection.", server_type_name);
+        log_info(log_msg);
+        return 0;
+    }
+    while (message_buffer_next(rx, message, sizeof(message))) {
+        if (!handle_heartbeat(sockfd, message) && !handle_backoff_hint(sockfd, message)) {
+            sprintf(log_msg, "Unexpected message from %s server: '%s'", server_type_name, message);
+            log_info(log_msg);
+        }
+    }
+    return 1;
+}
+
 // Connects to a server (SS or SL) and gets the sensor ID
 int connect_and_get_id(const char *server_type_name, const char *server_ip, int server_port,
                        int loc_id,                      // Sensor's location ID
                        char *id_storage,                // Where the server-confirmed ID will be stored
-                       const char *sensor_id_to_send) { // Sensor ID to be sent in REQ_CONNSEN
+                       const char *sensor_id_to_send,   // Sensor ID to be sent in REQ_CONNSEN
+                       MessageBuffer *rx) {             // Receive buffer of this connection
     int sockfd;
-    struct sockaddr_in serv_addr;
     char buffer[MAX_MSG_SIZE + 1];                // Buffer for building and receiving messages
     char log_msg[150];                            // Buffer for log messages
     char payload_for_req_connsen[MAX_MSG_SIZE];   // Buffer for the composite REQ_CONNSEN payload
 
-    // Create and connect the socket
-    if ((sockfd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-        sprintf(log_msg, "Failed to create socket for %s", server_type_name);
-        log_error(log_msg);
-        return -1;
-    }
-
-    serv_addr.sin_family = AF_INET;          // IPv4 address family
-    serv_addr.sin_port = htons(server_port); // Server port
-    // Convert the server IP address
-    if (inet_pton(AF_INET, server_ip, &serv_addr.sin_addr) <= 0) {
-        sprintf(log_msg, "Invalid IP address for %s", server_type_name);
-        log_error(log_msg);
-        close(sockfd);
-        return -1;
-    }
-
-    // Connect to the server
-    if (connect(sockfd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0) {
+    // Create and connect the socket (TCP, or Unix domain for "unix:<path>" addresses)
+    if ((sockfd = transport_connect(server_ip, server_port)) < 0) {
         sprintf(log_msg, "Failed to connect to %s server (%s:%d)", server_type_name, server_ip, server_port);
         log_error(log_msg);
-        close(sockfd);
         return -1;
     }
     sprintf(log_msg, "Connected to %s server (%s:%d).", server_type_name, server_ip, server_port);
@@ -58,7 +150,7 @@ int connect_and_get_id(const char *server_type_name, const char *server_ip, int
     sprintf(log_msg, "Sending REQ_CONNSEN to %s", server_type_name);
     log_info(log_msg);
 
-    if (write(sockfd, buffer, strlen(buffer)) < 0) {
+    if (send_request(sockfd, buffer) < 0) {
         sprintf(log_msg, "Failed to send REQ_CONNSEN to %s", server_type_name);
         log_error(log_msg);
         close(sockfd);
@@ -66,9 +158,9 @@ int connect_and_get_id(const char *server_type_name, const char *server_ip, int
     }
 
     // Wait for and process RES_CONNSEN(SlotID)
-    ssize_t bytes_read = read(sockfd, buffer, MAX_MSG_SIZE);
+    message_buffer_reset(rx);
+    ssize_t bytes_read = read_server_message(sockfd, rx, buffer, sizeof(buffer));
     if (bytes_read > 0) {
-        buffer[bytes_read] = '\0';
         int code;
         char received_payload[MAX_PIDS_LENGTH]; // To store the received SlotID
 
@@ -111,10 +203,73 @@ int connect_and_get_id(const char *server_type_name, const char *server_ip, int
 }
 
 
+// Connects to an SL read replica given as "<ip>:<port>" or "unix:<path>".
+// Replicas only serve queries, so no registration is needed. Returns the socket, or -1 on failure.
+int connect_sl_replica(const char *address) {
+    char host[MAX_MSG_SIZE];
+    int port = 0;
+    snprintf(host, sizeof(host), "%s", address);
+    if (!transport_is_unix(host)) {
+        char *colon = strrchr(host, ':');
+        if (colon == NULL) return -1;
+        *colon = '\0';
+        port = atoi(colon + 1);
+    }
+    return transport_connect(host, port);
+}
+
+// Picks the connection for the next read query, rotating over the SL and its live replicas.
+// Sets *rx to the receive buffer of the chosen connection.
+int pick_sl_reader(int sl_fd, MessageBuffer **rx) {
+    for (int tries = 0; tries <= num_sl_replicas; tries++) {
+        unsigned k = next_sl_reader++ % (unsigned)(num_sl_replicas + 1);
+        if (k == 0) break;
+        if (sl_replica_fds[k - 1] > 0) {
+            *rx = &sl_replica_rx[k - 1];
+            return sl_replica_fds[k - 1];
+        }
+    }
+    *rx = &sl_rx;
+    return sl_fd;
+}
+
+// Stops using a replica whose connection failed; its queries go to the others from now on
+void drop_sl_replica(int fd) {
+    char log_msg[150];
+    for (int k = 0; k < num_sl_replicas; k++) {
+        if (sl_replica_fds[k] == fd) {
+            sprintf(log_msg, "Lost SL read replica #%d. Sending its queries elsewhere.", k + 1);
+            log_info(log_msg);
+            close(fd);
+            sl_replica_fds[k] = -1;
+        }
+    }
+}
+
+// Returns when the next command may be sent: the end of the longest pause a server connection asked for
+uint64_t next_command_at_ms(int ss_fd, int sl_fd) {
+    int fds[2 + MAX_SL_REPLICAS] = { ss_fd, sl_fd };
+    int num_fds = 2;
+    for (int k = 0; k < num_sl_replicas; k++) fds[num_fds++] = sl_replica_fds[k];
+
+    uint64_t at_ms = 0;
+    for (int k = 0; k < num_fds; k++) {
+        if (fds[k] >= 0 && fds[k] < FD_SETSIZE && backoff_until_ms[fds[k]] > at_ms) at_ms = backoff_until_ms[fds[k]];
+    }
+    return at_ms;
+}
+
 int main(int argc, char *argv[]) {
     if (argc < 5) {
-        fprintf(stderr, "Usage: %s <ss_server_ip> <ss_port> <sl_server_ip> <sl_port>\n", argv[0]);
+        fprintf(stderr, "Usage: %s <ss_server_ip> <ss_port> <sl_server_ip> <sl_port> [--udp] [--trace <file>]\n"
+                        "       [--sl-replica <ip>:<port>]... [--seed <n>]\n", argv[0]);
         fprintf(stderr, "Example: ./sensor 127.0.0.1 61000 127.0.0.1 62000\n");
+        fprintf(stderr, "  Server IPs may be given as unix:<path> for co-located servers (the port is then ignored).\n");
+        fprintf(stderr, "  --udp  Send 'check failure' and 'locate' queries as UDP datagrams.\n");
+        fprintf(stderr, "  --trace <file>  Trace every TCP request and export the spans to <file> (Chrome JSON) on exit.\n");
+        fprintf(stderr, "  --seed <n>  Seed of the random sensor ID, for reproducible runs (time and PID by default).\n");
+        fprintf(stderr, "  --sl-replica <ip>:<port>  Spread 'locate' and 'diagnose' over this SL read replica too\n");
+        fprintf(stderr, "                            (up to %d; unix:<path> is accepted as well).\n", MAX_SL_REPLICAS);
         exit(EXIT_FAILURE);
     }
 
@@ -123,26 +278,41 @@ int main(int argc, char *argv[]) {
     char *sl_ip = argv[3];
     int sl_port = atoi(argv[4]);
 
+    int use_udp = 0;
+    const char *sl_replica_addrs[MAX_SL_REPLICAS];
+    uint64_t seed = 0;
+    int seed_given = 0;
+    for (int a = 5; a < argc; a++) {
+        if (strcmp(argv[a], "--udp") == 0) {
+            use_udp = 1;
+        } else if (strcmp(argv[a], "--trace") == 0 && a + 1 < argc) {
+            trace_path = argv[++a];
+            trace_enable("sensor");
+        } else if (strcmp(argv[a], "--seed") == 0 && a + 1 < argc) {
+            seed = strtoull(argv[++a], NULL, 10);
+            seed_given = 1;
+        } else if (strcmp(argv[a], "--sl-replica") == 0 && a + 1 < argc && num_sl_replicas < MAX_SL_REPLICAS) {
+            sl_replica_addrs[num_sl_replicas++] = argv[++a];
+        } else {
+            fprintf(stderr, "Error: Unknown option '%s'.\n", argv[a]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
     // Generate random Sensor ID (10 digits)
-    srand((unsigned int)time(NULL)); // Seed the random number generator
+    rng_seed(seed_given ? seed : (uint64_t)time(NULL) ^ ((uint64_t)getpid() << 32));
     for (size_t i = 0; i < 10; ++i) {
-        my_sensor_id[i] = '0' + (rand() % 10); // Generate a random digit
+        my_sensor_id[i] = '0' + rng_below(10); // Generate a random digit
     }
     my_sensor_id[10] = '\0'; // Null-terminate the string
 
     char log_msg[150];
 
     // Validate Sensor ID
-    if (strlen(my_sensor_id) != 10) {
+    if (sensor_id_parse(my_sensor_id) == SENSOR_KEY_NONE) {
         fprintf(stderr, "Error: SENSOR_ID must be exactly 10 numeric characters long.\n");
         exit(EXIT_FAILURE);
     }
-    for (size_t i = 0; i < 10; ++i) {
-        if (!isdigit((unsigned char)my_sensor_id[i])) {
-            fprintf(stderr, "Error: SENSOR_ID must contain only numeric digits.\n");
-            exit(EXIT_FAILURE);
-        }
-    }
 
     sprintf(log_msg, "Sensor initialized with ID: %s", my_sensor_id);
     log_info(log_msg);
@@ -153,14 +323,14 @@ int main(int argc, char *argv[]) {
     char confirmed_slot_id_sl[MAX_PIDS_LENGTH];
 
     // Connect to Status Server (SS)
-    ss_fd = connect_and_get_id("SS", ss_ip, ss_port, initial_loc_id, confirmed_slot_id_ss, my_sensor_id);
+    ss_fd = connect_and_get_id("SS", ss_ip, ss_port, initial_loc_id, confirmed_slot_id_ss, my_sensor_id, &ss_rx);
     if (ss_fd < 0) {
         log_info("Could not get Slot ID from Status Server. Shutting down.");
         exit(EXIT_FAILURE);
     }
 
     // Connect to Location Server (SL)
-    sl_fd = connect_and_get_id("SL", sl_ip, sl_port, initial_loc_id, confirmed_slot_id_sl, my_sensor_id);
+    sl_fd = connect_and_get_id("SL", sl_ip, sl_port, initial_loc_id, confirmed_slot_id_sl, my_sensor_id, &sl_rx);
     if (sl_fd < 0) {
         log_info("Could not get Slot ID from Location Server. Shutting down.");
         if (ss_fd > 0) close(ss_fd);
@@ -175,19 +345,110 @@ int main(int argc, char *argv[]) {
         exit(EXIT_FAILURE);
     }
 
+    // Read replicas of the SL
+    for (int k = 0; k < num_sl_replicas; k++) {
+        sl_replica_fds[k] = connect_sl_replica(sl_replica_addrs[k]);
+        message_buffer_reset(&sl_replica_rx[k]);
+        if (sl_replica_fds[k] < 0) {
+            sprintf(log_msg, "Failed to connect to SL read replica %s. Not using it.", sl_replica_addrs[k]);
+            log_error(log_msg);
+        } else {
+            sprintf(log_msg, "Connected to SL read replica %s.", sl_replica_addrs[k]);
+            log_info(log_msg);
+        }
+    }
+
+    // Optional UDP socket for status/location queries
+    int udp_fd = -1;
+    struct sockaddr_in ss_udp_addr, sl_udp_addr;
+    if (use_udp && (transport_is_unix(ss_ip) || transport_is_unix(sl_ip))) {
+        log_info("UDP fast path needs TCP server addresses. Using the stream connections instead.");
+    } else if (use_udp) {
+        memset(&ss_udp_addr, 0, sizeof(ss_udp_addr));
+        memset(&sl_udp_addr, 0, sizeof(sl_udp_addr));
+        ss_udp_addr.sin_family = AF_INET;
+        ss_udp_addr.sin_port = htons(ss_port);
+        sl_udp_addr.sin_family = AF_INET;
+        sl_udp_addr.sin_port = htons(sl_port);
+        if (inet_pton(AF_INET, ss_ip, &ss_udp_addr.sin_addr) <= 0 ||
+            inet_pton(AF_INET, sl_ip, &sl_udp_addr.sin_addr) <= 0 ||
+            (udp_fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
+            log_error("Failed to set up UDP queries. Falling back to TCP");
+            udp_fd = -1;
+        } else {
+            log_info("UDP fast path enabled for status and location queries.");
+        }
+    }
+
     log_info("OK(02)");
     log_info("Initial handshake with SS and SL completed.");
     sprintf(log_msg, "Sensor slot ID %s confirmed by both SS and SL.", confirmed_slot_id_ss);
     log_info(log_msg);
 
     // Main loop for user commands
-    printf("Enter commands ('check failure', 'locate <SensorID>', 'diagnose <LocID>', 'kill' to exit):\n");
+    printf("Enter commands ('check failure', 'locate <SensorID>', 'diagnose <LocID>', 'move <LocID>', 'reading <value>', 'history <SensorID> <risk|location|reading> [minutes]', 'summary', 'alerts [LocID|Region]', 'kill' to exit):\n");
+    // Commands are read from stdin through a message buffer so the loop can also
+    // wait on the server sockets and answer their heartbeats while idle
     char command_line[MAX_MSG_SIZE];
-    while (fgets(command_line, sizeof(command_line), stdin) != NULL) {
-        command_line[strcspn(command_line, "\n")] = 0; // Remove newline
+    MessageBuffer stdin_rx;
+    message_buffer_reset(&stdin_rx);
+    int stdin_eof = 0;
+    int have_command = 0;
+    while (1) {
+        if (!have_command) have_command = message_buffer_next(&stdin_rx, command_line, sizeof(command_line));
+        // A command waits out a server's backoff here rather than in a sleep, so heartbeats are still answered
+        uint64_t now_ms = monotonic_ms();
+        uint64_t send_at_ms = have_command ? next_command_at_ms(ss_fd, sl_fd) : 0;
+        if (!have_command || send_at_ms > now_ms) {
+            if (!have_command && stdin_eof) break;
+
+            fd_set read_fds;
+            FD_ZERO(&read_fds);
+            if (!have_command) FD_SET(STDIN_FILENO, &read_fds);
+            FD_SET(ss_fd, &read_fds);
+            FD_SET(sl_fd, &read_fds);
+            int max_fd = ss_fd > sl_fd ? ss_fd : sl_fd;
+            for (int k = 0; k < num_sl_replicas; k++) {
+                if (sl_replica_fds[k] <= 0) continue;
+                FD_SET(sl_replica_fds[k], &read_fds);
+                if (sl_replica_fds[k] > max_fd) max_fd = sl_replica_fds[k];
+            }
+            uint64_t wait_ms = have_command ? send_at_ms - now_ms : 0;
+            struct timeval tv = { .tv_sec = (time_t)(wait_ms / 1000), .tv_usec = (suseconds_t)(wait_ms % 1000) * 1000 };
+            if (select(max_fd + 1, &read_fds, NULL, NULL, have_command ? &tv : NULL) < 0) {
+                if (errno == EINTR) continue;
+                log_error("select() error.");
+                break;
+            }
+            if ((FD_ISSET(ss_fd, &read_fds) && !service_server_socket("SS", ss_fd, &ss_rx)) ||
+                (FD_ISSET(sl_fd, &read_fds) && !service_server_socket("SL", sl_fd, &sl_rx))) {
+                log_info("Lost connection to the servers. Shutting down sensor.");
+                break;
+            }
+            for (int k = 0; k < num_sl_replicas; k++) {
+                int fd = sl_replica_fds[k];
+                if (fd > 0 && FD_ISSET(fd, &read_fds) && !service_server_socket("SL replica", fd, &sl_replica_rx[k])) {
+                    drop_sl_replica(fd);
+                }
+            }
+            if (FD_ISSET(STDIN_FILENO, &read_fds)) {
+                char input[MAX_MSG_SIZE];
+                ssize_t bytes_read = read(STDIN_FILENO, input, sizeof(input));
+                if (bytes_read <= 0) {
+                    stdin_eof = 1;
+                    message_buffer_append(&stdin_rx, "\n", 1); // Flush a last line without newline
+                } else if (message_buffer_append(&stdin_rx, input, bytes_read) < 0) {
+                    log_error("Command too long.");
+                    message_buffer_reset(&stdin_rx);
+                }
+            }
+            continue;
+        }
+        have_command = 0;
+
         char sensor_log_msg[150];
         char msg_buffer[MAX_MSG_SIZE];
-        char response_buffer[MAX_MSG_SIZE];
+        char response_buffer[MAX_MSG_SIZE + 1];
 
         if (strcmp(command_line, "kill") == 0) {
             log_info("'kill' command received. Disconnecting from SS and SL servers...");
@@ -197,10 +458,10 @@ int main(int argc, char *argv[]) {
                 sprintf(sensor_log_msg, "Sending REQ_DISCSEN (Slot ID: %s) to SS...", confirmed_slot_id_ss);
                 log_info(sensor_log_msg);
                 build_control_message(msg_buffer, sizeof(msg_buffer), REQ_DISCSEN, confirmed_slot_id_ss);
-                if (write(ss_fd, msg_buffer, strlen(msg_buffer)) < 0) {
+                if (send_request(ss_fd, msg_buffer) < 0) {
                     log_error("Failed to send REQ_DISCSEN to SS");
                 } else {
-                    read(ss_fd, response_buffer, sizeof(response_buffer) - 1); // Read response, but don't strictly need to process it for 'kill'
+                    read_server_message(ss_fd, &ss_rx, response_buffer, sizeof(response_buffer)); // Read response, but don't strictly need to process it for 'kill'
                     log_info("Received disconnect confirmation from SS.");
                 }
                 close(ss_fd);
@@ -212,10 +473,10 @@ int main(int argc, char *argv[]) {
                 sprintf(sensor_log_msg, "Sending REQ_DISCSEN (Slot ID: %s) to SL...", confirmed_slot_id_sl);
                 log_info(sensor_log_msg);
                 build_control_message(msg_buffer, sizeof(msg_buffer), REQ_DISCSEN, confirmed_slot_id_sl);
-                if (write(sl_fd, msg_buffer, strlen(msg_buffer)) < 0) {
+                if (send_request(sl_fd, msg_buffer) < 0) {
                     log_error("Failed to send REQ_DISCSEN to SL");
                 } else {
-                    read(sl_fd, response_buffer, sizeof(response_buffer) - 1);
+                    read_server_message(sl_fd, &sl_rx, response_buffer, sizeof(response_buffer));
                     log_info("Received disconnect confirmation from SL.");
                 }
                 close(sl_fd);
@@ -228,11 +489,20 @@ int main(int argc, char *argv[]) {
             if (ss_fd > 0) {
                 sprintf(sensor_log_msg, "Sending REQ_SENSSTATUS (Slot ID: %s) to SS...", confirmed_slot_id_ss);
                 log_info(sensor_log_msg);
-                build_control_message(msg_buffer, sizeof(msg_buffer), REQ_SENSSTATUS, confirmed_slot_id_ss);
-                if (write(ss_fd, msg_buffer, strlen(msg_buffer)) < 0) {
+                if (udp_fd >= 0) {
+                    // UDP queries authenticate with the slot and sensor ID of the TCP registration
+                    char payload_udp[MAX_MSG_SIZE];
+                    snprintf(payload_udp, sizeof(payload_udp), "%s,%s", confirmed_slot_id_ss, my_sensor_id);
+                    build_control_message(msg_buffer, sizeof(msg_buffer), REQ_SENSSTATUS, payload_udp);
+                } else {
+                    build_control_message(msg_buffer, sizeof(msg_buffer), REQ_SENSSTATUS, confirmed_slot_id_ss);
+                }
+                if (udp_fd < 0 && send_request(ss_fd, msg_buffer) < 0) {
                     log_error("Failed to send REQ_SENSSTATUS to SS");
                 } else {
-                    ssize_t bytes_read = read(ss_fd, response_buffer, sizeof(response_buffer) - 1);
+                    ssize_t bytes_read = (udp_fd >= 0)
+                        ? udp_query(udp_fd, &ss_udp_addr, msg_buffer, response_buffer, sizeof(response_buffer))
+                        : read_server_message(ss_fd, &ss_rx, response_buffer, sizeof(response_buffer));
                     if (bytes_read > 0) {
                         response_buffer[bytes_read] = '\0';
                         int code; char payload[MAX_MSG_SIZE];
@@ -241,21 +511,15 @@ int main(int argc, char *argv[]) {
                                 int loc_id = atoi(payload);
                                 if (loc_id == -1) {
                                     log_info("Normal status reported for the sensor.");
-                                } else if (loc_id >= 1 && loc_id <= 3) {
-                                    sprintf(sensor_log_msg, "Alert received from location: %d (Norte)", loc_id);
-                                    log_info(sensor_log_msg);
-                                } else if (loc_id >= 4 && loc_id <= 5) {
-                                    sprintf(sensor_log_msg, "Alert received from location: %d (Sul)", loc_id);
-                                    log_info(sensor_log_msg);
-                                } else if (loc_id >= 6 && loc_id <= 7) {
-                                    sprintf(sensor_log_msg, "Alert received from location: %d (Leste)", loc_id);
-                                    log_info(sensor_log_msg);
-                                } else if (loc_id >= 8 && loc_id <= 10) {
-                                    sprintf(sensor_log_msg, "Alert received from location: %d (Oeste)", loc_id);
+                                } else if (location_region(loc_id) >= 0) {
+                                    sprintf(sensor_log_msg, "Alert received from location: %d (%s)",
+                                            loc_id, region_name(location_region(loc_id)));
                                     log_info(sensor_log_msg);
                                 } else {
                                     log_error("Received invalid location ID from SS.");
                                 }
+                            } else if (code == ERROR_MSG && atoi(payload) == REPLICA_NOT_SYNCED) {
+                                log_info("SS has not synchronized sensor locations with the SL yet. Try again later.");
                             } else {
                                 log_info("Received error or unexpected response from SS.");
                             }
@@ -266,14 +530,25 @@ int main(int argc, char *argv[]) {
         } else if (strncmp(command_line, "locate ", strlen("locate ")) == 0) {
             char target_sensor_id[MAX_PIDS_LENGTH];
             if (sscanf(command_line, "locate %49s", target_sensor_id) == 1) {
-                if (sl_fd > 0) {
-                    sprintf(sensor_log_msg, "Sending REQ_SENSLOC for sensor '%s' to SL...", target_sensor_id);
+                MessageBuffer *reader_rx;
+                int reader_fd = pick_sl_reader(sl_fd, &reader_rx);
+                if (reader_fd > 0) {
+                    sprintf(sensor_log_msg, "Sending REQ_SENSLOC for sensor '%s' to %s...", target_sensor_id,
+                            reader_fd == sl_fd ? "SL" : "SL replica");
                     log_info(sensor_log_msg);
-                    build_control_message(msg_buffer, sizeof(msg_buffer), REQ_SENSLOC, target_sensor_id);
-                    if (write(sl_fd, msg_buffer, strlen(msg_buffer)) < 0) {
+                    if (udp_fd >= 0) {
+                        char payload_udp[MAX_MSG_SIZE];
+                        snprintf(payload_udp, sizeof(payload_udp), "%s,%s,%s", confirmed_slot_id_sl, my_sensor_id, target_sensor_id);
+                        build_control_message(msg_buffer, sizeof(msg_buffer), REQ_SENSLOC, payload_udp);
+                    } else {
+                        build_control_message(msg_buffer, sizeof(msg_buffer), REQ_SENSLOC, target_sensor_id);
+                    }
+                    if (udp_fd < 0 && send_request(reader_fd, msg_buffer) < 0) {
                         log_error("Failed to send REQ_SENSLOC to SL");
                     } else {
-                        ssize_t bytes_read = read(sl_fd, response_buffer, sizeof(response_buffer) - 1);
+                        ssize_t bytes_read = (udp_fd >= 0)
+                            ? udp_query(udp_fd, &sl_udp_addr, msg_buffer, response_buffer, sizeof(response_buffer))
+                            : read_server_message(reader_fd, reader_rx, response_buffer, sizeof(response_buffer));
                         if (bytes_read > 0) {
                             response_buffer[bytes_read] = '\0';
                             int code; char payload[MAX_MSG_SIZE];
@@ -287,6 +562,8 @@ int main(int argc, char *argv[]) {
                                     log_info("Received error or unexpected response from SL for REQ_SENSLOC.");
                                 }
                             } else { log_error("Failed to parse response from SL for REQ_SENSLOC"); }
+                        } else if (udp_fd < 0 && reader_fd != sl_fd) {
+                            drop_sl_replica(reader_fd);
                         } else { log_error("Failed to read response from SL or disconnected"); }
                     }
                 }
@@ -294,17 +571,20 @@ int main(int argc, char *argv[]) {
         } else if (strncmp(command_line, "diagnose ", strlen("diagnose ")) == 0) {
             int target_loc_id;
             if (sscanf(command_line, "diagnose %d", &target_loc_id) == 1) {
-                if (sl_fd > 0) {
+                MessageBuffer *reader_rx;
+                int reader_fd = pick_sl_reader(sl_fd, &reader_rx);
+                if (reader_fd > 0) {
                     char payload_req_loclist[MAX_MSG_SIZE];
                     snprintf(payload_req_loclist, sizeof(payload_req_loclist), "%s,%d", confirmed_slot_id_sl, target_loc_id);
                     
-                    sprintf(sensor_log_msg, "Sending REQ_LOCLIST for location %d to SL...", target_loc_id);
+                    sprintf(sensor_log_msg, "Sending REQ_LOCLIST for location %d to %s...", target_loc_id,
+                            reader_fd == sl_fd ? "SL" : "SL replica");
                     log_info(sensor_log_msg);
                     build_control_message(msg_buffer, sizeof(msg_buffer), REQ_LOCLIST, payload_req_loclist);
-                    if (write(sl_fd, msg_buffer, strlen(msg_buffer)) < 0) {
+                    if (send_request(reader_fd, msg_buffer) < 0) {
                         log_error("Failed to send REQ_LOCLIST to SL");
                     } else {
-                        ssize_t bytes_read = read(sl_fd, response_buffer, sizeof(response_buffer) - 1);
+                        ssize_t bytes_read = read_server_message(reader_fd, reader_rx, response_buffer, sizeof(response_buffer));
                         if (bytes_read > 0) {
                             response_buffer[bytes_read] = '\0';
                             int code; char payload[MAX_MSG_SIZE];
@@ -318,18 +598,195 @@ int main(int argc, char *argv[]) {
                                     log_info("Received error or unexpected response from SL.");
                                 }
                             } else { log_error("Failed to parse response from SL for REQ_LOCLIST"); }
+                        } else if (reader_fd != sl_fd) {
+                            drop_sl_replica(reader_fd);
                         } else { log_error("Failed to read response from SL or disconnected"); }
                     }
                 }
             }
+        } else if (strncmp(command_line, "move ", strlen("move ")) == 0) {
+            // Location reports are fire-and-forget; the SL only answers errors, which the
+            // select loop logs as they arrive
+            int new_loc_id;
+            if (sscanf(command_line, "move %d", &new_loc_id) == 1 && new_loc_id >= 1 && new_loc_id <= NUM_LOCATIONS) {
+                char loc_str[12];
+                sprintf(loc_str, "%d", new_loc_id);
+                build_control_message(msg_buffer, sizeof(msg_buffer), REQ_LOCUPDATE, loc_str);
+                if (sl_fd <= 0 || send_request(sl_fd, msg_buffer) < 0) {
+                    log_error("Failed to send REQ_LOCUPDATE to SL");
+                } else {
+                    sprintf(sensor_log_msg, "Reported location %d to SL.", new_loc_id);
+                    log_info(sensor_log_msg);
+                }
+            } else {
+                sprintf(sensor_log_msg, "Invalid location. Use 'move <LocID>' with LocID from 1 to %d.", NUM_LOCATIONS);
+                log_info(sensor_log_msg);
+            }
+        } else if (strncmp(command_line, "reading ", strlen("reading ")) == 0) {
+            // Measurements are fire-and-forget like location reports; the SS only answers errors
+            char value_str[32];
+            char *end;
+            if (sscanf(command_line, "reading %31s", value_str) == 1 && (strtof(value_str, &end), *end == '\0')) {
+                build_control_message(msg_buffer, sizeof(msg_buffer), REQ_READING, value_str);
+                if (ss_fd <= 0 || send_request(ss_fd, msg_buffer) < 0) {
+                    log_error("Failed to send REQ_READING to SS");
+                } else {
+                    sprintf(sensor_log_msg, "Reported reading %s to SS.", value_str);
+                    log_info(sensor_log_msg);
+                }
+            } else {
+                log_info("Invalid reading. Use 'reading <value>' with a number.");
+            }
+        } else if (strncmp(command_line, "history ", strlen("history ")) == 0) {
+            // Locations are asked to the SL, risk and readings to the SS. A response holds as many points
+            // as fit in one message; the next page starts after the last timestamp received.
+            char target_sensor_id[MAX_PIDS_LENGTH];
+            char metric[16];
+            int minutes = 60;
+            int fields = sscanf(command_line, "history %49s %15s %d", target_sensor_id, metric, &minutes);
+            int to_sl = fields >= 2 && strcmp(metric, "location") == 0;
+            int server_fd = to_sl ? sl_fd : ss_fd;
+            if (fields < 2 || minutes <= 0 ||
+                (!to_sl && strcmp(metric, "risk") != 0 && strcmp(metric, "reading") != 0)) {
+                log_info("Invalid history. Use 'history <SensorID> <risk|location|reading> [minutes]'.");
+            } else if (server_fd > 0) {
+                unsigned long long from_ms = wall_clock_ms() - (unsigned long long)minutes * 60000;
+                int received = 0;
+                for (;;) {
+                    char payload_req[MAX_MSG_SIZE];
+                    snprintf(payload_req, sizeof(payload_req), "%s,%s,%llu,0", target_sensor_id, metric, from_ms);
+                    build_control_message(msg_buffer, sizeof(msg_buffer), REQ_HISTORY, payload_req);
+                    if (send_request(server_fd, msg_buffer) < 0) {
+                        log_error("Failed to send REQ_HISTORY");
+                        break;
+                    }
+                    ssize_t bytes_read = read_server_message(server_fd, to_sl ? &sl_rx : &ss_rx,
+                                                             response_buffer, sizeof(response_buffer));
+                    int code; char payload[MAX_MSG_SIZE];
+                    if (bytes_read <= 0) {
+                        log_error("Failed to read response or disconnected");
+                        break;
+                    }
+                    if (!parse_message(response_buffer, &code, payload, sizeof(payload)) || code != RES_HISTORY) {
+                        if (received == 0) {
+                            sprintf(sensor_log_msg, "No %s history of sensor '%s' in the last %d minute(s).",
+                                    metric, target_sensor_id, minutes);
+                            log_info(sensor_log_msg);
+                        }
+                        break;
+                    }
+                    // "<ts>:<value>,..." oldest first
+                    int page_points = 0;
+                    char *save_ptr = NULL;
+                    for (char *entry = strtok_r(payload, ",", &save_ptr); entry != NULL;
+                         entry = strtok_r(NULL, ",", &save_ptr)) {
+                        unsigned long long ts;
+                        char value[32];
+                        if (sscanf(entry, "%llu:%31s", &ts, value) != 2) continue;
+                        time_t seconds = (time_t)(ts / 1000);
+                        struct tm tm_local;
+                        char when[32];
+                        localtime_r(&seconds, &tm_local);
+                        strftime(when, sizeof(when), "%H:%M:%S", &tm_local);
+                        snprintf(sensor_log_msg, sizeof(sensor_log_msg), "%s %s.%03llu %s = %s",
+                                 target_sensor_id, when, ts % 1000, metric, value);
+                        log_info(sensor_log_msg);
+                        from_ms = ts + 1;
+                        page_points++;
+                    }
+                    if (page_points == 0) break;
+                    received += page_points;
+                }
+            }
+        } else if (strcmp(command_line, "summary") == 0) {
+            // Alert counts are only known to the SS
+            if (ss_fd > 0) {
+                log_info("Sending REQ_REGIONSUM to SS...");
+                build_control_message(msg_buffer, sizeof(msg_buffer), REQ_REGIONSUM, NULL);
+                if (send_request(ss_fd, msg_buffer) < 0) {
+                    log_error("Failed to send REQ_REGIONSUM to SS");
+                } else {
+                    ssize_t bytes_read = read_server_message(ss_fd, &ss_rx, response_buffer, sizeof(response_buffer));
+                    int code; char payload[MAX_MSG_SIZE];
+                    if (bytes_read > 0 && parse_message(response_buffer, &code, payload, sizeof(payload)) &&
+                        code == RES_REGIONSUM) {
+                        // One entry per region: "<Region>,<sensors>,<alerts>,<loc>:<sensors>:<alerts>,..."
+                        char *save_ptr = NULL;
+                        for (char *entry = strtok_r(payload, ";", &save_ptr); entry != NULL;
+                             entry = strtok_r(NULL, ";", &save_ptr)) {
+                            char name[20];
+                            int sensors, alerts, consumed = 0;
+                            if (sscanf(entry, "%19[^,],%d,%d%n", name, &sensors, &alerts, &consumed) == 3) {
+                                snprintf(sensor_log_msg, sizeof(sensor_log_msg), "%s: %d sensors, %d alerts (loc:sensors:alerts %s)",
+                                         name, sensors, alerts, entry[consumed] == ',' ? entry + consumed + 1 : "-");
+                                log_info(sensor_log_msg);
+                            }
+                        }
+                    } else if (bytes_read > 0) {
+                        log_info("Received error or unexpected response from SS for REQ_REGIONSUM.");
+                    } else { log_error("Failed to read response from SS or disconnected"); }
+                }
+            }
+        } else if (strcmp(command_line, "alerts") == 0 || strncmp(command_line, "alerts ", strlen("alerts ")) == 0) {
+            // The SS knows which sensors are in alert and where they are, so one request lists them all
+            char filter[20] = "";
+            if (sscanf(command_line, "alerts %19s", filter) < 1) filter[0] = '\0';
+            if (ss_fd > 0) {
+                log_info("Sending REQ_ALERTLIST to SS...");
+                build_control_message(msg_buffer, sizeof(msg_buffer), REQ_ALERTLIST, filter);
+                if (send_request(ss_fd, msg_buffer) < 0) {
+                    log_error("Failed to send REQ_ALERTLIST to SS");
+                } else {
+                    ssize_t bytes_read = read_server_message(ss_fd, &ss_rx, response_buffer, sizeof(response_buffer));
+                    int code = 0; char payload[MAX_MSG_SIZE];
+                    if (bytes_read > 0 && parse_message(response_buffer, &code, payload, sizeof(payload)) &&
+                        code == RES_ALERTLIST) {
+                        // "<count>;<SensorID>:<LocId>,..."
+                        char *list = strchr(payload, ';');
+                        int count = atoi(payload), listed = 0;
+                        char *save_ptr = NULL;
+                        for (char *entry = list != NULL ? strtok_r(list + 1, ",", &save_ptr) : NULL; entry != NULL;
+                             entry = strtok_r(NULL, ",", &save_ptr)) {
+                            char alert_sensor_id[MAX_PIDS_LENGTH];
+                            int loc_id;
+                            if (sscanf(entry, "%49[^:]:%d", alert_sensor_id, &loc_id) == 2) {
+                                const char *region = region_name(location_region(loc_id));
+                                if (loc_id == 0) { // The SS's replica does not hold the sensor yet
+                                    snprintf(sensor_log_msg, sizeof(sensor_log_msg), "Sensor %s in alert (location not known yet)",
+                                             alert_sensor_id);
+                                } else {
+                                    snprintf(sensor_log_msg, sizeof(sensor_log_msg), "Sensor %s in alert at location %d (%s)",
+                                             alert_sensor_id, loc_id, region != NULL ? region : "?");
+                                }
+                                log_info(sensor_log_msg);
+                                listed++;
+                            }
+                        }
+                        snprintf(sensor_log_msg, sizeof(sensor_log_msg), "%d sensor(s) in alert%s.", count,
+                                 listed < count ? " (list truncated)" : "");
+                        log_info(sensor_log_msg);
+                    } else if (bytes_read > 0 && code == ERROR_MSG && atoi(payload) == INVALID_PAYLOAD_ERROR) {
+                        log_info("Invalid filter. Use 'alerts [LocID|Region]'.");
+                    } else if (bytes_read > 0) {
+                        log_info("Received error or unexpected response from SS for REQ_ALERTLIST.");
+                    } else { log_error("Failed to read response from SS or disconnected"); }
+                }
+            }
         } else {
             log_info("Unknown command.");
         }
-        printf("Enter commands ('check failure', 'locate <SensorID>', 'diagnose <LocID>', 'kill' to exit):\n");
+        printf("Enter commands ('check failure', 'locate <SensorID>', 'diagnose <LocID>', 'move <LocID>', 'reading <value>', 'history <SensorID> <risk|location|reading> [minutes]', 'summary', 'alerts [LocID|Region]', 'kill' to exit):\n");
     }
 
     if (ss_fd > 0) close(ss_fd);
     if (sl_fd > 0) close(sl_fd);
+    for (int k = 0; k < num_sl_replicas; k++) {
+        if (sl_replica_fds[k] > 0) close(sl_replica_fds[k]);
+    }
+    if (udp_fd >= 0) close(udp_fd);
+    if (trace_path != NULL && trace_export_chrome(trace_path) < 0) {
+        log_error("Failed to write trace file");
+    }
     log_info("Sensor shut down.");
     return 0;
 }
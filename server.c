@@ -1,10 +1,68 @@
+#define _GNU_SOURCE // For accept4
 #include "common.h"
+#include "uring.h"
+#include "timerwheel.h"
+#include "capture.h"
+#include "trace.h"
+#include "shmring.h"
+#include "export.h"
+#include "p2pthread.h"
+#include "riskrules.h"
+#include "tsdb.h"
 #include <sys/select.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/wait.h>
+#include <math.h>
 
 #define MAX_CLIENTS 15  // Maximum number of clients per server
 
-int peer_socket_fd = -1; // Active P2P connection socket
+#define TIMER_TICK_MS 100               // Resolution of the timer wheel
+#define CLIENT_IDLE_TIMEOUT_MS 30000    // Silence after which a sensor is sent REQ_HEARTBEAT
+#define PEER_IDLE_TIMEOUT_MS 15000      // Silence after which the peer is sent REQ_HEARTBEAT
+#define HEARTBEAT_TIMEOUT_MS 10000      // Time to answer a REQ_HEARTBEAT before being dropped
+#define P2P_REQUEST_TIMEOUT_MS 5000     // Time for the peer to answer a handshake or disconnect request
+#define MAX_PEERS 4                     // SL: SS peers connected at once (the SS has a single peer)
+
+#define SENSOR_INDEX_SIZE 64            // Buckets of the sensor ID index (power of two, > 2 * MAX_CLIENTS)
+#define UDP_GRANT_SIZE 256              // Sensors remembered as allowed to query over UDP (power of two)
+#define RISK_FEED_MAX_BATCH 32768       // Largest risk update batch accepted in one datagram
+#define RISK_FEED_MAX_BATCHES 64        // Batches drained per wakeup, so clients are not starved
+
+#define REPL_LOG_SIZE 256               // Registry changes the SL keeps for incremental resyncs
+#define REPLICA_SIZE 64                 // Buckets of the SS / SLR location replica (power of two)
+#define PRIMARY_RETRY_MS 1000           // SLR: delay between attempts to reach the primary SL
+#define LOCATION_FLUSH_MS TIMER_TICK_MS // SL: REQ_LOCUPDATEs of one sensor within this window become one move
+#define RISK_EVAL_MS TIMER_TICK_MS      // SS: period of the risk rules over the latest readings
+#define LOCLIST_CACHE_ENTRIES 4         // SL, SLR: serialized REQ_LOCLIST responses kept (LRU across locations)
+#define HISTORY_POOL_BLOCKS 16384       // Time-series blocks (256 bytes each) shared by all sensor histories
+#define HISTORY_SENSORS (2 * MAX_CLIENTS) // Sensors with a history, kept after they disconnect
+#define HISTORY_MAX_POINTS 40           // Points decoded for one REQ_HISTORY (more than fit in a response)
+
+#define ACCEPT_BATCH 64                 // Connections accepted per wakeup of the client listener
+#define ADMISSION_TABLE_SIZE 1024       // Token buckets for source addresses (power of two)
+#define ADMISSION_DEFAULT_RATE 10       // Connections per second allowed from one source address
+#define ADMISSION_DEFAULT_BURST 30      // Connections one source address may open at once
+
+#define REQUEST_QUEUE_SIZE 1024         // Pending client requests per class (power of two)
+#define REQUEST_BUDGET 128              // Query and bulk requests served per loop iteration
+#define CLIENT_QUEUE_LIMIT 64           // Queued requests after which a client's socket is not read
+#define CLIENT_TX_BUFFER 8192           // Reply bytes held for a client whose socket buffer is full
+#define MAX_REPL_SUBSCRIBERS 4          // SL: read replicas streaming registry changes at once
+#define QUERY_WEIGHT 4                  // Queries served for each bulk request while both classes wait
+#define SHED_DEFAULT_DEADLINE_MS 200    // Queue delay after which bulk requests are answered ERROR(11)
+#define BACKOFF_DEFAULT_DELAY_MS 50     // Average queue delay from which clients are sent BACKOFF_HINT
+#define BACKOFF_QUEUE_DEPTH 256         // Queued queries and bulk requests from which clients are sent BACKOFF_HINT
+#define BACKOFF_MIN_MS 100              // Shortest and longest pause a BACKOFF_HINT asks for
+#define BACKOFF_MAX_MS 5000
+
+#define URING_ENTRIES 256         // Submission queue size of the io_uring backend
+#define URING_RECV_BUFFERS 64     // Provided receive buffers (power of two)
+#define URING_SEND_BUFFERS 128    // Outgoing message buffers awaiting send completion
+#define URING_BUFFER_GROUP 1      // Buffer group ID of the provided receive buffers
+#define URING_CONTROL_FDS (5 + 3 * MAX_PEERS + MAX_REPL_SUBSCRIBERS) // Descriptors served by readiness: stdin,
+                                                                     // listeners, UDP, feed, 3 per peer, replicas
 
 // P2P connection state
 typedef enum {
@@ -14,44 +72,3019 @@ typedef enum {
     P2P_REQ_SENT,
     P2P_RES_SENT_AWAITING_RES,
     P2P_FULLY_ESTABLISHED,
-    P2P_DISCONNECT_REQ_SENT
+    P2P_DISCONNECT_REQ_SENT,
+    NUM_P2P_STATES
 } P2PState;
 
-P2PState p2p_current_state = P2P_DISCONNECTED;
-char my_pids_for_peer[MAX_PIDS_LENGTH] = "";  // ID assigned by this server to the peer
-char peer_pids_for_me[MAX_PIDS_LENGTH] = "";  // ID assigned by peer to this server
+// Shared-memory P2P transport (--p2p-shm on both servers). Once the handshake completes, the SS offers
+// a link; after the SL accepts it, peer messages travel through the rings and the socket only
+// carries the handshake, disconnection and end-of-file detection.
+int p2p_shm_enabled = 0;
+
+// P2P link thread (--p2p-thread). Once the handshake completes, the thread owns the peer socket and
+// the link's shm becomes the reactor's end of an in-process link to it, so the reactor exchanges peer
+// messages through the rings and never blocks on (or is delayed by) the socket.
+int p2p_thread_enabled = 0;
+
+// P2P links. The SS has one link, to its SL; the SL serves up to MAX_PEERS SS peers at once, each with
+// its own handshake state, receive buffer, timer, replication subscription and transport.
+// A link is free while its socket_fd is -1.
+typedef struct {
+    int socket_fd;
+    P2PState state;
+    char my_pids[MAX_PIDS_LENGTH];    // ID assigned by this server to the peer
+    char peer_pids[MAX_PIDS_LENGTH];  // ID assigned by peer to this server
+    MessageBuffer rx;                 // Partial messages received from the peer
+    Timer timer;
+    int ping_pending;
+    int repl_subscribed;              // SL: the SS has synchronized and receives live changes
+    ShmLink shm;
+    int shm_active;                   // Messages to and from the peer go through shm
+    P2PThread thread;
+    int shm_handoff_fd;               // SS: handoff socket of the link being offered
+} PeerLink;
+
+PeerLink peer_links[MAX_PEERS];
+
+// Passive P2P listener, (re)opened whenever a link is free
+int peer_listen_fd = -1;
+const char *peer_listen_addr = NULL;
+int peer_port = 0;
 
 // Information about connected clients
 typedef struct {
+    uint64_t sensor_key;              // Packed 10-digit sensor ID, SENSOR_KEY_NONE until registered
     int socket_fd;
-    char client_id[MAX_PIDS_LENGTH];  // 10-digit sensor ID
     int assigned_slot;                // Slot (1 to 15)
     int location_id;                  // Location ID (used by SL)
     int risk_status;                  // Risk status (used by SS)
 } ClientInfo;
 
-ClientInfo connected_clients[MAX_CLIENTS];
-int num_connected_clients = 0;
+ClientInfo connected_clients[MAX_CLIENTS];
+int num_connected_clients = 0;
+int client_fds[MAX_CLIENTS];
+char client_addr_desc[MAX_CLIENTS][64]; // Remote address captured at accept time, for logging
+MessageBuffer client_rx[MAX_CLIENTS];   // Partial messages received from each client
+// Replies the non-blocking client socket did not take yet, written out when it becomes writable.
+// A client that lets CLIENT_TX_BUFFER bytes pile up is disconnected.
+char client_tx[MAX_CLIENTS][CLIENT_TX_BUFFER];
+size_t client_tx_len[MAX_CLIENTS];
+
+// Open-addressing hash index from sensor ID to slot index, kept in sync with registrations.
+// Entries hold slot + 1; 0 is an empty bucket and -1 a deleted one.
+int sensor_index[SENSOR_INDEX_SIZE];
+
+// UDP fast path credentials: the slot issued at each sensor's TCP registration, kept after its TCP
+// connection closes so the sensor can go on querying without holding it. Direct-mapped by sensor ID;
+// a colliding registration evicts the older grant. REQ_DISCSEN revokes the grant.
+typedef struct {
+    uint64_t sensor_key;
+    int slot;
+} UdpGrant;
+UdpGrant udp_grants[UDP_GRANT_SIZE];
+
+// Registered sensors and sensors in alert (risk 1) per location (1 to NUM_LOCATIONS) and per region,
+// updated on every registration, disconnection and risk change
+int location_sensor_count[NUM_LOCATIONS + 1];
+int location_alert_count[NUM_LOCATIONS + 1];
+int region_sensor_count[NUM_REGIONS];
+int region_alert_count[NUM_REGIONS];
+
+// Sensors in alert (SS): slot indexes of the registered sensors with risk status 1 as a dense list,
+// kept in sync with every risk change, so REQ_ALERTLIST only visits the sensors in alert
+int alert_slots[MAX_CLIENTS];
+int alert_slot_pos[MAX_CLIENTS];      // Position + 1 in alert_slots, 0 if not in alert
+int num_alert_slots = 0;
+
+// Sensor readings (SS): the latest REQ_READING sample of each slot and its rate of change per second,
+// in columns so the risk rules (--risk-max, --risk-min, --risk-rate) check all slots in one pass
+// every RISK_EVAL_MS. While rules are set, they decide the risk status of sensors that reported.
+float reading_value[MAX_CLIENTS];
+float reading_rate[MAX_CLIENTS];
+uint64_t reading_time_ms[MAX_CLIENTS];
+uint8_t reading_seen[MAX_CLIENTS];     // A reading arrived since the sensor registered
+uint8_t reading_alert[MAX_CLIENTS];    // Output of the last evaluation
+int readings_changed = 0;              // New readings since the last evaluation
+RiskRules risk_rules;
+Timer risk_eval_timer;
+
+// Sensor history (SS, SL): risk transitions, locations and readings as compressed time series with
+// wall-clock timestamps, queried with REQ_HISTORY. A history outlives the connection of its sensor so
+// incidents can be reviewed afterwards; a sensor registering again continues its history, and a new one
+// takes over the least recently updated history of a disconnected sensor. The block pool bounds memory:
+// once it is full, the oldest blocks are overwritten.
+enum { HISTORY_RISK, HISTORY_LOCATION, HISTORY_READING, HISTORY_METRICS };
+static const char *const history_metric_names[HISTORY_METRICS] = { "risk", "location", "reading" };
+
+typedef struct {
+    uint64_t sensor_key;              // SENSOR_KEY_NONE: unused entry
+    uint64_t updated_ms;
+    int attached;                     // The sensor is registered (its slot points here)
+    TsSeries series[HISTORY_METRICS];
+} SensorHistory;
+
+SensorHistory sensor_history[HISTORY_SENSORS];
+int client_history[MAX_CLIENTS];      // Index + 1 of the history of the sensor in the slot, 0 if none
+TsPool history_pool;
+
+// Sensors per location as doubly linked lists threaded through the client table, so a location change
+// is an O(1) unlink and relink and REQ_LOCLIST only visits the sensors at the location.
+// Links hold slot index + 1 (0 ends the list); bucket 0 collects locations outside 1 to NUM_LOCATIONS.
+int location_head[NUM_LOCATIONS + 1];
+int location_next[MAX_CLIENTS];
+int location_prev[MAX_CLIENTS];
+
+// REQ_LOCLIST responses (SL, SLR) are memoized as the serialized message. Every change of a location's
+// membership bumps its version, which makes a cached response stale; the least recently used response
+// is evicted when a location missing from the cache is queried.
+typedef struct {
+    int location_id;                  // 0: unused entry
+    unsigned version;                 // location_version[location_id] the response was built at
+    uint64_t last_used;
+    int count;                        // Sensors listed, 0 for the ERROR(10) response
+    char message[MAX_MSG_SIZE];
+} LocListCacheEntry;
+
+unsigned location_version[NUM_LOCATIONS + 1];
+LocListCacheEntry loclist_cache[LOCLIST_CACHE_ENTRIES];
+uint64_t loclist_cache_clock = 0;
+
+// REQ_LOCUPDATE coalescing (SL): updates are staged per slot and applied once per LOCATION_FLUSH_MS.
+// Queries only ever see applied locations, and a sensor reporting many times per window costs one move
+// and one replicated change.
+int pending_location[MAX_CLIENTS];      // Latest staged location, 0 if none
+Timer location_flush_timer;
+
+// SL->SS registry replication. The SL logs every registration and disconnection with a sequence
+// number and streams them to the SS, which keeps a read-only copy of sensor locations so alert
+// queries are answered locally. The epoch identifies one SL run, so a restarted SL forces a full resync.
+typedef struct {
+    uint64_t seq;
+    uint64_t sensor_key;
+    char op;                          // 'R' registered (or moved), 'D' disconnected
+    int location_id;
+} ReplDelta;
+
+ReplDelta repl_log[REPL_LOG_SIZE];    // SL: ring of the latest changes
+uint64_t repl_seq = 0;                // SL: sequence of the latest change
+unsigned repl_epoch = 0;
+
+// SL: read replicas subscribed to the change stream. A replica connects to the client port like a
+// sensor; serving its REQ_REPLSYNC moves the connection out of the client table into this one, so a
+// replica holds a sensor slot only until its first request and is then read and written from here.
+typedef struct {
+    int fd;                           // 0: unused entry
+    char addr_desc[64];
+    MessageBuffer rx;
+    char tx[CLIENT_TX_BUFFER];        // Changes the socket did not take yet
+    size_t tx_len;
+} ReplSubscriber;
+
+ReplSubscriber repl_subscribers[MAX_REPL_SUBSCRIBERS];
+
+typedef struct {
+    uint64_t sensor_key;
+    int location_id;                  // 0: empty bucket, -1: deleted entry
+} ReplicaEntry;
+
+ReplicaEntry replica[REPLICA_SIZE];   // SS, SLR: open-addressing table of the SL's sensor locations
+unsigned replica_epoch = 0;
+uint64_t replica_seq = 0;             // SS, SLR: sequence of the last change applied
+int replica_ready = 0;                // SS, SLR: a snapshot was received at least once
+
+// SL read replica (SLR): subscribes to the primary SL's change stream over a client connection
+// and answers REQ_SENSLOC and REQ_LOCLIST from its replica
+const char *primary_addr = NULL;
+int primary_port = 0;
+int primary_fd = -1;
+MessageBuffer primary_rx;
+Timer primary_retry_timer;
+
+// Timeouts: idle sensors are probed with REQ_HEARTBEAT and evicted if they stay silent,
+// and peer links are probed the same way or dropped if a pending request gets no answer.
+TimerWheel timer_wheel;
+Timer client_idle_timers[MAX_CLIENTS];
+int client_ping_pending[MAX_CLIENTS];
+uint64_t loop_now_ms = 0; // Time of the current loop iteration
+
+// Admission control: one token bucket per source IPv4 address, in a direct-mapped table
+// (an address colliding with another one takes its bucket over with a full bucket).
+// Tokens are counted in thousandths, so a rate of R connections/s refills R per millisecond.
+typedef struct {
+    uint32_t addr;
+    int64_t milli_tokens;
+    uint64_t last_refill_ms;
+    int in_use;
+} AdmissionBucket;
+
+AdmissionBucket admission_table[ADMISSION_TABLE_SIZE];
+int admission_rate = ADMISSION_DEFAULT_RATE;   // 0 disables admission control
+int admission_burst = ADMISSION_DEFAULT_BURST;
+int admission_rejected = 0;                    // Rejections not yet reported in the log
+Timer admission_report_timer;
+
+// Client requests are queued by class and served after each round of I/O: control requests
+// (registration, disconnection, heartbeats, replica subscriptions) all at once, then queries and
+// bulk requests (REQ_LOCLIST, REQ_REGIONSUM) by weighted round robin within REQUEST_BUDGET.
+// Requests left over wait for the next iteration, after the P2P link and new control requests were
+// served, and bulk requests that waited longer than shed_deadline_ms are shed with ERROR(11).
+// A client with CLIENT_QUEUE_LIMIT requests waiting is not read until some are served, so a flooding
+// client is slowed down by TCP flow control instead of filling the queues.
+typedef enum {
+    REQUEST_CLASS_CONTROL,
+    REQUEST_CLASS_QUERY,
+    REQUEST_CLASS_BULK,
+    NUM_REQUEST_CLASSES
+} RequestClass;
+
+typedef struct {
+    int slot;                     // Slot index of the client
+    uint32_t conn_id;             // Connection the request came from; the slot may be reused
+    uint64_t enqueued_us;
+    uint64_t trace_id;
+    char message[MAX_MSG_SIZE + 1];
+} QueuedRequest;
+
+typedef struct {
+    QueuedRequest entries[REQUEST_QUEUE_SIZE];
+    unsigned head;
+    unsigned tail;
+} RequestQueue;
+
+RequestQueue request_queues[NUM_REQUEST_CLASSES];
+int client_queued[MAX_CLIENTS];                  // Requests of each slot waiting in the queues
+int shed_deadline_ms = SHED_DEFAULT_DEADLINE_MS; // 0 disables shedding
+int requests_shed = 0;                           // Sheddings not yet reported in the log
+Timer shed_report_timer;
+
+// Backpressure: while served requests waited backoff_delay_ms on average, or BACKOFF_QUEUE_DEPTH
+// queries and bulk requests are queued, the reply to a query or bulk request is preceded by
+// BACKOFF_HINT "<ms>": twice the time the queues take to drain at the current loop latency, or twice
+// the average queue delay if longer. A client gets one hint per pause it was asked for, so senders
+// that honor it slow down before requests are shed, and the others are not flooded with hints.
+int backoff_delay_ms = BACKOFF_DEFAULT_DELAY_MS; // 0 disables the hints
+uint64_t queue_delay_avg_us = 0;                 // Moving average of the time served requests waited
+uint64_t loop_latency_avg_us = 0;                // Moving average of the duration of a loop iteration
+uint64_t client_backoff_until_ms[MAX_CLIENTS];   // End of the pause the client in each slot was last asked for
+int backoff_hints_sent = 0;                      // Hints not yet reported in the log
+int backoff_last_hint_ms = 0;
+Timer backoff_report_timer;
+
+// Wire capture (--capture <path>): inbound client and peer messages and client replies are recorded
+// for the replay tool. Each accepted connection gets a new ID, so reused slots are told apart.
+Capture capture;
+uint32_t client_conn_ids[MAX_CLIENTS];
+uint32_t next_conn_id = 1;
+Timer capture_flush_timer;
+
+// Tracing (--trace <file>): while a traced message is handled, its trace ID is propagated on
+// every reply and peer message sent, and its spans are exported to the file on exit or 'trace'.
+uint64_t current_trace_id = 0;
+uint64_t current_trace_start_us = 0;  // When the traced message was taken from the receive buffer
+const char *trace_path = NULL;
+
+// Registry export ('export' command): a forked child writes the copy-on-write image of the client
+// table, so the snapshot is point-in-time consistent and the event loop keeps serving meanwhile.
+uint64_t client_accepted_ms[MAX_CLIENTS];   // loop_now_ms when the connection in each slot was accepted
+pid_t export_pid = 0;                        // Running export child, 0 if none
+uint64_t export_started_ms = 0;
+Timer export_poll_timer;                     // Checks every tick whether the child has exited
+
+// Server roles
+typedef enum {
+    SERVER_TYPE_UNINITIALIZED,
+    SERVER_TYPE_STATUS,
+    SERVER_TYPE_LOCATION,
+    SERVER_TYPE_LOCATION_REPLICA
+} ServerRole;
+
+ServerRole current_server_role = SERVER_TYPE_UNINITIALIZED;
+
+// I/O backends: readiness polling with select() or completion-based io_uring
+typedef enum {
+    IO_BACKEND_SELECT,
+    IO_BACKEND_URING
+} IoBackend;
+
+IoBackend io_backend = IO_BACKEND_SELECT;
+
+// io_uring user_data layout: request type (8 bits) | generation (24 bits) | index (32 bits).
+// The generation of a client slot changes when its socket is closed, so late completions
+// from a previous connection in the same slot are ignored.
+typedef enum {
+    URING_OP_ACCEPT = 1,
+    URING_OP_RECV,
+    URING_OP_SEND,
+    URING_OP_POLL
+} UringOp;
+
+#define URING_USER_DATA(op, gen, index) \
+    (((uint64_t)(op) << 56) | ((uint64_t)((gen) & 0xFFFFFF) << 32) | (uint32_t)(index))
+#define URING_USER_OP(ud) ((int)((ud) >> 56))
+#define URING_USER_GEN(ud) ((unsigned)(((ud) >> 32) & 0xFFFFFF))
+#define URING_USER_INDEX(ud) ((int)((ud) & 0xFFFFFFFF))
+
+Uring uring;
+unsigned client_generation[MAX_CLIENTS];
+unsigned poll_generation = 0;
+char uring_send_buffers[URING_SEND_BUFFERS][MAX_MSG_SIZE];
+int uring_free_send_buffers[URING_SEND_BUFFERS];
+int uring_num_free_send_buffers = 0;
+int uring_last_send_fd = -1; // Socket of the most recently prepared SQE, if it was a send
+
+// Fibonacci hash of a packed sensor ID; the high bits mix all the digits
+static unsigned sensor_index_hash(uint64_t sensor_key) {
+    return (unsigned)((sensor_key * 0x9E3779B97F4A7C15ull) >> 32);
+}
+
+// Records that the sensor registered over TCP in the given slot (1 to MAX_CLIENTS)
+void udp_grant_issue(uint64_t sensor_key, int slot) {
+    UdpGrant *grant = &udp_grants[sensor_index_hash(sensor_key) & (UDP_GRANT_SIZE - 1)];
+    grant->sensor_key = sensor_key;
+    grant->slot = slot;
+}
+
+// Forgets the UDP grant of a sensor that unregistered
+void udp_grant_revoke(uint64_t sensor_key) {
+    UdpGrant *grant = &udp_grants[sensor_index_hash(sensor_key) & (UDP_GRANT_SIZE - 1)];
+    if (grant->sensor_key == sensor_key) *grant = (UdpGrant){0};
+}
+
+// Returns 1 if the sensor was issued this slot at its last TCP registration, whether or not it is still connected
+int udp_grant_valid(uint64_t sensor_key, int slot) {
+    if (sensor_key == SENSOR_KEY_NONE || slot < 1 || slot > MAX_CLIENTS) return 0;
+    const UdpGrant *grant = &udp_grants[sensor_index_hash(sensor_key) & (UDP_GRANT_SIZE - 1)];
+    return grant->sensor_key == sensor_key && grant->slot == slot;
+}
+
+// Returns the slot index of the registered sensor with this packed ID, or -1 if there is none.
+int sensor_index_find(uint64_t sensor_key) {
+    if (sensor_key == SENSOR_KEY_NONE) return -1;
+    unsigned bucket = sensor_index_hash(sensor_key) & (SENSOR_INDEX_SIZE - 1);
+    for (int probes = 0; probes < SENSOR_INDEX_SIZE && sensor_index[bucket] != 0; probes++) {
+        int k = sensor_index[bucket] - 1;
+        if (k >= 0 && connected_clients[k].sensor_key == sensor_key) return k;
+        bucket = (bucket + 1) & (SENSOR_INDEX_SIZE - 1);
+    }
+    return -1;
+}
+
+// Adds the sensor registered in slot index k to the index
+void sensor_index_insert(int k) {
+    unsigned bucket = sensor_index_hash(connected_clients[k].sensor_key) & (SENSOR_INDEX_SIZE - 1);
+    while (sensor_index[bucket] > 0) {
+        bucket = (bucket + 1) & (SENSOR_INDEX_SIZE - 1);
+    }
+    sensor_index[bucket] = k + 1;
+}
+
+// Removes the sensor registered in slot index k from the index
+void sensor_index_remove(int k) {
+    unsigned bucket = sensor_index_hash(connected_clients[k].sensor_key) & (SENSOR_INDEX_SIZE - 1);
+    for (int probes = 0; probes < SENSOR_INDEX_SIZE && sensor_index[bucket] != 0; probes++) {
+        if (sensor_index[bucket] == k + 1) {
+            // The bucket can be emptied outright when no probe sequence continues past it
+            int next = sensor_index[(bucket + 1) & (SENSOR_INDEX_SIZE - 1)];
+            sensor_index[bucket] = next == 0 ? 0 : -1;
+            return;
+        }
+        bucket = (bucket + 1) & (SENSOR_INDEX_SIZE - 1);
+    }
+}
+
+// Adjusts the aggregates of a sensor's location and region. Sensors outside the region table are not counted.
+void update_region_stats(int loc_id, int sensor_delta, int alert_delta) {
+    int region = location_region(loc_id);
+    if (region < 0) return;
+    location_sensor_count[loc_id] += sensor_delta;
+    location_alert_count[loc_id] += alert_delta;
+    region_sensor_count[region] += sensor_delta;
+    region_alert_count[region] += alert_delta;
+}
+
+// Adds the sensor in slot index k to the alert list or removes it, after its risk status or registration changed
+void alert_list_update(int k) {
+    int alerting = connected_clients[k].sensor_key != SENSOR_KEY_NONE && connected_clients[k].risk_status == 1;
+    if (alerting && alert_slot_pos[k] == 0) {
+        alert_slots[num_alert_slots++] = k;
+        alert_slot_pos[k] = num_alert_slots;
+    } else if (!alerting && alert_slot_pos[k] != 0) {
+        int last = alert_slots[--num_alert_slots];
+        alert_slots[alert_slot_pos[k] - 1] = last;
+        alert_slot_pos[last] = alert_slot_pos[k];
+        alert_slot_pos[k] = 0;
+    }
+}
+
+// Appends a point to a history series of the sensor registered in slot index k
+void history_record(int k, int metric, double value) {
+    if (client_history[k] == 0) return;
+    SensorHistory *history = &sensor_history[client_history[k] - 1];
+    history->updated_ms = wall_clock_ms();
+    ts_append(&history_pool, &history->series[metric], history->updated_ms, value);
+}
+
+// Attaches a history to the sensor just registered in slot index k: its own one if it is still kept,
+// else an unused entry or the least recently updated one of a disconnected sensor
+void history_attach(int k) {
+    int reuse = -1;
+    for (int h = 0; h < HISTORY_SENSORS; h++) {
+        if (sensor_history[h].sensor_key == connected_clients[k].sensor_key && !sensor_history[h].attached) {
+            reuse = h;
+            break;
+        }
+        if (sensor_history[h].attached) continue;
+        if (reuse < 0 || sensor_history[h].updated_ms < sensor_history[reuse].updated_ms) reuse = h;
+    }
+    if (reuse < 0) return; // Cannot happen: there are more entries than slots
+    SensorHistory *history = &sensor_history[reuse];
+    if (history->sensor_key != connected_clients[k].sensor_key) {
+        for (int m = 0; m < HISTORY_METRICS; m++) ts_series_clear(&history_pool, &history->series[m]);
+        history->sensor_key = connected_clients[k].sensor_key;
+    }
+    history->attached = 1;
+    client_history[k] = reuse + 1;
+}
+
+void history_detach(int k) {
+    if (client_history[k] != 0) sensor_history[client_history[k] - 1].attached = 0;
+    client_history[k] = 0;
+}
+
+// Builds the RES_HISTORY payload for a REQ_HISTORY payload. Only the blocks overlapping the range are
+// decoded. Returns 0 on success or the ERROR code to answer.
+int build_history_response(const char *request, char *out, size_t out_size) {
+    char sensor_id[MAX_PIDS_LENGTH];
+    char metric_name[16];
+    unsigned long long from_ms, to_ms;
+    char extra;
+    if (sscanf(request, "%49[^,],%15[^,],%llu,%llu%c", sensor_id, metric_name, &from_ms, &to_ms, &extra) != 4) {
+        return INVALID_PAYLOAD_ERROR;
+    }
+    uint64_t sensor_key = sensor_id_parse(sensor_id);
+    int metric = 0;
+    while (metric < HISTORY_METRICS && strcmp(metric_name, history_metric_names[metric]) != 0) metric++;
+    if (sensor_key == SENSOR_KEY_NONE || metric == HISTORY_METRICS) return INVALID_PAYLOAD_ERROR;
+    if (to_ms == 0) to_ms = UINT64_MAX;
+
+    const SensorHistory *history = NULL;
+    for (int h = 0; h < HISTORY_SENSORS && history == NULL; h++) {
+        if (sensor_history[h].sensor_key == sensor_key) history = &sensor_history[h];
+    }
+    if (history == NULL) return SENSOR_NOT_FOUND;
+
+    TsPoint points[HISTORY_MAX_POINTS];
+    size_t n = ts_query(&history->series[metric], from_ms, to_ms, points, HISTORY_MAX_POINTS);
+    if (n == 0) return SENSOR_NOT_FOUND;
+
+    // Whole entries only, leaving room for the code and the newline around the payload
+    size_t len = 0;
+    out[0] = '\0';
+    for (size_t p = 0; p < n; p++) {
+        char entry[48];
+        int entry_len = snprintf(entry, sizeof(entry), "%s%llu:%.7g", p > 0 ? "," : "",
+                                 (unsigned long long)points[p].ts, points[p].value);
+        if (len + (size_t)entry_len + 8 > out_size) break;
+        memcpy(out + len, entry, (size_t)entry_len + 1);
+        len += (size_t)entry_len;
+    }
+    return 0;
+}
+
+// Changes the risk status of the sensor in slot index k, keeping the alert counts in sync
+void set_sensor_risk(int k, int risk) {
+    if (connected_clients[k].risk_status != risk) history_record(k, HISTORY_RISK, risk);
+    int alert_delta = (risk == 1) - (connected_clients[k].risk_status == 1);
+    update_region_stats(connected_clients[k].location_id, 0, alert_delta);
+    connected_clients[k].risk_status = risk;
+    alert_list_update(k);
+}
+
+// Stores a reading of the sensor registered in slot index k (SS only)
+void record_reading(int k, float value) {
+    if (reading_seen[k]) {
+        // Two readings within the same millisecond give no usable rate: the previous one is kept
+        if (loop_now_ms > reading_time_ms[k]) {
+            reading_rate[k] = (value - reading_value[k]) * 1000.0f / (float)(loop_now_ms - reading_time_ms[k]);
+        }
+    } else {
+        reading_rate[k] = 0.0f;
+    }
+    reading_value[k] = value;
+    reading_time_ms[k] = loop_now_ms;
+    reading_seen[k] = 1;
+    readings_changed = 1;
+    history_record(k, HISTORY_READING, value);
+}
+
+// Runs the risk rules over the readings and updates the risk status of the sensors that reported
+void risk_eval_expired(Timer *timer, void *arg) {
+    char log_msg[150];
+    (void)arg;
+    timer_schedule(&timer_wheel, timer, loop_now_ms, RISK_EVAL_MS);
+    if (!readings_changed) return;
+    readings_changed = 0;
+
+    risk_rules_evaluate(&risk_rules, reading_value, reading_rate, MAX_CLIENTS, reading_alert);
+    for (int k = 0; k < MAX_CLIENTS; k++) {
+        if (!reading_seen[k] || connected_clients[k].sensor_key == SENSOR_KEY_NONE) continue;
+        if ((connected_clients[k].risk_status == 1) == reading_alert[k]) continue;
+
+        char sensor_id[SENSOR_ID_STR_SIZE];
+        sensor_id_format(connected_clients[k].sensor_key, sensor_id, sizeof(sensor_id));
+        sprintf(log_msg, "Risk rules: sensor %s status = %d (reading %.3f, rate %.3f/s).",
+                sensor_id, reading_alert[k], reading_value[k], reading_rate[k]);
+        log_info(log_msg);
+        set_sensor_risk(k, reading_alert[k]);
+    }
+}
+
+// Builds the RES_REGIONSUM payload from the aggregates, one ';'-separated entry per region:
+// "<Region>,<sensors>,<alerts>,<loc>:<sensors>:<alerts>,..." listing every location of the region.
+void build_region_summary(char *out, size_t out_size) {
+    size_t len = 0;
+    out[0] = '\0';
+    for (int region = 0; region < NUM_REGIONS; region++) {
+        len += snprintf(out + len, out_size - len, "%s%s,%d,%d", region > 0 ? ";" : "",
+                        region_name(region), region_sensor_count[region], region_alert_count[region]);
+        for (int loc_id = 1; loc_id <= NUM_LOCATIONS && len < out_size; loc_id++) {
+            if (location_region(loc_id) != region) continue;
+            len += snprintf(out + len, out_size - len, ",%d:%d:%d",
+                            loc_id, location_sensor_count[loc_id], location_alert_count[loc_id]);
+        }
+        if (len >= out_size) break;
+    }
+}
+
+static int location_bucket(int loc_id) {
+    return loc_id >= 1 && loc_id <= NUM_LOCATIONS ? loc_id : 0;
+}
+
+// Links the sensor registered in slot index k into the list of its location
+void location_index_insert(int k) {
+    int bucket = location_bucket(connected_clients[k].location_id);
+    location_version[bucket]++;
+    location_prev[k] = 0;
+    location_next[k] = location_head[bucket];
+    if (location_head[bucket] != 0) location_prev[location_head[bucket] - 1] = k + 1;
+    location_head[bucket] = k + 1;
+}
+
+// Unlinks the sensor registered in slot index k from the list of its location
+void location_index_remove(int k) {
+    location_version[location_bucket(connected_clients[k].location_id)]++;
+    if (location_prev[k] != 0) {
+        location_next[location_prev[k] - 1] = location_next[k];
+    } else {
+        location_head[location_bucket(connected_clients[k].location_id)] = location_next[k];
+    }
+    if (location_next[k] != 0) location_prev[location_next[k] - 1] = location_prev[k];
+    location_next[k] = location_prev[k] = 0;
+}
+
+void repl_publish(char op, int k);
+
+// Moves the sensor registered in slot index k to another location, keeping the location index,
+// the aggregates and (on the SL) the replicas in sync
+void move_sensor_location(int k, int loc_id) {
+    ClientInfo *client = &connected_clients[k];
+    if (client->location_id == loc_id) return;
+    int alert = client->risk_status == 1;
+    location_index_remove(k);
+    update_region_stats(client->location_id, -1, -alert);
+    client->location_id = loc_id;
+    location_index_insert(k);
+    update_region_stats(loc_id, 1, alert);
+    repl_publish('R', k);
+    history_record(k, HISTORY_LOCATION, loc_id);
+}
+
+// Applies the staged REQ_LOCUPDATEs (SL only)
+void location_flush_expired(Timer *timer, void *arg) {
+    (void)timer;
+    (void)arg;
+    for (int k = 0; k < MAX_CLIENTS; k++) {
+        if (pending_location[k] == 0) continue;
+        if (connected_clients[k].sensor_key != SENSOR_KEY_NONE) move_sensor_location(k, pending_location[k]);
+        pending_location[k] = 0;
+    }
+}
+
+// Stages a location change of the sensor in slot index k, replacing one staged earlier in the window
+void stage_location_update(int k, int loc_id) {
+    pending_location[k] = loc_id;
+    if (!timer_pending(&location_flush_timer)) {
+        timer_schedule(&timer_wheel, &location_flush_timer, loop_now_ms, LOCATION_FLUSH_MS);
+    }
+}
+
+// Returns the location of an active sensor, or -1 if it is not registered.
+int find_sensor_location(uint64_t sensor_key) {
+    int k = sensor_index_find(sensor_key);
+    return k >= 0 ? connected_clients[k].location_id : -1;
+}
+
+// Returns the link using the P2P socket fd, or NULL
+PeerLink *find_peer_link(int fd) {
+    for (int n = 0; n < MAX_PEERS; n++) {
+        if (fd > 0 && peer_links[n].socket_fd == fd) return &peer_links[n];
+    }
+    return NULL;
+}
+
+// Returns a link without a connection, or NULL if all are in use. Only the SL uses more than one.
+PeerLink *free_peer_link(void) {
+    int limit = current_server_role == SERVER_TYPE_LOCATION ? MAX_PEERS : 1;
+    for (int n = 0; n < limit; n++) {
+        if (peer_links[n].socket_fd <= 0) return &peer_links[n];
+    }
+    return NULL;
+}
+
+// Opens the passive P2P listener if it is not already open
+void start_passive_p2p_listener(void) {
+    char log_msg[150];
+
+    if (peer_listen_fd > 0 || free_peer_link() == NULL) return;
+    if ((peer_listen_fd = transport_listen(peer_listen_addr, peer_port, 1)) != -1) {
+        sprintf(log_msg, "Now listening for new P2P connections on port %d...", peer_port);
+        log_info(log_msg);
+    } else {
+        log_error("Failed to restart passive P2P listening.");
+    }
+}
+
+// Releases the shared-memory link of the peer, if any, after stopping the link thread that uses it
+void close_peer_shm(PeerLink *link) {
+    p2p_thread_stop(&link->thread);
+    if (link->shm_handoff_fd >= 0) close(link->shm_handoff_fd);
+    link->shm_handoff_fd = -1;
+    shm_link_close(&link->shm);
+    link->shm_active = 0;
+}
+
+// Closes the P2P socket, once the link thread (if any) has written out what was queued and let go of it
+void close_peer_socket(PeerLink *link) {
+    close_peer_shm(link);
+    if (link->socket_fd > 0) close(link->socket_fd);
+    link->socket_fd = -1;
+}
+
+// Closes the P2P connection and forgets the handshake state
+void reset_peer_connection(PeerLink *link) {
+    close_peer_socket(link);
+    link->state = P2P_DISCONNECTED;
+    link->my_pids[0] = '\0';
+    link->peer_pids[0] = '\0';
+    message_buffer_reset(&link->rx);
+    timer_cancel(&timer_wheel, &link->timer);
+    link->ping_pending = 0;
+}
+
+// Restarts the peer timer after activity on the P2P link: an established link is probed
+// when it goes idle, while a pending handshake or disconnect request must be answered in time.
+void refresh_peer_timer(PeerLink *link) {
+    link->ping_pending = 0;
+    if (link->socket_fd <= 0) {
+        timer_cancel(&timer_wheel, &link->timer);
+    } else if (link->state == P2P_FULLY_ESTABLISHED) {
+        timer_schedule(&timer_wheel, &link->timer, loop_now_ms, PEER_IDLE_TIMEOUT_MS);
+    } else {
+        timer_schedule(&timer_wheel, &link->timer, loop_now_ms, P2P_REQUEST_TIMEOUT_MS);
+    }
+}
+
+ssize_t send_to_peer(PeerLink *link, const char *msg);
+
+void peer_timer_expired(Timer *timer, void *arg) {
+    char log_msg[150];
+    PeerLink *link = arg;
+
+    if (link->socket_fd <= 0) return;
+
+    if (link->state == P2P_FULLY_ESTABLISHED && !link->ping_pending) {
+        char msg_out[MAX_MSG_SIZE];
+        build_control_message(msg_out, sizeof(msg_out), REQ_HEARTBEAT, NULL);
+        if (send_to_peer(link, msg_out) >= 0) {
+            link->ping_pending = 1;
+            timer_schedule(&timer_wheel, timer, loop_now_ms, HEARTBEAT_TIMEOUT_MS);
+            return;
+        }
+    }
+
+    sprintf(log_msg, "P2P peer %s timed out (state %d). Closing connection.", link->my_pids, link->state);
+    log_info(log_msg);
+    reset_peer_connection(link);
+    log_info("Switching to passive P2P listening...");
+    start_passive_p2p_listener();
+}
+
+// Writes handshake and disconnection messages on the socket, or through the link thread while it owns it
+static ssize_t peer_write_socket(PeerLink *link, const char *data, size_t len) {
+    if (!link->thread.running) return write(link->socket_fd, data, len);
+    if (shm_link_send(&link->shm, data, len) < 0) {
+        log_error("P2P link thread queue full. Message dropped.");
+        return -1;
+    }
+    return (ssize_t)len;
+}
+
+// Starts the link thread on the established peer socket (--p2p-thread)
+void start_peer_thread(PeerLink *link) {
+    close_peer_shm(link);
+    if (p2p_thread_start(&link->thread, link->socket_fd, &link->shm) < 0) {
+        log_error("Failed to start the P2P link thread. Staying in the event loop.");
+        return;
+    }
+    link->shm_active = 1;
+    log_info("P2P link handed over to its own thread.");
+}
+
+// Writes bytes to the peer through the shared-memory link when it is active, or the socket
+static ssize_t peer_write(PeerLink *link, const char *data, size_t len) {
+    if (!link->shm_active) return write(link->socket_fd, data, len);
+    if (shm_link_send(&link->shm, data, len) < 0) {
+        log_error("Shared-memory P2P ring full. Message dropped.");
+        return -1;
+    }
+    return (ssize_t)len;
+}
+
+// Writes a message to the peer, carrying the trace ID of the request being handled, if any
+ssize_t send_to_peer(PeerLink *link, const char *msg) {
+    if (current_trace_id == 0) return peer_write(link, msg, strlen(msg));
+
+    char traced[MAX_MSG_SIZE + TRACE_PREFIX_LEN];
+    trace_prefix(traced, sizeof(traced), current_trace_id, msg);
+    uint64_t start_us = monotonic_us();
+    ssize_t n = peer_write(link, traced, strlen(traced));
+    trace_span(current_trace_id, "peer send", atoi(msg), start_us, monotonic_us());
+    return n;
+}
+
+ssize_t send_to_client(int client_fd, const char *msg);
+int flush_tx(int fd, char *buf, size_t *len);
+
+// Returns the read replica subscribed on fd, or NULL
+ReplSubscriber *find_repl_subscriber(int fd) {
+    for (int n = 0; n < MAX_REPL_SUBSCRIBERS; n++) {
+        if (repl_subscribers[n].fd > 0 && repl_subscribers[n].fd == fd) return &repl_subscribers[n];
+    }
+    return NULL;
+}
+
+// Returns an unused read replica entry, or NULL if MAX_REPL_SUBSCRIBERS replicas are subscribed
+ReplSubscriber *free_repl_subscriber(void) {
+    for (int n = 0; n < MAX_REPL_SUBSCRIBERS; n++) {
+        if (repl_subscribers[n].fd <= 0) return &repl_subscribers[n];
+    }
+    return NULL;
+}
+
+// Closes the connection of a read replica and frees its entry
+void close_repl_subscriber(ReplSubscriber *sub) {
+    char log_msg[150];
+    sprintf(log_msg, "Read replica %s unsubscribed.", sub->addr_desc);
+    log_info(log_msg);
+    close(sub->fd);
+    sub->fd = 0;
+    sub->tx_len = 0;
+}
+
+// Queues a message for a read replica and writes out what its socket takes.
+// A replica that lets CLIENT_TX_BUFFER bytes pile up is shut down; the read side then closes it.
+ssize_t send_to_repl_subscriber(ReplSubscriber *sub, const char *msg) {
+    size_t len = strlen(msg);
+    if (sub->tx_len + len > CLIENT_TX_BUFFER) {
+        log_error("Read replica buffer full. Disconnecting the replica.");
+        shutdown(sub->fd, SHUT_RDWR);
+        return -1;
+    }
+    memcpy(sub->tx + sub->tx_len, msg, len);
+    sub->tx_len += len;
+    return flush_tx(sub->fd, sub->tx, &sub->tx_len) < 0 ? -1 : (ssize_t)len;
+}
+
+// Sends one replication message on a peer link, a read replica's connection or the primary's connection
+void repl_send(int fd, int code, const char *payload) {
+    char msg_out[MAX_MSG_SIZE];
+    build_control_message(msg_out, sizeof(msg_out), code, payload);
+    PeerLink *link = find_peer_link(fd);
+    ReplSubscriber *sub = link == NULL ? find_repl_subscriber(fd) : NULL;
+    ssize_t n = link != NULL ? send_to_peer(link, msg_out)
+              : sub != NULL ? send_to_repl_subscriber(sub, msg_out)
+              : send_to_client(fd, msg_out);
+    if (n < 0) {
+        log_error("Failed to send replication message.");
+    }
+}
+
+// Sends a logged registry change as REPL_DELTA "<seq>,<R|D>,<SensorID>,<LocId>"
+void repl_send_delta(int fd, const ReplDelta *delta) {
+    char payload[MAX_MSG_SIZE];
+    char sensor_id[SENSOR_ID_STR_SIZE];
+    sensor_id_format(delta->sensor_key, sensor_id, sizeof(sensor_id));
+    snprintf(payload, sizeof(payload), "%llu,%c,%s,%d", (unsigned long long)delta->seq, delta->op,
+             sensor_id, delta->location_id);
+    repl_send(fd, REPL_DELTA, payload);
+}
+
+// Records a registry change of the sensor in slot index k (SL only) and streams it to the synchronized SS
+// peers and to the subscribed read replicas.
+// op is 'R' for a registration or location change and 'D' for a disconnection.
+void repl_publish(char op, int k) {
+    if (current_server_role != SERVER_TYPE_LOCATION) return;
+
+    ReplDelta *delta = &repl_log[++repl_seq % REPL_LOG_SIZE];
+    delta->seq = repl_seq;
+    delta->op = op;
+    delta->sensor_key = connected_clients[k].sensor_key;
+    delta->location_id = connected_clients[k].location_id;
+
+    for (int n = 0; n < MAX_PEERS; n++) {
+        PeerLink *link = &peer_links[n];
+        if (link->repl_subscribed && link->socket_fd > 0 && link->state == P2P_FULLY_ESTABLISHED) {
+            repl_send_delta(link->socket_fd, delta);
+        }
+    }
+    for (int n = 0; n < MAX_REPL_SUBSCRIBERS; n++) {
+        if (repl_subscribers[n].fd > 0) repl_send_delta(repl_subscribers[n].fd, delta);
+    }
+}
+
+// Answers REQ_REPLSYNC "<epoch>,<last_seq>" from the SS or a read replica on fd (SL only).
+// If the replica follows this SL and the missing changes are still logged, only those are replayed;
+// otherwise the whole registry is sent as a snapshot of REPL_DELTA entries with sequence 0.
+// The caller subscribes fd to the live changes.
+void repl_serve_sync(int fd, const char *payload) {
+    char log_msg[150];
+    char payload_out[MAX_MSG_SIZE];
+    unsigned epoch = 0;
+    unsigned long long last_seq = 0;
+
+    if (sscanf(payload, "%u,%llu", &epoch, &last_seq) == 2 && epoch == repl_epoch &&
+        last_seq <= repl_seq && repl_seq - last_seq <= REPL_LOG_SIZE) {
+        sprintf(log_msg, "Replica resync: replaying changes %llu to %llu.", last_seq + 1, (unsigned long long)repl_seq);
+        log_info(log_msg);
+        snprintf(payload_out, sizeof(payload_out), "%u,%llu,I", repl_epoch, last_seq);
+        repl_send(fd, RES_REPLSYNC, payload_out);
+        for (uint64_t seq = last_seq + 1; seq <= repl_seq; seq++) {
+            repl_send_delta(fd, &repl_log[seq % REPL_LOG_SIZE]);
+        }
+    } else {
+        sprintf(log_msg, "Replica resync: sending full snapshot at change %llu.", (unsigned long long)repl_seq);
+        log_info(log_msg);
+        snprintf(payload_out, sizeof(payload_out), "%u,%llu,F", repl_epoch, (unsigned long long)repl_seq);
+        repl_send(fd, RES_REPLSYNC, payload_out);
+        for (int k = 0; k < MAX_CLIENTS; k++) {
+            if (connected_clients[k].socket_fd > 0 && connected_clients[k].sensor_key != SENSOR_KEY_NONE) {
+                ReplDelta entry = { .seq = 0, .sensor_key = connected_clients[k].sensor_key, .op = 'R',
+                                    .location_id = connected_clients[k].location_id };
+                repl_send_delta(fd, &entry);
+            }
+        }
+    }
+}
+
+// Finds the bucket holding the packed sensor ID in the replica, or -1
+int replica_find(uint64_t sensor_key) {
+    unsigned bucket = sensor_index_hash(sensor_key) & (REPLICA_SIZE - 1);
+    for (int probes = 0; probes < REPLICA_SIZE && replica[bucket].location_id != 0; probes++) {
+        if (replica[bucket].location_id > 0 && replica[bucket].sensor_key == sensor_key) return (int)bucket;
+        bucket = (bucket + 1) & (REPLICA_SIZE - 1);
+    }
+    return -1;
+}
+
+// Applies one registry change to the replica
+void replica_apply(char op, uint64_t sensor_key, int location_id) {
+    int bucket = replica_find(sensor_key);
+    if (bucket >= 0) location_version[location_bucket(replica[bucket].location_id)]++;
+    if (op == 'D') {
+        if (bucket >= 0) replica[bucket].location_id = -1;
+        return;
+    }
+    if (location_id <= 0) return;
+    location_version[location_bucket(location_id)]++;
+    if (bucket < 0) {
+        unsigned free_bucket = sensor_index_hash(sensor_key) & (REPLICA_SIZE - 1);
+        for (int probes = 0; probes < REPLICA_SIZE && replica[free_bucket].location_id > 0; probes++) {
+            free_bucket = (free_bucket + 1) & (REPLICA_SIZE - 1);
+        }
+        if (replica[free_bucket].location_id > 0) {
+            log_error("Location replica full.");
+            return;
+        }
+        bucket = (int)free_bucket;
+        replica[bucket].sensor_key = sensor_key;
+    }
+    replica[bucket].location_id = location_id;
+}
+
+// Asks the SL for the changes after the last one applied to the replica (SS and SLR).
+// The SS has a single peer link, the first one.
+void replica_request_sync(void) {
+    char payload[MAX_MSG_SIZE];
+    snprintf(payload, sizeof(payload), "%u,%llu", replica_epoch, (unsigned long long)replica_seq);
+    repl_send(current_server_role == SERVER_TYPE_LOCATION_REPLICA ? primary_fd : peer_links[0].socket_fd,
+              REQ_REPLSYNC, payload);
+}
+
+// Handles RES_REPLSYNC "<epoch>,<seq>,<F|I>": a full snapshot replaces the replica, while an
+// incremental resync keeps it and is followed by the missing changes.
+void replica_begin_sync(const char *payload) {
+    char log_msg[150];
+    unsigned epoch;
+    unsigned long long seq;
+    char mode;
+
+    if (sscanf(payload, "%u,%llu,%c", &epoch, &seq, &mode) != 3) {
+        log_error("Invalid RES_REPLSYNC payload.");
+        return;
+    }
+    if (mode == 'F') {
+        memset(replica, 0, sizeof(replica));
+        for (int loc_id = 0; loc_id <= NUM_LOCATIONS; loc_id++) location_version[loc_id]++;
+    }
+    replica_epoch = epoch;
+    replica_seq = seq;
+    replica_ready = 1;
+    sprintf(log_msg, "Location replica %s at change %llu.", mode == 'F' ? "reloaded" : "resumed", seq);
+    log_info(log_msg);
+}
+
+// Handles REPL_DELTA "<seq>,<R|D>,<SensorID>,<LocId>" (SS and SLR). Sequence 0 marks snapshot entries;
+// other changes must follow the last applied one, and a gap triggers a resync.
+void replica_apply_delta(const char *payload) {
+    char log_msg[150];
+    unsigned long long seq;
+    char op;
+    char sensor_id[MAX_PIDS_LENGTH];
+    int location_id;
+
+    if (sscanf(payload, "%llu,%c,%49[^,],%d", &seq, &op, sensor_id, &location_id) != 4 ||
+        sensor_id_parse(sensor_id) == SENSOR_KEY_NONE) {
+        log_error("Invalid REPL_DELTA payload.");
+        return;
+    }
+    if (seq != 0 && seq <= replica_seq) return; // Already applied
+    if (seq != 0 && seq != replica_seq + 1) {
+        sprintf(log_msg, "Replica gap: expected change %llu, got %llu. Resynchronizing.",
+                (unsigned long long)replica_seq + 1, seq);
+        log_info(log_msg);
+        replica_request_sync();
+        return;
+    }
+    uint64_t sensor_key = sensor_id_parse(sensor_id);
+    replica_apply(op, sensor_key, location_id);
+    if (seq != 0) replica_seq = seq;
+
+    // The SS keeps the location its sensors registered with for the aggregates; follow moves made on the SL
+    int k = current_server_role == SERVER_TYPE_STATUS && op == 'R' && location_id > 0 ? sensor_index_find(sensor_key) : -1;
+    if (k >= 0) move_sensor_location(k, location_id);
+}
+
+// Called whenever the P2P handshake completes: the SS (re)synchronizes its location replica, and the SL
+// keeps listening for more SS peers, also when it reached this one by connecting to it
+void on_peer_established(PeerLink *link) {
+    link->repl_subscribed = 0;
+    if (p2p_thread_enabled) start_peer_thread(link);
+    if (current_server_role == SERVER_TYPE_STATUS) {
+        replica_request_sync();
+    } else {
+        start_passive_p2p_listener();
+    }
+}
+
+// Offers the SL a shared-memory link (SS with --p2p-shm). The SL fetches the link's descriptors from
+// a one-shot handoff socket, and the SS switches to the rings when RES_P2PSHM accepts the offer.
+void offer_peer_shm(PeerLink *link) {
+    char log_msg[150];
+    char name[64];
+
+    close_peer_shm(link);
+    if (shm_link_create(&link->shm) < 0 || (link->shm_handoff_fd = shm_handoff_listen(name, sizeof(name))) < 0) {
+        log_error("Failed to set up the shared-memory P2P link. Staying on the socket.");
+        close_peer_shm(link);
+        return;
+    }
+    char msg_out[MAX_MSG_SIZE];
+    build_control_message(msg_out, sizeof(msg_out), REQ_P2PSHM, name);
+    if (peer_write_socket(link, msg_out, strlen(msg_out)) < 0) {
+        log_error("Failed to send REQ_P2PSHM.");
+        close_peer_shm(link);
+        return;
+    }
+    sprintf(log_msg, "Offered a shared-memory P2P link (handoff socket @%s).", name);
+    log_info(log_msg);
+}
+
+// Answers REQ_P2PSHM (SL): attaches to the SS's link if --p2p-shm is enabled, then sends through it
+void accept_peer_shm(PeerLink *link, const char *name) {
+    int fds[SHM_LINK_FDS];
+    int accepted = 0;
+
+    if (!p2p_shm_enabled) {
+        log_info("Shared-memory P2P link offered but not enabled (--p2p-shm). Declining.");
+    } else {
+        close_peer_shm(link);
+        if (shm_handoff_receive(name, fds) < 0 || shm_link_attach(&link->shm, fds) < 0) {
+            log_error("Failed to attach to the shared-memory P2P link. Declining.");
+        } else {
+            accepted = 1;
+        }
+    }
+
+    char msg_out[MAX_MSG_SIZE];
+    build_control_message(msg_out, sizeof(msg_out), RES_P2PSHM, accepted ? "1" : "0");
+    if (peer_write_socket(link, msg_out, strlen(msg_out)) < 0) {
+        log_error("Failed to send RES_P2PSHM.");
+        close_peer_shm(link);
+        return;
+    }
+    // Everything sent from now on follows RES_P2PSHM through the rings
+    if (!accepted) return;
+    link->shm_active = 1;
+    log_info("P2P link switched to shared memory.");
+}
+
+// Connects a read replica to its primary SL and requests the changes missing from the replica.
+// If the primary cannot be reached, the attempt is repeated every PRIMARY_RETRY_MS.
+void connect_primary(void) {
+    char log_msg[150];
+
+    primary_fd = transport_connect(primary_addr, primary_port);
+    if (primary_fd < 0) {
+        if (!timer_pending(&primary_retry_timer)) {
+            sprintf(log_msg, "Primary SL %s:%d unreachable. Retrying every %d ms.", primary_addr, primary_port, PRIMARY_RETRY_MS);
+            log_info(log_msg);
+        }
+        timer_schedule(&timer_wheel, &primary_retry_timer, loop_now_ms, PRIMARY_RETRY_MS);
+        return;
+    }
+    timer_cancel(&timer_wheel, &primary_retry_timer);
+    message_buffer_reset(&primary_rx);
+    sprintf(log_msg, "Connected to primary SL %s:%d on socket %d. Subscribing to registry changes...",
+            primary_addr, primary_port, primary_fd);
+    log_info(log_msg);
+    replica_request_sync();
+}
+
+void primary_retry_expired(Timer *timer, void *arg) {
+    (void)timer;
+    (void)arg;
+    connect_primary();
+}
+
+// Closes the connection to the primary SL and schedules a reconnection. The replica keeps
+// answering queries meanwhile and is resynchronized incrementally once the primary is back.
+void close_primary(void) {
+    close(primary_fd);
+    primary_fd = -1;
+    timer_schedule(&timer_wheel, &primary_retry_timer, loop_now_ms, PRIMARY_RETRY_MS);
+}
+
+// Handles one message from the primary SL (SLR only)
+void handle_primary_message(char *message) {
+    char log_msg[150];
+    int code;
+    char payload[MAX_MSG_SIZE];
+
+    if (!parse_message(message, &code, payload, sizeof(payload))) {
+        log_error("Failed to parse message from the primary SL.");
+        return;
+    }
+    if (code == RES_REPLSYNC) {
+        replica_begin_sync(payload);
+    } else if (code == REPL_DELTA) {
+        replica_apply_delta(payload);
+    } else if (code == REQ_HEARTBEAT) {
+        char msg_out[MAX_MSG_SIZE];
+        build_control_message(msg_out, sizeof(msg_out), RES_HEARTBEAT, NULL);
+        if (write(primary_fd, msg_out, strlen(msg_out)) < 0) {
+            log_error("Failed to send RES_HEARTBEAT to the primary SL.");
+        }
+    } else {
+        sprintf(log_msg, "Unexpected message from the primary SL: Code=%d, Payload='%s'", code, payload);
+        log_info(log_msg);
+    }
+}
+
+// Returns the location of a sensor from the registry (SL) or the replica (SLR), or -1 if it is unknown.
+int lookup_sensor_location(uint64_t sensor_key) {
+    if (current_server_role == SERVER_TYPE_LOCATION_REPLICA) {
+        int bucket = replica_find(sensor_key);
+        return bucket >= 0 ? replica[bucket].location_id : -1;
+    }
+    return find_sensor_location(sensor_key);
+}
+
+// Appends a sensor ID to a comma-separated list of count entries, unless it would not fit in out.
+// Returns 1 if it was appended.
+static int append_sensor_id(char *out, size_t out_size, size_t *len, int count, uint64_t sensor_key) {
+    char sensor_id[SENSOR_ID_STR_SIZE];
+    if (*len + SENSOR_ID_STR_SIZE >= out_size) return 0;
+    sensor_id_format(sensor_key, sensor_id, sizeof(sensor_id));
+    *len += snprintf(out + *len, out_size - *len, "%s%s", count > 0 ? "," : "", sensor_id);
+    return 1;
+}
+
+// Writes the comma-separated IDs of the sensors at a location, from the location index (SL) or the
+// replica (SLR). Returns the number of sensors listed; IDs that would not fit in out are left out.
+int build_location_list(int loc_id, char *out, size_t out_size) {
+    int count = 0;
+    size_t len = 0;
+    out[0] = '\0';
+    if (current_server_role == SERVER_TYPE_LOCATION_REPLICA) {
+        for (int bucket = 0; bucket < REPLICA_SIZE; bucket++) {
+            if (replica[bucket].location_id != loc_id) continue;
+            if (!append_sensor_id(out, out_size, &len, count, replica[bucket].sensor_key)) break;
+            count++;
+        }
+        return count;
+    }
+    for (int link = location_head[location_bucket(loc_id)]; link != 0; link = location_next[link - 1]) {
+        const ClientInfo *client = &connected_clients[link - 1];
+        if (client->location_id != loc_id) continue; // Bucket 0 mixes locations
+        if (!append_sensor_id(out, out_size, &len, count, client->sensor_key)) break;
+        count++;
+    }
+    return count;
+}
+
+// Returns the serialized REQ_LOCLIST response for a location (1 to NUM_LOCATIONS), from the cache if
+// the location's membership has not changed since it was built. Sets *cached to 1 on a cache hit.
+const LocListCacheEntry *loclist_response(int loc_id, int *cached) {
+    LocListCacheEntry *entry = NULL;
+    for (int e = 0; e < LOCLIST_CACHE_ENTRIES; e++) {
+        if (loclist_cache[e].location_id == loc_id) {
+            entry = &loclist_cache[e];
+            break;
+        }
+        if (entry == NULL || loclist_cache[e].last_used < entry->last_used) entry = &loclist_cache[e];
+    }
+    entry->last_used = ++loclist_cache_clock;
+
+    *cached = entry->location_id == loc_id && entry->version == location_version[loc_id];
+    if (*cached) return entry;
+
+    char sensor_list[MAX_MSG_SIZE - 8];
+    entry->location_id = loc_id;
+    entry->version = location_version[loc_id];
+    entry->count = build_location_list(loc_id, sensor_list, sizeof(sensor_list));
+    if (entry->count > 0) {
+        build_control_message(entry->message, sizeof(entry->message), RES_LOCLIST, sensor_list);
+    } else {
+        char err_payload[10];
+        sprintf(err_payload, "%02d", SENSOR_NOT_FOUND);
+        build_control_message(entry->message, sizeof(entry->message), ERROR_MSG, err_payload);
+    }
+    return entry;
+}
+
+// Builds the RES_SENSSTATUS (or ERROR) answer for a registered sensor (SS only).
+// Alerting sensors are located through the replica of the SL registry, without a round trip to the SL;
+// until the replica has its first snapshot they are answered ERROR(12).
+void build_sensor_status_response(const ClientInfo *client, char *msg_out, size_t msg_out_size) {
+    char log_msg[150];
+    char err_payload[10];
+
+    if (client->risk_status != 1) {
+        log_info("Sensor status is normal (0), no alert.");
+        build_control_message(msg_out, msg_out_size, RES_SENSSTATUS, "-1");
+        return;
+    }
+
+    if (!replica_ready) {
+        log_error("Location replica not synchronized with the SL yet. Sending ERROR(12).");
+        sprintf(err_payload, "%02d", REPLICA_NOT_SYNCED);
+        build_control_message(msg_out, msg_out_size, ERROR_MSG, err_payload);
+        return;
+    }
+
+    char sensor_id[SENSOR_ID_STR_SIZE];
+    sensor_id_format(client->sensor_key, sensor_id, sizeof(sensor_id));
+
+    int bucket = replica_find(client->sensor_key);
+    if (bucket >= 0) {
+        char loc_str[12];
+        sprintf(loc_str, "%d", replica[bucket].location_id);
+        sprintf(log_msg, "Sensor %s status = 1 (failure detected), location %s from replica.",
+                sensor_id, loc_str);
+        log_info(log_msg);
+        build_control_message(msg_out, msg_out_size, RES_SENSSTATUS, loc_str);
+    } else {
+        sprintf(log_msg, "Sensor %s not found in the location replica. Sending ERROR(10).", sensor_id);
+        log_info(log_msg);
+        sprintf(err_payload, "%02d", SENSOR_NOT_FOUND);
+        build_control_message(msg_out, msg_out_size, ERROR_MSG, err_payload);
+    }
+}
+
+// Builds the RES_ALERTLIST payload "<count>;<SensorID>:<LocId>,..." for REQ_ALERTLIST (SS only).
+// filter is empty for all sensors in alert, a location ID or a region name. Locations come from the
+// replica of the SL registry, so the whole list costs no round trip to the SL. A sensor the replica
+// does not hold yet is listed with location 0 and matches no location or region filter.
+// <count> counts every match; the list holds the whole entries that fit in out.
+// Returns 0, or the error code if the filter is invalid.
+int build_alert_list(const char *filter, char *out, size_t out_size) {
+    char log_msg[150];
+    int filter_loc = 0;
+    int filter_region = -1;
+
+    if (filter[0] >= '0' && filter[0] <= '9') {
+        filter_loc = atoi(filter);
+        if (location_region(filter_loc) < 0) return INVALID_PAYLOAD_ERROR;
+    } else if (filter[0] != '\0') {
+        for (int region = 0; region < NUM_REGIONS; region++) {
+            if (strcmp(filter, region_name(region)) == 0) filter_region = region;
+        }
+        if (filter_region < 0) return INVALID_PAYLOAD_ERROR;
+    }
+    if (!replica_ready) log_error("Location replica not synchronized with the SL yet.");
+
+    char entries[MAX_MSG_SIZE];
+    size_t len = 0;
+    int count = 0;
+    int full = 0;
+    entries[0] = '\0';
+    for (int n = 0; n < num_alert_slots; n++) {
+        uint64_t sensor_key = connected_clients[alert_slots[n]].sensor_key;
+        int bucket = replica_ready ? replica_find(sensor_key) : -1;
+        int loc_id = bucket >= 0 ? replica[bucket].location_id : 0;
+        if ((filter_loc > 0 && loc_id != filter_loc) ||
+            (filter_region >= 0 && location_region(loc_id) != filter_region)) {
+            continue;
+        }
+        count++;
+        if (full) continue;
+
+        // Once an entry does not fit beside the count, the remaining matches are only counted
+        char sensor_id[SENSOR_ID_STR_SIZE];
+        char entry[SENSOR_ID_STR_SIZE + 16];
+        sensor_id_format(sensor_key, sensor_id, sizeof(sensor_id));
+        int entry_len = snprintf(entry, sizeof(entry), "%s%s:%d", len > 0 ? "," : "", sensor_id, loc_id);
+        if (len + (size_t)entry_len + 16 > out_size || len + (size_t)entry_len >= sizeof(entries)) {
+            full = 1;
+            continue;
+        }
+        memcpy(entries + len, entry, (size_t)entry_len + 1);
+        len += (size_t)entry_len;
+    }
+    snprintf(out, out_size, "%d;%s", count, entries);
+    sprintf(log_msg, "Alert list: %d of %d sensor(s) in alert match '%s'.", count, num_alert_slots, filter);
+    log_info(log_msg);
+    return 0;
+}
+
+// Answers one datagram received on the UDP fast path.
+// Only REQ_SENSSTATUS (SS) and REQ_SENSLOC (SL) are served, and the sender must prove a
+// previous TCP registration by sending the slot it was issued and its sensor ID (see UdpGrant):
+//   REQ_SENSSTATUS <Slot>,<SensorID>
+//   REQ_SENSLOC    <Slot>,<SensorID>,<TargetSensorID>
+// The sensor need not hold its TCP connection; a status query is answered while the SS still has
+// its registration, and ERROR(10) once it is gone.
+void handle_udp_query(int udp_fd) {
+    char buffer[MAX_MSG_SIZE + 1];
+    char log_msg[150];
+    struct sockaddr_in src_addr;
+    socklen_t src_len = sizeof(src_addr);
+
+    ssize_t bytes_read = recvfrom(udp_fd, buffer, MAX_MSG_SIZE, 0, (struct sockaddr *)&src_addr, &src_len);
+    if (bytes_read < 0) {
+        log_error("Failed to receive UDP query.");
+        return;
+    }
+    buffer[bytes_read] = '\0';
+
+    int code;
+    char payload[MAX_MSG_SIZE];
+    if (!parse_message(buffer, &code, payload, sizeof(payload))) {
+        log_error("Failed to parse UDP query.");
+        return;
+    }
+
+    int slot = 0;
+    char sensor_id[MAX_PIDS_LENGTH] = "";
+    char target_id[MAX_PIDS_LENGTH] = "";
+    int n_fields = sscanf(payload, "%d,%49[^,],%49s", &slot, sensor_id, target_id);
+
+    char msg_out[MAX_MSG_SIZE];
+    char err_payload[10];
+    int has_response = 0;
+
+    if ((code == REQ_SENSSTATUS && current_server_role == SERVER_TYPE_STATUS && n_fields == 2) ||
+        (code == REQ_SENSLOC && current_server_role == SERVER_TYPE_LOCATION && n_fields == 3)) {
+        uint64_t sensor_key = sensor_id_parse(sensor_id);
+        int k = code == REQ_SENSSTATUS ? sensor_index_find(sensor_key) : -1;
+        if (!udp_grant_valid(sensor_key, slot)) {
+            sprintf(log_msg, "UDP query (Code=%d) from unregistered slot %d / sensor '%s'. Sending ERROR(10).",
+                    code, slot, sensor_id);
+            log_info(log_msg);
+            sprintf(err_payload, "%02d", SENSOR_NOT_FOUND);
+            build_control_message(msg_out, sizeof(msg_out), ERROR_MSG, err_payload);
+            has_response = 1;
+        } else if (code == REQ_SENSSTATUS && k < 0) {
+            sprintf(log_msg, "UDP REQ_SENSSTATUS from sensor %s, which is no longer registered. Sending ERROR(10).",
+                    sensor_id);
+            log_info(log_msg);
+            sprintf(err_payload, "%02d", SENSOR_NOT_FOUND);
+            build_control_message(msg_out, sizeof(msg_out), ERROR_MSG, err_payload);
+            has_response = 1;
+        } else if (code == REQ_SENSSTATUS) {
+            sprintf(log_msg, "UDP REQ_SENSSTATUS from sensor %s (Slot: %d)", sensor_id, slot);
+            log_info(log_msg);
+            build_sensor_status_response(&connected_clients[k], msg_out, sizeof(msg_out));
+            has_response = 1;
+        } else {
+            int loc_id_found = find_sensor_location(sensor_id_parse(target_id));
+            if (loc_id_found != -1) {
+                char loc_str[12];
+                sprintf(loc_str, "%d", loc_id_found);
+                build_control_message(msg_out, sizeof(msg_out), RES_SENSLOC, loc_str);
+            } else {
+                sprintf(err_payload, "%02d", SENSOR_NOT_FOUND);
+                build_control_message(msg_out, sizeof(msg_out), ERROR_MSG, err_payload);
+            }
+            has_response = 1;
+        }
+    } else {
+        sprintf(log_msg, "Unexpected UDP query (Code=%d). Sending ERROR(03).", code);
+        log_info(log_msg);
+        sprintf(err_payload, "%02d", INVALID_PAYLOAD_ERROR);
+        build_control_message(msg_out, sizeof(msg_out), ERROR_MSG, err_payload);
+        has_response = 1;
+    }
+
+    if (has_response &&
+        sendto(udp_fd, msg_out, strlen(msg_out), 0, (struct sockaddr *)&src_addr, src_len) < 0) {
+        log_error("Failed to send UDP response.");
+    }
+}
+
+// Applies the risk update batches waiting on the risk feed socket (SS only).
+// Each datagram is one batch of "<SensorID> <0|1>" lines, applied in a single pass through the
+// sensor ID index. If the sender bound an address, it gets one datagram back with a result line
+// per record, in order: "<SensorID> 0 03" (updated), "<SensorID> 255 10" (not registered)
+// or "<SensorID> 255 03" (malformed record). A batch larger than RISK_FEED_MAX_BATCH is answered
+// with a single "255 03" line and not applied.
+void handle_risk_feed(int feed_fd) {
+    static char batch[RISK_FEED_MAX_BATCH + 1];
+    static char reply[2 * RISK_FEED_MAX_BATCH];
+    char log_msg[150];
+
+    for (int n = 0; n < RISK_FEED_MAX_BATCHES; n++) {
+        struct sockaddr_un src_addr;
+        socklen_t src_len = sizeof(src_addr);
+        // MSG_TRUNC reports the full datagram length, so oversized batches are detected
+        ssize_t batch_len = recvfrom(feed_fd, batch, RISK_FEED_MAX_BATCH, MSG_DONTWAIT | MSG_TRUNC,
+                                     (struct sockaddr *)&src_addr, &src_len);
+        if (batch_len < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) log_error("Failed to receive risk update batch.");
+            return;
+        }
+
+        size_t reply_len = 0;
+        if (batch_len > RISK_FEED_MAX_BATCH) {
+            sprintf(log_msg, "Risk batch of %zd bytes exceeds %d bytes. Rejecting it with ERROR(03).",
+                    batch_len, RISK_FEED_MAX_BATCH);
+            log_error(log_msg);
+            char err_payload[10];
+            sprintf(err_payload, "%02d", INVALID_PAYLOAD_ERROR);
+            build_control_message(reply, sizeof(reply), ERROR_MSG, err_payload);
+            batch_len = 0;
+            reply_len = strlen(reply);
+        }
+        batch[batch_len] = '\0';
+
+        int updated = 0, not_found = 0, invalid = 0;
+        char *save_ptr = NULL;
+        for (char *line = strtok_r(batch, "\n", &save_ptr); line != NULL; line = strtok_r(NULL, "\n", &save_ptr)) {
+            // Stop before a result line could overflow the reply; the sender sees the missing results
+            if (sizeof(reply) - reply_len < MAX_PIDS_LENGTH + 16) {
+                sprintf(log_msg, "Risk batch too large, records after #%d ignored.", updated + not_found + invalid);
+                log_error(log_msg);
+                break;
+            }
+
+            char sensor_id[MAX_PIDS_LENGTH];
+            int risk;
+            char extra;
+            int code = ERROR_MSG;
+            int result = INVALID_PAYLOAD_ERROR;
+            if (sscanf(line, "%49s %d %c", sensor_id, &risk, &extra) == 2 && (risk == 0 || risk == 1) &&
+                sensor_id_parse(sensor_id) != SENSOR_KEY_NONE) {
+                int k = sensor_index_find(sensor_id_parse(sensor_id));
+                if (k >= 0) {
+                    set_sensor_risk(k, risk);
+                    code = OK_MSG;
+                    result = OK_SUCCESSFUL_UPDATE;
+                    updated++;
+                } else {
+                    result = SENSOR_NOT_FOUND;
+                    not_found++;
+                }
+            } else {
+                if (sscanf(line, "%49s", sensor_id) != 1) strcpy(sensor_id, "-");
+                invalid++;
+            }
+            reply_len += snprintf(reply + reply_len, sizeof(reply) - reply_len, "%s %d %02d\n",
+                                  sensor_id, code, result);
+        }
+
+        if (batch_len > 0) {
+            sprintf(log_msg, "Risk batch applied: %d updated, %d not found, %d invalid.", updated, not_found, invalid);
+            log_info(log_msg);
+        }
+
+        if (src_len > sizeof(sa_family_t) && reply_len > 0 &&
+            sendto(feed_fd, reply, reply_len, MSG_DONTWAIT, (struct sockaddr *)&src_addr, src_len) < 0) {
+            log_error("Failed to acknowledge risk update batch.");
+        }
+    }
+}
+
+// Writes out as much of the *len bytes held in buf as the socket takes without blocking.
+// Returns 0 on success (or a full socket buffer), -1 if the socket failed.
+int flush_tx(int fd, char *buf, size_t *len) {
+    size_t off = 0;
+    int result = 0;
+    while (off < *len) {
+        ssize_t n = send(fd, buf + off, *len - off, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n > 0) {
+            off += (size_t)n;
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else {
+            if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) result = -1;
+            break;
+        }
+    }
+    memmove(buf, buf + off, *len - off);
+    *len -= off;
+    return result;
+}
+
+// Sends a message to a client socket.
+// With the io_uring backend the send is only queued; it is submitted with the next loop iteration's
+// single io_uring_enter, and consecutive sends to the same socket are linked to keep their order.
+// Otherwise what the non-blocking socket does not take is held in the client's reply buffer, behind
+// which later replies queue up.
+ssize_t send_to_client(int client_fd, const char *msg) {
+    char traced[MAX_MSG_SIZE + TRACE_PREFIX_LEN];
+    uint64_t trace_start_us = 0;
+    if (current_trace_id != 0) {
+        trace_prefix(traced, sizeof(traced), current_trace_id, msg);
+        msg = traced;
+        trace_start_us = monotonic_us();
+    }
+    size_t len = strlen(msg);
+    int i = 0;
+    while (i < MAX_CLIENTS && client_fds[i] != client_fd) i++;
+    if (i < MAX_CLIENTS) {
+        capture_write(&capture, client_conn_ids[i], CAPTURE_REPLY, msg, strcspn(msg, "\n"));
+    }
+    if (io_backend == IO_BACKEND_URING && uring_num_free_send_buffers > 0 && len <= MAX_MSG_SIZE &&
+        (i == MAX_CLIENTS || client_tx_len[i] == 0)) {
+        int buf_index = uring_free_send_buffers[--uring_num_free_send_buffers];
+        memcpy(uring_send_buffers[buf_index], msg, len);
+        if (uring_prep_send(&uring, client_fd, uring_send_buffers[buf_index], len,
+                            URING_USER_DATA(URING_OP_SEND, 0, buf_index),
+                            uring_last_send_fd == client_fd) == 0) {
+            uring_last_send_fd = client_fd;
+            if (trace_start_us != 0) trace_span(current_trace_id, "send (queued)", atoi(msg + TRACE_PREFIX_LEN),
+                                                trace_start_us, monotonic_us());
+            return (ssize_t)len;
+        }
+        uring_free_send_buffers[uring_num_free_send_buffers++] = buf_index;
+    }
+
+    ssize_t n;
+    if (i == MAX_CLIENTS) {
+        // Not a client slot (the SLR's connection to its primary): a plain blocking send
+        n = send(client_fd, msg, len, MSG_NOSIGNAL);
+    } else if (client_tx_len[i] + len > CLIENT_TX_BUFFER) {
+        // The client stopped reading; the read side sees the shutdown and drops it
+        log_error("Client reply buffer full. Disconnecting the client.");
+        shutdown(client_fd, SHUT_RDWR);
+        n = -1;
+    } else {
+        // A client may have gone away while its requests were queued: no SIGPIPE for that (flush_tx)
+        memcpy(client_tx[i] + client_tx_len[i], msg, len);
+        client_tx_len[i] += len;
+        n = flush_tx(client_fd, client_tx[i], &client_tx_len[i]) < 0 ? -1 : (ssize_t)len;
+    }
+    if (trace_start_us != 0) trace_span(current_trace_id, "send", atoi(msg + TRACE_PREFIX_LEN), trace_start_us, monotonic_us());
+    return n;
+}
+
+// Closes the socket of the client in slot i.
+// With io_uring, the slot's multishot receive is cancelled and queued sends are submitted first.
+void close_client_socket(int i) {
+    if (io_backend == IO_BACKEND_URING) {
+        uring_prep_cancel(&uring, URING_USER_DATA(URING_OP_RECV, client_generation[i], i));
+        uring_submit(&uring, 0);
+        uring_last_send_fd = -1;
+        client_generation[i]++;
+    }
+    timer_cancel(&timer_wheel, &client_idle_timers[i]);
+    capture_write(&capture, client_conn_ids[i], CAPTURE_CLOSE, NULL, 0);
+    close(client_fds[i]);
+    client_fds[i] = 0;
+    client_tx_len[i] = 0;
+    client_queued[i] = 0; // Its queued requests are discarded when they come up
+}
+
+// Closes the connection of the client in slot i and frees its registration, if any
+void drop_client(int i) {
+    close_client_socket(i);
+    if (connected_clients[i].sensor_key != SENSOR_KEY_NONE) {
+        sensor_index_remove(i);
+        location_index_remove(i);
+        repl_publish('D', i);
+        update_region_stats(connected_clients[i].location_id, -1, -(connected_clients[i].risk_status == 1));
+        if (num_connected_clients > 0) num_connected_clients--;
+    }
+    history_detach(i);
+    client_backoff_until_ms[i] = 0;
+    connected_clients[i] = (ClientInfo){0};
+    alert_list_update(i);
+    pending_location[i] = 0;
+}
+
+// Records activity from the client in slot i, restarting its idle timeout
+void touch_client(int i) {
+    client_ping_pending[i] = 0;
+    timer_schedule(&timer_wheel, &client_idle_timers[i], loop_now_ms, CLIENT_IDLE_TIMEOUT_MS);
+}
+
+// Idle timeout of a client: the first expiry sends REQ_HEARTBEAT, the second one evicts the client
+void client_idle_expired(Timer *timer, void *arg) {
+    int i = (int)(intptr_t)arg;
+    char log_msg[150];
+
+    if (client_fds[i] <= 0) return;
+
+    if (!client_ping_pending[i]) {
+        char msg_out[MAX_MSG_SIZE];
+        build_control_message(msg_out, sizeof(msg_out), REQ_HEARTBEAT, NULL);
+        send_to_client(client_fds[i], msg_out);
+        client_ping_pending[i] = 1;
+        timer_schedule(&timer_wheel, timer, loop_now_ms, HEARTBEAT_TIMEOUT_MS);
+        return;
+    }
+
+    sprintf(log_msg, "Client %s (socket %d, slot %d) did not answer REQ_HEARTBEAT. Evicting.",
+            client_addr_desc[i], client_fds[i], i + 1);
+    log_info(log_msg);
+    drop_client(i);
+}
+
+// Takes one token from the bucket of a connection's source address.
+// addr may be NULL, in which case it is looked up from the socket.
+// Returns 1 if the connection is admitted, 0 if the source exceeded its rate.
+int admission_check(int fd, const struct sockaddr *addr) {
+    struct sockaddr_storage peer_addr;
+    if (admission_rate <= 0) return 1;
+    if (addr == NULL) {
+        socklen_t addr_len = sizeof(peer_addr);
+        if (getpeername(fd, (struct sockaddr *)&peer_addr, &addr_len) < 0) return 1;
+        addr = (struct sockaddr *)&peer_addr;
+    }
+    if (addr->sa_family != AF_INET) return 1; // Unix domain clients are local
+
+    uint32_t ip = ((const struct sockaddr_in *)addr)->sin_addr.s_addr;
+    AdmissionBucket *bucket = &admission_table[(ip * 2654435761u) >> 22 & (ADMISSION_TABLE_SIZE - 1)];
+    int64_t capacity = (int64_t)admission_burst * 1000;
+    if (!bucket->in_use || bucket->addr != ip) {
+        bucket->addr = ip;
+        bucket->milli_tokens = capacity;
+        bucket->last_refill_ms = loop_now_ms;
+        bucket->in_use = 1;
+    } else {
+        bucket->milli_tokens += (int64_t)(loop_now_ms - bucket->last_refill_ms) * admission_rate;
+        if (bucket->milli_tokens > capacity) bucket->milli_tokens = capacity;
+        bucket->last_refill_ms = loop_now_ms;
+    }
+
+    if (bucket->milli_tokens < 1000) return 0;
+    bucket->milli_tokens -= 1000;
+    return 1;
+}
+
+// Logs the rejections of the last second in one line instead of one line per connection
+void admission_report_expired(Timer *timer, void *arg) {
+    char log_msg[150];
+    (void)timer;
+    (void)arg;
+
+    sprintf(log_msg, "Admission control rejected %d connection(s) exceeding %d/s per source address.",
+            admission_rejected, admission_rate);
+    log_info(log_msg);
+    admission_rejected = 0;
+}
+
+// Resets a connection refused by admission control; SO_LINGER 0 makes close() send an RST,
+// so no TIME_WAIT state is kept.
+void reject_connection(int fd) {
+    struct linger reset = { .l_onoff = 1, .l_linger = 0 };
+    setsockopt(fd, SOL_SOCKET, SO_LINGER, &reset, sizeof(reset));
+    close(fd);
+
+    if (admission_rejected++ == 0) {
+        timer_schedule(&timer_wheel, &admission_report_timer, loop_now_ms, 1000);
+    }
+}
+
+// Periodically writes buffered capture records out, so a crash loses at most CAPTURE_FLUSH_MS of traffic
+void capture_flush_expired(Timer *timer, void *arg) {
+    (void)arg;
+    capture_flush(&capture);
+    timer_schedule(&timer_wheel, timer, loop_now_ms, CAPTURE_FLUSH_MS);
+}
+
+// Writes the recorded trace spans to the --trace file
+void export_trace(void) {
+    char log_msg[150];
+    int spans = trace_export_chrome(trace_path);
+    if (spans < 0) {
+        log_error("Failed to write trace file");
+        return;
+    }
+    snprintf(log_msg, sizeof(log_msg), "Exported %d trace spans to %s.", spans, trace_path);
+    log_info(log_msg);
+}
+
+// Child side of an export: writes every registered sensor of the (copied) client table to target.
+// Runs in a fork of a process that may have a link thread, so it only makes async-signal-safe calls.
+// Never returns.
+static void write_registry_export(const char *target, ExportFormat format) {
+    static char out[EXPORT_RECORD_MAX * (MAX_CLIENTS + 1)]; // Copy-on-write page of the parent
+    int fd = export_open(target);
+    if (fd < 0) _exit(2);
+
+    // Drop the other inherited sockets, so connections the server closes meanwhile are not held open
+    if (fd > 3) close_range(3, (unsigned)fd - 1, 0);
+    close_range((unsigned)fd + 1, ~0U, 0);
+
+    uint32_t count = 0;
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        if (connected_clients[i].sensor_key != SENSOR_KEY_NONE) count++;
+    }
+    const char *role = current_server_role == SERVER_TYPE_STATUS ? "SS" :
+                       current_server_role == SERVER_TYPE_LOCATION ? "SL" : "SLR";
+    size_t len = export_format_header(out, format, role, count);
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        const ClientInfo *client = &connected_clients[i];
+        if (client->sensor_key == SENSOR_KEY_NONE) continue;
+        ExportRecord record = {
+            .sensor_id = client->sensor_key & ~SENSOR_KEY_TAG,
+            .age_ms = (uint32_t)(loop_now_ms - client_accepted_ms[i]),
+            .slot = (uint16_t)client->assigned_slot,
+            .location_id = (int8_t)client->location_id,
+            .risk_status = (int8_t)client->risk_status,
+        };
+        len += export_format_record(out + len, format, &record);
+    }
+    int failed = export_write_all(fd, out, len) < 0;
+    if (close(fd) != 0) failed = 1;
+    _exit(failed ? 1 : 0);
+}
+
+// Starts exporting a snapshot of the registry to a file or a "unix:<path>" socket
+void start_registry_export(const char *target, ExportFormat format) {
+    char log_msg[MAX_MSG_SIZE + 50];
+    if (export_pid > 0) {
+        log_info("export: An export is already running.");
+        return;
+    }
+
+    fflush(stdout); // The child must not write out our buffered log lines again
+    pid_t pid = fork();
+    if (pid < 0) {
+        log_error("export: fork failed");
+        return;
+    }
+    if (pid == 0) write_registry_export(target, format);
+
+    export_pid = pid;
+    export_started_ms = loop_now_ms;
+    timer_schedule(&timer_wheel, &export_poll_timer, loop_now_ms, TIMER_TICK_MS);
+    sprintf(log_msg, "Exporting a snapshot of %d sensors to %s (%s).", num_connected_clients, target,
+            format == EXPORT_CSV ? "csv" : "bin");
+    log_info(log_msg);
+}
+
+// Reports the result of the export child once it has exited
+void export_poll_expired(Timer *timer, void *arg) {
+    char log_msg[150];
+    int status;
+    (void)arg;
+    if (waitpid(export_pid, &status, WNOHANG) != export_pid) {
+        timer_schedule(&timer_wheel, timer, loop_now_ms, TIMER_TICK_MS);
+        return;
+    }
+
+    if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+        sprintf(log_msg, "Export finished in %llu ms.", (unsigned long long)(loop_now_ms - export_started_ms));
+        log_info(log_msg);
+    } else if (WIFEXITED(status) && WEXITSTATUS(status) == 2) {
+        log_info("export: Cannot open the export target.");
+    } else {
+        log_info("export: Writing the snapshot failed.");
+    }
+    export_pid = 0;
+}
+
+// Assigns a newly accepted socket to a free slot, or rejects it with ERROR(09).
+// Returns the slot index, or -1 if the connection was rejected.
+int accept_client_socket(int new_client_fd) {
+    char log_msg[150];
+
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        if (client_fds[i] == 0) {
+            client_fds[i] = new_client_fd;
+            connected_clients[i].socket_fd = new_client_fd;
+            transport_describe_peer(new_client_fd, client_addr_desc[i], sizeof(client_addr_desc[i]));
+            message_buffer_reset(&client_rx[i]);
+            touch_client(i);
+            client_conn_ids[i] = next_conn_id++;
+            client_accepted_ms[i] = loop_now_ms;
+            capture_write(&capture, client_conn_ids[i], CAPTURE_OPEN, client_addr_desc[i], strlen(client_addr_desc[i]));
+
+            sprintf(log_msg, "New client connected from %s on socket %d, assigned to slot %d.",
+                    client_addr_desc[i], new_client_fd, i + 1);
+            log_info(log_msg);
+
+            if (io_backend == IO_BACKEND_URING &&
+                uring_prep_multishot_recv(&uring, new_client_fd,
+                                          URING_USER_DATA(URING_OP_RECV, client_generation[i], i)) == 0) {
+                uring_last_send_fd = -1;
+            }
+            return i;
+        }
+    }
+
+    log_info("Client limit reached. Rejecting new connection.");
+    char err_payload[10];
+    sprintf(err_payload, "%02d", SENSOR_LIMIT_EXCEEDED);
+    char err_msg[MAX_MSG_SIZE];
+    build_control_message(err_msg, sizeof(err_msg), ERROR_MSG, err_payload);
+
+    // The socket is new, so its empty buffer takes the short reply whole unless the client is already gone
+    size_t err_len = strlen(err_msg);
+    if (send(new_client_fd, err_msg, err_len, MSG_NOSIGNAL | MSG_DONTWAIT) != (ssize_t)err_len) {
+        log_error("Failed to send error message to new client.");
+    }
+    close(new_client_fd);
+    return -1;
+}
+
+// Drains up to ACCEPT_BATCH pending connections from the non-blocking client listener.
+// Sockets are created non-blocking and close-on-exec by accept4 itself, and admission is
+// decided from the address it returns, before a slot is assigned.
+void accept_pending_clients(int listen_fd) {
+    for (int n = 0; n < ACCEPT_BATCH; n++) {
+        struct sockaddr_storage addr;
+        socklen_t addr_len = sizeof(addr);
+        int new_client_fd = accept4(listen_fd, (struct sockaddr *)&addr, &addr_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (new_client_fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) log_error("Failed to accept new client connection.");
+            return;
+        }
+        if (!admission_check(new_client_fd, (struct sockaddr *)&addr)) {
+            reject_connection(new_client_fd);
+        } else {
+            accept_client_socket(new_client_fd);
+        }
+    }
+}
+
+void process_client_data(int i, char *buffer, ssize_t bytes_read);
+
+// Starts the io_uring backend: provided receive buffers plus a multishot accept on the client listener.
+// Returns 0 on success, -1 if the kernel does not support the required features.
+int uring_backend_start(int client_master_fd) {
+    if (uring_init(&uring, URING_ENTRIES, URING_RECV_BUFFERS, MAX_MSG_SIZE + 1, URING_BUFFER_GROUP) < 0) {
+        return -1;
+    }
+    for (int k = 0; k < URING_SEND_BUFFERS; k++) {
+        uring_free_send_buffers[k] = k;
+    }
+    uring_num_free_send_buffers = URING_SEND_BUFFERS;
+
+    // An unsupported multishot accept fails immediately, so probe it before committing to the backend
+    UringCompletion completion;
+    if (uring_prep_multishot_accept(&uring, client_master_fd, URING_USER_DATA(URING_OP_ACCEPT, 0, 0)) < 0 ||
+        uring_submit(&uring, 0) < 0 ||
+        (uring_next_completion(&uring, &completion) && completion.res < 0)) {
+        uring_destroy(&uring);
+        return -1;
+    }
+    io_backend = IO_BACKEND_URING;
+    return 0;
+}
+
+// One io_uring loop iteration: arms one-shot polls for the descriptors still served by readiness
+// (stdin, P2P and UDP sockets), submits everything queued since the last iteration in a single
+// io_uring_enter, and waits for completions. Accepts and client receives are handled right away;
+// ready control descriptors are returned in read_fds. The wait ends after timeout_ms (-1 for no limit).
+// Returns the number of ready control descriptors, or -1 on error.
+int uring_wait_events(int client_master_fd, const int *control_fds, int num_control_fds, fd_set *read_fds,
+                      int timeout_ms) {
+    char log_msg[150];
+    int ready = 0;
+    int fired[URING_CONTROL_FDS] = {0};
+
+    poll_generation++;
+    for (int k = 0; k < num_control_fds; k++) {
+        uring_prep_poll(&uring, control_fds[k], URING_USER_DATA(URING_OP_POLL, poll_generation, k));
+    }
+    uring_last_send_fd = -1;
+
+    FD_ZERO(read_fds);
+    if (uring_submit_timeout(&uring, 1, timeout_ms) < 0) {
+        return -1;
+    }
+
+    UringCompletion completion;
+    while (uring_next_completion(&uring, &completion)) {
+        int op = URING_USER_OP(completion.user_data);
+        unsigned gen = URING_USER_GEN(completion.user_data);
+        int index = URING_USER_INDEX(completion.user_data);
+
+        if (op == URING_OP_ACCEPT) {
+            if (completion.res >= 0 && !admission_check(completion.res, NULL)) {
+                reject_connection(completion.res);
+            } else if (completion.res >= 0) {
+                accept_client_socket(completion.res);
+            } else {
+                sprintf(log_msg, "io_uring accept failed: %s", strerror(-completion.res));
+                log_info(log_msg);
+            }
+            if (!completion.more) {
+                uring_prep_multishot_accept(&uring, client_master_fd, URING_USER_DATA(URING_OP_ACCEPT, 0, 0));
+                uring_last_send_fd = -1;
+            }
+        } else if (op == URING_OP_RECV) {
+            int current = index >= 0 && index < MAX_CLIENTS && client_fds[index] > 0 &&
+                          gen == (client_generation[index] & 0xFFFFFF);
+            if (current && completion.res == -ENOBUFS) {
+                // Receive buffers exhausted: re-arm and let the data wait in the socket
+                uring_prep_multishot_recv(&uring, client_fds[index], completion.user_data);
+                uring_last_send_fd = -1;
+            } else if (current && completion.res > 0 && completion.has_buffer) {
+                process_client_data(index, uring_buffer(&uring, completion.buf_id), completion.res);
+                if (!completion.more && client_fds[index] > 0 && gen == (client_generation[index] & 0xFFFFFF)) {
+                    uring_prep_multishot_recv(&uring, client_fds[index], completion.user_data);
+                    uring_last_send_fd = -1;
+                }
+            } else if (current) {
+                process_client_data(index, NULL, completion.res);
+            }
+            if (completion.has_buffer) {
+                uring_recycle_buffer(&uring, completion.buf_id);
+            }
+        } else if (op == URING_OP_SEND) {
+            uring_free_send_buffers[uring_num_free_send_buffers++] = index;
+            if (completion.res < 0 && completion.res != -ECANCELED) {
+                sprintf(log_msg, "io_uring send failed: %s", strerror(-completion.res));
+                log_info(log_msg);
+            }
+        } else if (op == URING_OP_POLL && gen == (poll_generation & 0xFFFFFF) &&
+                   index < num_control_fds && completion.res > 0) {
+            FD_SET(control_fds[index], read_fds);
+            fired[index] = 1;
+            ready++;
+        }
+    }
+
+    // Polls that did not fire are removed; they are re-armed next iteration for the current descriptors
+    for (int k = 0; k < num_control_fds; k++) {
+        if (!fired[k]) {
+            uring_prep_poll_remove(&uring, URING_USER_DATA(URING_OP_POLL, poll_generation, k));
+        }
+    }
+    uring_last_send_fd = -1;
+    return ready;
+}
+
+// Message handlers are looked up in tables indexed by message code, filled once at startup, so a
+// message costs one indexed load and an indirect call instead of a comparison chain, and a code
+// without a handler is unexpected. The client table only holds the handlers of this server's role.
+// The peer table is indexed by P2P state as well: handshake messages only have a handler in the
+// state they are valid in.
+#define MSG_CODE_LIMIT 256 // Codes are 0 to 255 (ERROR_MSG)
+
+typedef void (*ClientHandler)(int i, char *payload);
+typedef int (*PeerHandler)(PeerLink *link, char *payload); // Returns -1 if the server must shut down
+
+ClientHandler client_handlers[MSG_CODE_LIMIT];
+PeerHandler peer_handlers[NUM_P2P_STATES][MSG_CODE_LIMIT];
+
+static int peer_unexpected(PeerLink *link, int code) {
+    char log_msg[150];
+    sprintf(log_msg, "Unexpected P2P message (Code=%d) or invalid state (%d).", code, link->state);
+    log_info(log_msg);
+    return 0;
+}
+
+// REQ_CONNPEER while listening: the peer connected to us
+static int peer_connpeer_request(PeerLink *link, char *payload) {
+    (void)payload;
+    char log_msg[150];
+    char msg_out[MAX_MSG_SIZE];
+
+    snprintf(link->my_pids, sizeof(link->my_pids), "Peer%d_Active", link->socket_fd);
+    sprintf(log_msg, "Connected peer assigned ID: %s", link->my_pids);
+    log_info(log_msg);
+
+    build_control_message(msg_out, sizeof(msg_out), RES_CONNPEER, link->my_pids);
+    if (peer_write_socket(link, msg_out, strlen(msg_out)) < 0) {
+        log_error("Failed to send RES_CONNPEER.");
+        close_peer_socket(link);
+        link->state = P2P_DISCONNECTED;
+    } else {
+        log_info("RES_CONNPEER sent.");
+        link->state = P2P_RES_SENT_AWAITING_RES;
+    }
+    return 0;
+}
+
+// RES_CONNPEER after our REQ_CONNPEER
+static int peer_connpeer_active(PeerLink *link, char *payload) {
+    char log_msg[150];
+    char msg_out[MAX_MSG_SIZE];
+
+    strncpy(link->peer_pids, payload, sizeof(link->peer_pids) - 1);
+    link->peer_pids[sizeof(link->peer_pids) - 1] = '\0';
+
+    snprintf(link->my_pids, sizeof(link->my_pids), "Peer%d_Passive", link->socket_fd);
+    log_info("P2P handshake complete (active side). Sending confirmation...");
+
+    build_control_message(msg_out, sizeof(msg_out), RES_CONNPEER, link->my_pids);
+    if (peer_write_socket(link, msg_out, strlen(msg_out)) < 0) {
+        log_error("Failed to send RES_CONNPEER confirmation.");
+        close_peer_socket(link);
+        link->state = P2P_DISCONNECTED;
+    } else {
+        link->state = P2P_FULLY_ESTABLISHED;
+        sprintf(log_msg, "P2P connection with peer %s (ID: %s) fully established.",
+                link->my_pids, link->peer_pids);
+        log_info(log_msg);
+        on_peer_established(link);
+        if (p2p_shm_enabled && current_server_role == SERVER_TYPE_STATUS) offer_peer_shm(link);
+    }
+    return 0;
+}
+
+// RES_CONNPEER confirming ours (passive side)
+static int peer_connpeer_passive(PeerLink *link, char *payload) {
+    char log_msg[150];
+
+    strncpy(link->peer_pids, payload, sizeof(link->peer_pids) - 1);
+    link->peer_pids[sizeof(link->peer_pids) - 1] = '\0';
+
+    link->state = P2P_FULLY_ESTABLISHED;
+    sprintf(log_msg, "P2P connection with peer %s (ID: %s) fully established.",
+            link->my_pids, link->peer_pids);
+    log_info(log_msg);
+    on_peer_established(link);
+    if (p2p_shm_enabled && current_server_role == SERVER_TYPE_STATUS) offer_peer_shm(link);
+    return 0;
+}
+
+// REQ_DISCPEER: the peer leaves
+static int peer_discpeer(PeerLink *link, char *payload) {
+    char log_msg[150];
+    char msg_out[MAX_MSG_SIZE];
+    char payload_out[10];
+
+    if (strcmp(payload, link->peer_pids) == 0) {
+        sprintf(log_msg, "REQ_DISCPEER received from peer %s (ID: %s). Confirming.", link->my_pids, link->peer_pids);
+        log_info(log_msg);
+
+        sprintf(payload_out, "%02d", OK_SUCCESSFUL_DISCONNECT);
+        build_control_message(msg_out, sizeof(msg_out), OK_MSG, payload_out);
+
+        if (peer_write_socket(link, msg_out, strlen(msg_out)) < 0) {
+            log_error("Failed to send OK(01) to peer.");
+        } else {
+            log_info("OK(01) sent to peer.");
+        }
+
+        sprintf(log_msg, "Peer %s disconnected.", link->my_pids);
+        log_info(log_msg);
+
+        close_peer_socket(link);
+        link->state = P2P_DISCONNECTED;
+        link->my_pids[0] = '\0';
+        link->peer_pids[0] = '\0';
+
+        log_info("Switching to passive P2P listening...");
+
+        start_passive_p2p_listener();
+    } else {
+        sprintf(log_msg, "REQ_DISCPEER received with mismatched ID '%s'. Expected '%s'. Sending ERROR(02).", payload, link->peer_pids);
+        log_info(log_msg);
+
+        sprintf(payload_out, "%02d", PEER_NOT_FOUND);
+        build_control_message(msg_out, sizeof(msg_out), ERROR_MSG, payload_out);
+
+        if (peer_write_socket(link, msg_out, strlen(msg_out)) < 0) {
+            log_error("Failed to send ERROR(02) to peer.");
+        }
+    }
+    return 0;
+}
+
+// OK(01): the peer confirmed our REQ_DISCPEER. The server shuts down once every peer sent REQ_DISCPEER has.
+static int peer_ok(PeerLink *link, char *payload) {
+    char log_msg[150];
+
+    if (atoi(payload) != OK_SUCCESSFUL_DISCONNECT || link->state != P2P_DISCONNECT_REQ_SENT) {
+        return peer_unexpected(link, OK_MSG);
+    }
+    log_info("OK(01) 'Successful disconnect' received from peer.");
+    sprintf(log_msg, "Peer %s disconnected.", link->my_pids);
+    log_info(log_msg);
+
+    close_peer_socket(link);
+    link->state = P2P_DISCONNECTED;
+    link->my_pids[0] = '\0';
+    link->peer_pids[0] = '\0';
+
+    for (int n = 0; n < MAX_PEERS; n++) {
+        if (peer_links[n].state == P2P_DISCONNECT_REQ_SENT) return 0;
+    }
+    log_info("Server shutting down after peer disconnection.");
+    return -1;
+}
+
+// ERROR(02): the peer does not know us
+static int peer_error(PeerLink *link, char *payload) {
+    if (atoi(payload) != PEER_NOT_FOUND) return peer_unexpected(link, ERROR_MSG);
+    log_info("ERROR(02) 'Peer not found' received from peer.");
+    close_peer_socket(link);
+    link->state = P2P_DISCONNECTED;
+    return 0;
+}
+
+// REQ_HEARTBEAT: liveness probe
+static int peer_heartbeat(PeerLink *link, char *payload) {
+    (void)payload;
+    char msg_out[MAX_MSG_SIZE];
+
+    build_control_message(msg_out, sizeof(msg_out), RES_HEARTBEAT, NULL);
+    if (send_to_peer(link, msg_out) < 0) {
+        log_error("Failed to send RES_HEARTBEAT to peer.");
+    }
+    return 0;
+}
+
+// RES_HEARTBEAT: only proves the peer is alive; the caller restarts the peer timer
+static int peer_heartbeat_response(PeerLink *link, char *payload) {
+    (void)link;
+    (void)payload;
+    return 0;
+}
+
+// REQ_P2PSHM (SL, established link): offer of the shared-memory transport
+static int peer_p2pshm_request(PeerLink *link, char *payload) {
+    accept_peer_shm(link, payload);
+    return 0;
+}
+
+// RES_P2PSHM (SS): answer to our offer
+static int peer_p2pshm_response(PeerLink *link, char *payload) {
+    if (link->shm.region == NULL) return peer_unexpected(link, RES_P2PSHM);
+    if (atoi(payload) == 1) {
+        // The SL sent RES_P2PSHM on the socket before anything through the rings, so the
+        // rings are only read from now on and messages stay in order
+        link->shm_active = 1;
+        log_info("P2P link switched to shared memory.");
+    } else {
+        log_info("SL declined the shared-memory P2P link. Staying on the socket.");
+        close_peer_shm(link);
+    }
+    return 0;
+}
+
+// RES_REPLSYNC (SS)
+static int peer_replsync_response(PeerLink *link, char *payload) {
+    (void)link;
+    replica_begin_sync(payload);
+    return 0;
+}
+
+// REPL_DELTA (SS)
+static int peer_repl_delta(PeerLink *link, char *payload) {
+    (void)link;
+    replica_apply_delta(payload);
+    return 0;
+}
+
+// REQ_CHECKALERT (SL): location of a sensor for the SS
+static int peer_checkalert(PeerLink *link, char *payload) {
+    char log_msg[150];
+    char msg_out[MAX_MSG_SIZE];
+    char payload_out[10];
+
+    char sensor_id[MAX_PIDS_LENGTH];
+    strncpy(sensor_id, payload, sizeof(sensor_id) - 1);
+    sensor_id[sizeof(sensor_id) - 1] = '\0';
+
+    sprintf(log_msg, "[SL] REQ_CHECKALERT for sensor %s", sensor_id);
+    log_info(log_msg);
+
+    int found_loc_id = find_sensor_location(sensor_id_parse(sensor_id));
+
+    if (found_loc_id > 0) {
+        sprintf(payload_out, "%d", found_loc_id);
+        build_control_message(msg_out, sizeof(msg_out), RES_CHECKALERT, payload_out);
+        sprintf(log_msg, "[SL] Found location %d for sensor %s. Sending RES_CHECKALERT.", found_loc_id, sensor_id);
+        log_info(log_msg);
+    } else {
+        sprintf(payload_out, "%02d", SENSOR_NOT_FOUND);
+        build_control_message(msg_out, sizeof(msg_out), ERROR_MSG, payload_out);
+        sprintf(log_msg, "[SL] Sensor %s not found. Sending ERROR(10).", sensor_id);
+        log_info(log_msg);
+    }
+
+    if (send_to_peer(link, msg_out) < 0) {
+        log_error("SL: Failed to send response to REQ_CHECKALERT.");
+    }
+    return 0;
+}
+
+// REQ_REPLSYNC (SL, established link): the SS synchronizes its replica
+static int peer_replsync(PeerLink *link, char *payload) {
+    repl_serve_sync(link->socket_fd, payload);
+    link->repl_subscribed = 1;
+    return 0;
+}
+
+// Handles one P2P message with the handler of the current handshake state and its code.
+// Returns -1 if the server must shut down (the peer confirmed our REQ_DISCPEER), 0 otherwise.
+int handle_peer_message(PeerLink *link, char *buffer) {
+    char log_msg[150];
+
+    int code;
+    char payload[MAX_MSG_SIZE];
+
+    if (parse_message(buffer, &code, payload, sizeof(payload))) {
+        sprintf(log_msg, "P2P message received: Code=%d, Payload='%s'", code, payload);
+        log_info(log_msg);
+
+        PeerHandler handler = code >= 0 && code < MSG_CODE_LIMIT ? peer_handlers[link->state][code] : NULL;
+        return handler != NULL ? handler(link, payload) : peer_unexpected(link, code);
+    } else {
+        log_error("Failed to parse P2P message.");
+        close_peer_socket(link);
+        link->state = P2P_DISCONNECTED;
+    }
+    return 0;
+}
+
+// Appends bytes received from the peer, on the socket or through the shared-memory link,
+// and handles the complete messages. Returns -1 if the server must shut down, 0 otherwise.
+int process_peer_data(PeerLink *link, const char *data, size_t len) {
+    if (message_buffer_append(&link->rx, data, len) < 0) {
+        log_error("P2P message too long. Closing peer connection.");
+        reset_peer_connection(link);
+    }
+    char message[MAX_MSG_SIZE + 1];
+    while (link->socket_fd > 0 && message_buffer_next(&link->rx, message, sizeof(message))) {
+        capture_write(&capture, CAPTURE_PEER_CONN, CAPTURE_RECV, message, strlen(message));
+        current_trace_id = trace_strip(message);
+        current_trace_start_us = current_trace_id != 0 ? monotonic_us() : 0;
+        int peer_result = handle_peer_message(link, message);
+        if (current_trace_id != 0) {
+            trace_span(current_trace_id, "peer", atoi(message), current_trace_start_us, monotonic_us());
+            current_trace_id = 0;
+        }
+        if (peer_result < 0) return -1;
+    }
+    refresh_peer_timer(link);
+    return 0;
+}
+
+// REQ_CONNSEN: registers the sensor of slot i
+static void client_connsen(int i, char *payload) {
+    int client_fd = client_fds[i];
+    char log_msg[150];
+
+    char sensor_id[MAX_PIDS_LENGTH];
+    uint64_t sensor_key = SENSOR_KEY_NONE;
+    char loc_id_str[10];
+    int loc_id;
+    int valid = 0;
+
+    char *comma = strchr(payload, ',');
+    if (comma != NULL) {
+        size_t id_len = comma - payload;
+        if (id_len > 0 && id_len < MAX_PIDS_LENGTH) {
+            strncpy(sensor_id, payload, id_len);
+            sensor_id[id_len] = '\0';
+
+            strncpy(loc_id_str, comma + 1, sizeof(loc_id_str) - 1);
+            loc_id_str[sizeof(loc_id_str) - 1] = '\0';
+
+            if (strlen(loc_id_str) > 0) {
+                loc_id = atoi(loc_id_str);
+                if (loc_id == -1) {
+                    // Generate random location between 1 and 10
+                    loc_id = rng_below(10) + 1;
+                }
+                sensor_key = sensor_id_decode(sensor_id, id_len);
+                if (sensor_key != SENSOR_KEY_NONE) {
+                    valid = 1;
+                    sprintf(log_msg, "REQ_CONNSEN parsed: ID='%s', LocId=%d", sensor_id, loc_id);
+                    log_info(log_msg);
+                } else {
+                    log_error("REQ_CONNSEN: Sensor ID must be exactly 10 digits.");
+                }
+            } else {
+                log_error("REQ_CONNSEN: Missing LocId.");
+            }
+        } else {
+            log_error("REQ_CONNSEN: Invalid sensor ID length.");
+        }
+    } else {
+        log_error("REQ_CONNSEN: Invalid format, expected 'ID,LocId'.");
+    }
+
+    if (!valid) {
+        char err_payload[10];
+        sprintf(err_payload, "%02d", INVALID_PAYLOAD_ERROR);
+        char msg_err[MAX_MSG_SIZE];
+        build_control_message(msg_err, sizeof(msg_err), ERROR_MSG, err_payload);
+        send_to_client(client_fd, msg_err);
+        drop_client(i);
+        return;
+    }
+
+    if (connected_clients[i].socket_fd != client_fd) {
+        sprintf(log_msg, "Mismatch in client slot %d: socket %d != %d. Closing connection.",
+                i, connected_clients[i].socket_fd, client_fd);
+        log_error(log_msg);
+        drop_client(i);
+        return;
+    }
+
+    if (connected_clients[i].sensor_key == SENSOR_KEY_NONE) {
+        int k = sensor_index_find(sensor_key);
+        if (k >= 0) {
+            sprintf(log_msg, "Sensor ID '%s' already in use (slot %d). Rejecting.", sensor_id, k + 1);
+            log_error(log_msg);
+
+            char err_payload[10];
+            sprintf(err_payload, "%02d", SENSOR_ID_ALREADY_EXISTS_ERROR);
+            char msg_err[MAX_MSG_SIZE];
+            build_control_message(msg_err, sizeof(msg_err), ERROR_MSG, err_payload);
+            send_to_client(client_fd, msg_err);
+            drop_client(i);
+            return;
+        }
+
+        if (num_connected_clients >= MAX_CLIENTS) {
+            log_info("Sensor limit reached. Sending ERROR(09).");
+            char err_payload[10];
+            sprintf(err_payload, "%02d", SENSOR_LIMIT_EXCEEDED);
+            char msg_err[MAX_MSG_SIZE];
+            build_control_message(msg_err, sizeof(msg_err), ERROR_MSG, err_payload);
+            send_to_client(client_fd, msg_err);
+            drop_client(i);
+            return;
+        }
+
+        connected_clients[i].sensor_key = sensor_key;
+        sensor_index_insert(i);
+        connected_clients[i].location_id = loc_id;
+        connected_clients[i].assigned_slot = i + 1;
+        if (current_server_role == SERVER_TYPE_STATUS) {
+            connected_clients[i].risk_status = rng_below(2); // Random risk status for SS
+            // Log the risk status
+            sprintf(log_msg, "Client %s added (Status%d)",
+                    sensor_id,
+                    connected_clients[i].risk_status);
+            log_info(log_msg);
+        } else {
+            if (connected_clients[i].location_id == -1) {
+            // If location_id is -1, assign a random location between 1 and 15
+            connected_clients[i].location_id = rng_below(15) + 1;
+            }
+            printf(log_msg, "Client %s added (Loc %d)",
+                    sensor_id,
+                    connected_clients[i].location_id);
+        }
+        num_connected_clients++;
+        reading_seen[i] = 0;
+        location_index_insert(i);
+        update_region_stats(connected_clients[i].location_id, 1, connected_clients[i].risk_status == 1);
+        alert_list_update(i);
+        repl_publish('R', i);
+        history_attach(i);
+        history_record(i, HISTORY_LOCATION, connected_clients[i].location_id);
+        if (current_server_role == SERVER_TYPE_STATUS) {
+            history_record(i, HISTORY_RISK, connected_clients[i].risk_status);
+        }
+
+        udp_grant_issue(sensor_key, connected_clients[i].assigned_slot);
+
+        sprintf(log_msg, "Client registered: ID='%s', Slot=%d, LocId=%d",
+                sensor_id, connected_clients[i].assigned_slot, loc_id);
+        log_info(log_msg);
+
+        char slot_str[10];
+        sprintf(slot_str, "%d", connected_clients[i].assigned_slot);
+        char res_msg[MAX_MSG_SIZE];
+        build_control_message(res_msg, sizeof(res_msg), RES_CONNSEN, slot_str);
+        send_to_client(client_fd, res_msg);
+
+    } else {
+        if (connected_clients[i].sensor_key == sensor_key) {
+            sprintf(log_msg, "Client %s re-sent REQ_CONNSEN. Re-sending RES_CONNSEN.", sensor_id);
+            log_info(log_msg);
+            char res_msg[MAX_MSG_SIZE];
+            build_control_message(res_msg, sizeof(res_msg), RES_CONNSEN, sensor_id);
+            send_to_client(client_fd, res_msg);
+        } else {
+            char registered_id[SENSOR_ID_STR_SIZE];
+            sensor_id_format(connected_clients[i].sensor_key, registered_id, sizeof(registered_id));
+            sprintf(log_msg, "Client slot %d already registered with ID %s. Ignoring conflicting REQ_CONNSEN with ID %s.",
+                    i + 1, registered_id, sensor_id);
+            log_error(log_msg);
+        }
+    }
+}
+
+// REQ_CONNSEN on a read replica (SLR): registrations belong to the primary SL
+static void client_connsen_on_replica(int i, char *payload) {
+    int client_fd = client_fds[i];
+    (void)payload;
+
+    log_info("REQ_CONNSEN on a read replica. Sending ERROR(05).");
+    char err_payload[10];
+    sprintf(err_payload, "%02d", INVALID_MSG_CODE_ERROR);
+    char msg_err[MAX_MSG_SIZE];
+    build_control_message(msg_err, sizeof(msg_err), ERROR_MSG, err_payload);
+    send_to_client(client_fd, msg_err);
+}
+
+// REQ_DISCSEN: disconnects the sensor of slot i
+static void client_discsen(int i, char *payload) {
+    int client_fd = client_fds[i];
+    char log_msg[150];
+
+    char slot_str[10];
+    strncpy(slot_str, payload, sizeof(slot_str) - 1);
+    slot_str[sizeof(slot_str) - 1] = '\0';
+    int received_slot = atoi(slot_str);
+
+    if (connected_clients[i].socket_fd == client_fd &&
+        connected_clients[i].assigned_slot == received_slot &&
+        connected_clients[i].sensor_key != SENSOR_KEY_NONE) {
+
+        char sensor_id[SENSOR_ID_STR_SIZE];
+        sensor_id_format(connected_clients[i].sensor_key, sensor_id, sizeof(sensor_id));
+        sprintf(log_msg, "Client (ID: %s, Slot: %d) disconnected.",
+                sensor_id, connected_clients[i].assigned_slot);
+        log_info(log_msg);
+
+        char ok_payload[10];
+        sprintf(ok_payload, "%02d", OK_SUCCESSFUL_DISCONNECT);
+        char msg_ok[MAX_MSG_SIZE];
+        build_control_message(msg_ok, sizeof(msg_ok), OK_MSG, ok_payload);
+        send_to_client(client_fd, msg_ok);
+
+        udp_grant_revoke(connected_clients[i].sensor_key);
+        drop_client(i);
+    } else {
+        sprintf(log_msg, "Invalid REQ_DISCSEN: slot '%s' mismatch or client not registered. Sending ERROR(10).",
+                slot_str);
+        log_info(log_msg);
+
+        char err_payload[10];
+        sprintf(err_payload, "%02d", SENSOR_NOT_FOUND);
+        char msg_err[MAX_MSG_SIZE];
+        build_control_message(msg_err, sizeof(msg_err), ERROR_MSG, err_payload);
+        send_to_client(client_fd, msg_err);
+    }
+}
+
+// REQ_HEARTBEAT: liveness probe
+static void client_heartbeat(int i, char *payload) {
+    (void)payload;
+    int client_fd = client_fds[i];
+
+    char msg_out[MAX_MSG_SIZE];
+    build_control_message(msg_out, sizeof(msg_out), RES_HEARTBEAT, NULL);
+    send_to_client(client_fd, msg_out);
+}
+
+// RES_HEARTBEAT: only proves the client is alive; its idle timer was already restarted
+static void client_heartbeat_response(int i, char *payload) {
+    (void)i;
+    (void)payload;
+}
+
+// REQ_SENSSTATUS (SS): risk status of the requesting sensor
+static void client_sensstatus(int i, char *payload) {
+    int client_fd = client_fds[i];
+    char log_msg[150];
+
+    int slot_id = atoi(payload);
+
+    if (connected_clients[i].socket_fd == client_fd &&
+        connected_clients[i].assigned_slot == slot_id &&
+        connected_clients[i].sensor_key != SENSOR_KEY_NONE) {
+
+        char sensor_id[SENSOR_ID_STR_SIZE];
+        sensor_id_format(connected_clients[i].sensor_key, sensor_id, sizeof(sensor_id));
+        sprintf(log_msg, "REQ_SENSSTATUS from sensor %s (Slot: %d)",
+                sensor_id, connected_clients[i].assigned_slot);
+        log_info(log_msg);
+
+        char msg_to_client[MAX_MSG_SIZE];
+        build_sensor_status_response(&connected_clients[i], msg_to_client, sizeof(msg_to_client));
+        send_to_client(client_fd, msg_to_client);
+    } else {
+        sprintf(log_msg, "Invalid REQ_SENSSTATUS from client. Slot mismatch or not registered.");
+        log_error(log_msg);
+        char err_payload[10];
+        sprintf(err_payload, "%02d", SENSOR_NOT_FOUND);
+        char msg_err[MAX_MSG_SIZE];
+        build_control_message(msg_err, sizeof(msg_err), ERROR_MSG, err_payload);
+        send_to_client(client_fd, msg_err);
+    }
+}
+
+// REQ_READING (SS): sent periodically by sensors, stored without a reply, errors only
+static void client_reading(int i, char *payload) {
+    int client_fd = client_fds[i];
+    char log_msg[150];
+
+    char *end;
+    float value = strtof(payload, &end);
+    int error = 0;
+    if (connected_clients[i].sensor_key == SENSOR_KEY_NONE) {
+        error = SENSOR_NOT_FOUND;
+    } else if (end == payload || *end != '\0' || !isfinite(value)) {
+        error = INVALID_PAYLOAD_ERROR;
+    }
+    if (error != 0) {
+        sprintf(log_msg, "Invalid REQ_READING '%.20s' from slot %d. Sending ERROR(%02d).", payload, i + 1, error);
+        log_info(log_msg);
+        char err_payload[10];
+        sprintf(err_payload, "%02d", error);
+        char msg_err[MAX_MSG_SIZE];
+        build_control_message(msg_err, sizeof(msg_err), ERROR_MSG, err_payload);
+        send_to_client(client_fd, msg_err);
+    } else {
+        record_reading(i, value);
+    }
+}
+
+// REQ_SENSLOC (SL, SLR): location of a sensor
+static void client_sensloc(int i, char *payload) {
+    int client_fd = client_fds[i];
+    char log_msg[150];
+
+    char sensor_id[MAX_PIDS_LENGTH];
+    strncpy(sensor_id, payload, sizeof(sensor_id) - 1);
+    sensor_id[sizeof(sensor_id) - 1] = '\0';
+
+    int loc_id_found = lookup_sensor_location(sensor_id_parse(sensor_id));
+
+    char msg_out[MAX_MSG_SIZE];
+    if (loc_id_found != -1) {
+        sprintf(log_msg, "Sensor %s found with LocId=%d", sensor_id, loc_id_found);
+        log_info(log_msg);
+        char loc_str[10];
+        sprintf(loc_str, "%d", loc_id_found);
+        build_control_message(msg_out, sizeof(msg_out), RES_SENSLOC, loc_str);
+    } else {
+        log_info("Sensor not found. Sending ERROR(10).");
+        char err_payload[10];
+        sprintf(err_payload, "%02d", SENSOR_NOT_FOUND);
+        build_control_message(msg_out, sizeof(msg_out), ERROR_MSG, err_payload);
+    }
+    send_to_client(client_fd, msg_out);
+}
+
+// REQ_LOCLIST (SL, SLR): sensors at a location
+static void client_loclist(int i, char *payload) {
+    int client_fd = client_fds[i];
+    char log_msg[150];
+
+    char requester_slot_str[10], target_loc_str[10];
+    int target_loc_id = -1;
+    int valid = 0;
+
+    char *comma = strchr(payload, ',');
+    if (comma != NULL) {
+        size_t slot_len = comma - payload;
+        if (slot_len > 0 && slot_len < sizeof(requester_slot_str)) {
+            strncpy(requester_slot_str, payload, slot_len);
+            requester_slot_str[slot_len] = '\0';
+            strncpy(target_loc_str, comma + 1, sizeof(target_loc_str) - 1);
+            target_loc_str[sizeof(target_loc_str) - 1] = '\0';
+            target_loc_id = atoi(target_loc_str);
+            valid = 1;
+        }
+    }
+
+    if (!valid || target_loc_id < 1 || target_loc_id > NUM_LOCATIONS) {
+        log_error("REQ_LOCLIST: Invalid format or location.");
+        char err_payload[10];
+        sprintf(err_payload, "%02d", SENSOR_NOT_FOUND);
+        char msg_err[MAX_MSG_SIZE];
+        build_control_message(msg_err, sizeof(msg_err), ERROR_MSG, err_payload);
+        send_to_client(client_fd, msg_err);
+        return;
+    }
+
+    int cached;
+    const LocListCacheEntry *response = loclist_response(target_loc_id, &cached);
+    if (response->count > 0) {
+        sprintf(log_msg, "Found %d sensors at location %d%s", response->count, target_loc_id,
+                cached ? " (cached)" : "");
+    } else {
+        sprintf(log_msg, "No sensors found at location %d%s. Sending ERROR(10).", target_loc_id,
+                cached ? " (cached)" : "");
+    }
+    log_info(log_msg);
+
+    send_to_client(client_fd, response->message);
+}
+
+// REQ_LOCUPDATE (SL): sent several times per second by moving sensors, staged without a reply, errors only
+static void client_locupdate(int i, char *payload) {
+    int client_fd = client_fds[i];
+    char log_msg[150];
+
+    int loc_id = atoi(payload);
+    int error = 0;
+    if (connected_clients[i].sensor_key == SENSOR_KEY_NONE) {
+        error = SENSOR_NOT_FOUND;
+    } else if (loc_id < 1 || loc_id > NUM_LOCATIONS) {
+        error = INVALID_PAYLOAD_ERROR;
+    }
+    if (error != 0) {
+        sprintf(log_msg, "Invalid REQ_LOCUPDATE '%s' from slot %d. Sending ERROR(%02d).", payload, i + 1, error);
+        log_info(log_msg);
+        char err_payload[10];
+        sprintf(err_payload, "%02d", error);
+        char msg_err[MAX_MSG_SIZE];
+        build_control_message(msg_err, sizeof(msg_err), ERROR_MSG, err_payload);
+        send_to_client(client_fd, msg_err);
+    } else {
+        stage_location_update(i, loc_id);
+    }
+}
+
+// REQ_REPLSYNC (SL): a read replica subscribes to registry changes. Its connection leaves the
+// client table for repl_subscribers, which frees the sensor slot it was accepted into.
+static void client_replsync(int i, char *payload) {
+    int client_fd = client_fds[i];
+    char log_msg[150];
+
+    ReplSubscriber *sub = free_repl_subscriber();
+    if (connected_clients[i].sensor_key != SENSOR_KEY_NONE || sub == NULL) {
+        sprintf(log_msg, "REQ_REPLSYNC from %s refused: %s. Sending ERROR(%02d).", client_addr_desc[i],
+                sub == NULL ? "read replica limit reached" : "connection holds a sensor registration",
+                sub == NULL ? SENSOR_LIMIT_EXCEEDED : INVALID_MSG_CODE_ERROR);
+        log_info(log_msg);
+        char err_payload[10];
+        sprintf(err_payload, "%02d", sub == NULL ? SENSOR_LIMIT_EXCEEDED : INVALID_MSG_CODE_ERROR);
+        char msg_err[MAX_MSG_SIZE];
+        build_control_message(msg_err, sizeof(msg_err), ERROR_MSG, err_payload);
+        send_to_client(client_fd, msg_err);
+        return;
+    }
+
+    if (io_backend == IO_BACKEND_URING) {
+        uring_prep_cancel(&uring, URING_USER_DATA(URING_OP_RECV, client_generation[i], i));
+        uring_submit(&uring, 0);
+        uring_last_send_fd = -1;
+        client_generation[i]++;
+    }
+    timer_cancel(&timer_wheel, &client_idle_timers[i]);
+    sub->fd = client_fd;
+    memcpy(sub->addr_desc, client_addr_desc[i], sizeof(sub->addr_desc));
+    sub->rx = client_rx[i];
+    memcpy(sub->tx, client_tx[i], client_tx_len[i]);
+    sub->tx_len = client_tx_len[i];
+    client_fds[i] = 0; // Later requests queued from this connection are discarded
+    client_tx_len[i] = 0;
+    client_queued[i] = 0;
+
+    sprintf(log_msg, "Read replica %s subscribed to registry changes.", sub->addr_desc);
+    log_info(log_msg);
+    repl_serve_sync(client_fd, payload);
+}
+
+// Handles the data a read replica sent (SL only): a new REQ_REPLSYNC after a gap, or heartbeat replies
+void handle_repl_subscriber_data(ReplSubscriber *sub, char *buffer, ssize_t bytes_read) {
+    char log_msg[150];
+    char message[MAX_MSG_SIZE + 1];
+    char payload[MAX_MSG_SIZE];
+    int code;
+
+    if (bytes_read <= 0 || message_buffer_append(&sub->rx, buffer, bytes_read) < 0) {
+        close_repl_subscriber(sub);
+        return;
+    }
+    while (sub->fd > 0 && message_buffer_next(&sub->rx, message, sizeof(message))) {
+        trace_strip(message);
+        if (!parse_message(message, &code, payload, sizeof(payload))) {
+            log_error("Failed to parse message from a read replica.");
+        } else if (code == REQ_REPLSYNC) {
+            repl_serve_sync(sub->fd, payload);
+        } else if (code != RES_HEARTBEAT) {
+            sprintf(log_msg, "Unexpected message from read replica %s: Code=%d", sub->addr_desc, code);
+            log_info(log_msg);
+        }
+    }
+}
+
+// REQ_HISTORY: points of a sensor history
+static void client_history_query(int i, char *payload) {
+    int client_fd = client_fds[i];
+    char log_msg[150];
+
+    char points[MAX_MSG_SIZE];
+    char msg_out[MAX_MSG_SIZE];
+    int error = build_history_response(payload, points, sizeof(points));
+    if (error != 0) {
+        sprintf(log_msg, "REQ_HISTORY '%.60s' from slot %d: Sending ERROR(%02d).", payload, i + 1, error);
+        log_info(log_msg);
+        char err_payload[10];
+        sprintf(err_payload, "%02d", error);
+        build_control_message(msg_out, sizeof(msg_out), ERROR_MSG, err_payload);
+    } else {
+        build_control_message(msg_out, sizeof(msg_out), RES_HISTORY, points);
+    }
+    send_to_client(client_fd, msg_out);
+}
+
+// REQ_ALERTLIST (SS): sensors in alert with their locations
+static void client_alertlist(int i, char *payload) {
+    int client_fd = client_fds[i];
+    char msg_out[MAX_MSG_SIZE];
+    char list[MAX_MSG_SIZE - 8];
+
+    int error = build_alert_list(payload, list, sizeof(list));
+    if (error != 0) {
+        char err_payload[10];
+        sprintf(err_payload, "%02d", error);
+        build_control_message(msg_out, sizeof(msg_out), ERROR_MSG, err_payload);
+    } else {
+        build_control_message(msg_out, sizeof(msg_out), RES_ALERTLIST, list);
+    }
+    send_to_client(client_fd, msg_out);
+}
+
+// REQ_REGIONSUM: sensor and alert counts per region and location
+static void client_regionsum(int i, char *payload) {
+    (void)payload;
+    int client_fd = client_fds[i];
+
+    char summary[MAX_MSG_SIZE];
+    build_region_summary(summary, sizeof(summary));
+    char msg_out[MAX_MSG_SIZE];
+    build_control_message(msg_out, sizeof(msg_out), RES_REGIONSUM, summary);
+    send_to_client(client_fd, msg_out);
+}
+
+// Handles one complete message from the client in slot i.
+void handle_client_message(int i, char *buffer) {
+    int client_fd = client_fds[i];
+    char log_msg[150];
+
+    touch_client(i);
+
+    int code;
+    char payload[MAX_MSG_SIZE];
+
+    sprintf(log_msg, "Data received from client %s (socket %d)", client_addr_desc[i], client_fd);
+    log_info(log_msg);
+
+    if (parse_message(buffer, &code, payload, sizeof(payload))) {
+        if (current_trace_id != 0) trace_span(current_trace_id, "parse", code, current_trace_start_us, monotonic_us());
+        //sprintf(log_msg, "Parsed client message: Code=%d, Payload='%s'", code, payload);
+        //log_info(log_msg);
+
+        ClientHandler handler = code >= 0 && code < MSG_CODE_LIMIT ? client_handlers[code] : NULL;
+        if (handler != NULL) {
+            handler(i, payload);
+        } else {
+            sprintf(log_msg, "Unknown or unexpected client message code: %d", code);
+            log_info(log_msg);
+        }
+    } else {
+        log_error("Failed to parse client message.");
+    }
+}
+
+// Fills the handler tables for the role of this server
+void init_message_handlers(void) {
+    ServerRole role = current_server_role;
+
+    client_handlers[REQ_CONNSEN] = role == SERVER_TYPE_LOCATION_REPLICA ? client_connsen_on_replica : client_connsen;
+    client_handlers[REQ_DISCSEN] = client_discsen;
+    client_handlers[REQ_HEARTBEAT] = client_heartbeat;
+    client_handlers[RES_HEARTBEAT] = client_heartbeat_response;
+    client_handlers[REQ_HISTORY] = client_history_query;
+    client_handlers[REQ_REGIONSUM] = client_regionsum;
+    if (role == SERVER_TYPE_STATUS) {
+        client_handlers[REQ_SENSSTATUS] = client_sensstatus;
+        client_handlers[REQ_READING] = client_reading;
+        client_handlers[REQ_ALERTLIST] = client_alertlist;
+    } else {
+        client_handlers[REQ_SENSLOC] = client_sensloc;
+        client_handlers[REQ_LOCLIST] = client_loclist;
+    }
+    if (role == SERVER_TYPE_LOCATION) {
+        client_handlers[REQ_LOCUPDATE] = client_locupdate;
+        client_handlers[REQ_REPLSYNC] = client_replsync;
+    }
+
+    for (int state = 0; state < NUM_P2P_STATES; state++) {
+        PeerHandler *handlers = peer_handlers[state];
+        handlers[REQ_DISCPEER] = peer_discpeer;
+        handlers[OK_MSG] = peer_ok;
+        handlers[ERROR_MSG] = peer_error;
+        handlers[REQ_HEARTBEAT] = peer_heartbeat;
+        handlers[RES_HEARTBEAT] = peer_heartbeat_response;
+    }
+    peer_handlers[P2P_PASSIVE_LISTENING][REQ_CONNPEER] = peer_connpeer_request;
+    peer_handlers[P2P_REQ_SENT][RES_CONNPEER] = peer_connpeer_active;
+    peer_handlers[P2P_RES_SENT_AWAITING_RES][RES_CONNPEER] = peer_connpeer_passive;
+
+    // Data messages are only accepted from a peer that completed the handshake
+    PeerHandler *established = peer_handlers[P2P_FULLY_ESTABLISHED];
+    if (role == SERVER_TYPE_STATUS) {
+        established[RES_P2PSHM] = peer_p2pshm_response;
+        established[RES_REPLSYNC] = peer_replsync_response;
+        established[REPL_DELTA] = peer_repl_delta;
+    } else if (role == SERVER_TYPE_LOCATION) {
+        established[REQ_CHECKALERT] = peer_checkalert;
+        established[REQ_P2PSHM] = peer_p2pshm_request;
+        established[REQ_REPLSYNC] = peer_replsync;
+    }
+}
+
+// Processes the result of one read from the client in slot i.
+// bytes_read > 0 means buffer holds the received data, which may contain several messages
+// or part of one; 0 means the client closed the connection and < 0 is a read error.
+// Handles a request taken from a queue (or one that could not be queued)
+void dispatch_client_request(int i, char *message, uint64_t trace_id, uint64_t start_us) {
+    current_trace_id = trace_id;
+    if (trace_id == 0) {
+        handle_client_message(i, message);
+    } else {
+        current_trace_start_us = start_us;
+        handle_client_message(i, message);
+        trace_span(trace_id, "client", atoi(message), start_us, monotonic_us());
+        current_trace_id = 0;
+    }
+}
+
+static RequestClass request_class(int code) {
+    switch (code) {
+    case REQ_LOCLIST:
+    case REQ_REGIONSUM:
+    case REQ_ALERTLIST:
+    case REQ_HISTORY:
+        return REQUEST_CLASS_BULK;
+    case REQ_SENSLOC:
+    case REQ_SENSSTATUS:
+    case REQ_LOCUPDATE:
+    case REQ_READING:
+        return REQUEST_CLASS_QUERY;
+    default:
+        return REQUEST_CLASS_CONTROL;
+    }
+}
+
+// Logs the sheddings of the last second in one line instead of one line per request
+void shed_report_expired(Timer *timer, void *arg) {
+    char log_msg[150];
+    (void)timer;
+    (void)arg;
+
+    sprintf(log_msg, "Overload: shed %d request(s) queued for more than %d ms. Sent ERROR(%02d).",
+            requests_shed, shed_deadline_ms, SERVER_OVERLOADED);
+    log_info(log_msg);
+    requests_shed = 0;
+}
+
+// Returns the pause to ask clients for, or 0 while the server keeps up
+int backoff_hint_ms(void) {
+    if (backoff_delay_ms == 0) return 0;
+    unsigned queued = (request_queues[REQUEST_CLASS_QUERY].tail - request_queues[REQUEST_CLASS_QUERY].head) +
+                      (request_queues[REQUEST_CLASS_BULK].tail - request_queues[REQUEST_CLASS_BULK].head);
+    if (queue_delay_avg_us < (uint64_t)backoff_delay_ms * 1000 && queued < BACKOFF_QUEUE_DEPTH) return 0;
+
+    uint64_t drain_us = (uint64_t)(queued / REQUEST_BUDGET + 1) * loop_latency_avg_us;
+    uint64_t hint_ms = 2 * (drain_us > queue_delay_avg_us ? drain_us : queue_delay_avg_us) / 1000;
+    if (hint_ms < BACKOFF_MIN_MS) hint_ms = BACKOFF_MIN_MS;
+    if (hint_ms > BACKOFF_MAX_MS) hint_ms = BACKOFF_MAX_MS;
+    return (int)hint_ms;
+}
+
+// Sends BACKOFF_HINT to the client in slot i if the server is overloaded and the client's last pause is over
+void send_backoff_hint(int i) {
+    if (client_backoff_until_ms[i] > loop_now_ms) return;
+    int hint_ms = backoff_hint_ms();
+    if (hint_ms == 0) return;
+
+    char hint_payload[12];
+    sprintf(hint_payload, "%d", hint_ms);
+    char msg_hint[MAX_MSG_SIZE];
+    build_control_message(msg_hint, sizeof(msg_hint), BACKOFF_HINT, hint_payload);
+    send_to_client(client_fds[i], msg_hint);
+    client_backoff_until_ms[i] = loop_now_ms + (uint64_t)hint_ms;
+
+    backoff_last_hint_ms = hint_ms;
+    if (backoff_hints_sent++ == 0) {
+        timer_schedule(&timer_wheel, &backoff_report_timer, loop_now_ms, 1000);
+    }
+}
+
+// Logs the hints of the last second in one line
+void backoff_report_expired(Timer *timer, void *arg) {
+    char log_msg[150];
+    (void)timer;
+    (void)arg;
+
+    sprintf(log_msg, "Overload: sent %d BACKOFF_HINT(s), latest %d ms (queue delay %llu us, loop %llu us).",
+            backoff_hints_sent, backoff_last_hint_ms, (unsigned long long)queue_delay_avg_us,
+            (unsigned long long)loop_latency_avg_us);
+    log_info(log_msg);
+    backoff_hints_sent = 0;
+}
+
+// Answers a request of the client in slot i with ERROR(11) instead of serving it
+void shed_client_request(int i) {
+    char err_payload[10];
+    sprintf(err_payload, "%02d", SERVER_OVERLOADED);
+    char msg_err[MAX_MSG_SIZE];
+    build_control_message(msg_err, sizeof(msg_err), ERROR_MSG, err_payload);
+    send_to_client(client_fds[i], msg_err);
+
+    if (requests_shed++ == 0) {
+        timer_schedule(&timer_wheel, &shed_report_timer, loop_now_ms, 1000);
+    }
+}
+
+// Queues a message of the client in slot i under its request class. Control requests are served
+// at once if their queue is full; other requests are shed.
+void enqueue_client_request(int i, char *message) {
+    uint64_t now_us = monotonic_us();
+    uint64_t trace_id = trace_strip(message);
+    RequestQueue *queue = &request_queues[request_class(atoi(message))];
+
+    if (queue->tail - queue->head == REQUEST_QUEUE_SIZE) {
+        if (queue == &request_queues[REQUEST_CLASS_CONTROL]) {
+            dispatch_client_request(i, message, trace_id, now_us);
+        } else {
+            send_backoff_hint(i);
+            shed_client_request(i);
+        }
+        return;
+    }
+    QueuedRequest *request = &queue->entries[queue->tail++ % REQUEST_QUEUE_SIZE];
+    client_queued[i]++;
+    request->slot = i;
+    request->conn_id = client_conn_ids[i];
+    request->enqueued_us = now_us;
+    request->trace_id = trace_id;
+    snprintf(request->message, sizeof(request->message), "%s", message);
+}
+
+// Takes the next request of a class and serves it, or sheds it if it is a bulk request past its
+// deadline. Requests of clients that disconnected in the meantime are discarded.
+static void serve_next_request(RequestClass request_class) {
+    RequestQueue *queue = &request_queues[request_class];
+    QueuedRequest *request = &queue->entries[queue->head++ % REQUEST_QUEUE_SIZE];
+    int i = request->slot;
+    if (client_fds[i] <= 0 || client_conn_ids[i] != request->conn_id) return;
+    client_queued[i]--;
+
+    if (request_class != REQUEST_CLASS_CONTROL) {
+        queue_delay_avg_us = (3 * queue_delay_avg_us + (monotonic_us() - request->enqueued_us)) / 4;
+        send_backoff_hint(i);
+    }
 
-// Server roles
-typedef enum {
-    SERVER_TYPE_UNINITIALIZED,
-    SERVER_TYPE_STATUS,
-    SERVER_TYPE_LOCATION
-} ServerRole;
+    if (request_class == REQUEST_CLASS_BULK && shed_deadline_ms > 0 &&
+        monotonic_us() - request->enqueued_us > (uint64_t)shed_deadline_ms * 1000) {
+        shed_client_request(i);
+        return;
+    }
+    dispatch_client_request(i, request->message, request->trace_id, request->enqueued_us);
+}
 
-ServerRole current_server_role = SERVER_TYPE_UNINITIALIZED;
+// Serves the queued client requests: every control request, then up to REQUEST_BUDGET queries and
+// bulk requests, QUERY_WEIGHT queries for each bulk request while both classes are waiting
+void serve_request_queues(void) {
+    RequestQueue *control = &request_queues[REQUEST_CLASS_CONTROL];
+    RequestQueue *query = &request_queues[REQUEST_CLASS_QUERY];
+    RequestQueue *bulk = &request_queues[REQUEST_CLASS_BULK];
+
+    while (control->head != control->tail) serve_next_request(REQUEST_CLASS_CONTROL);
+
+    int queries_in_row = 0;
+    for (int served = 0; served < REQUEST_BUDGET && (query->head != query->tail || bulk->head != bulk->tail); served++) {
+        if (query->head != query->tail && (queries_in_row < QUERY_WEIGHT || bulk->head == bulk->tail)) {
+            serve_next_request(REQUEST_CLASS_QUERY);
+            queries_in_row++;
+        } else {
+            serve_next_request(REQUEST_CLASS_BULK);
+            queries_in_row = 0;
+        }
+    }
+}
+
+// Returns 1 if client requests are waiting in a queue
+int requests_pending(void) {
+    for (int c = 0; c < NUM_REQUEST_CLASSES; c++) {
+        if (request_queues[c].head != request_queues[c].tail) return 1;
+    }
+    return 0;
+}
+
+void process_client_data(int i, char *buffer, ssize_t bytes_read) {
+    int client_fd = client_fds[i];
+    char log_msg[150];
+
+    if (bytes_read > 0) {
+        if (message_buffer_append(&client_rx[i], buffer, bytes_read) < 0) {
+            sprintf(log_msg, "Client (socket %d) sent an oversized message. Closing connection.", client_fd);
+            log_error(log_msg);
+            drop_client(i);
+            return;
+        }
+        char message[MAX_MSG_SIZE + 1];
+        while (client_fds[i] == client_fd && message_buffer_next(&client_rx[i], message, sizeof(message))) {
+            capture_write(&capture, client_conn_ids[i], CAPTURE_RECV, message, strlen(message));
+            enqueue_client_request(i, message);
+        }
+    } else if (bytes_read == 0) {
+        sprintf(log_msg, "Client (socket %d) disconnected.", client_fd);
+        log_info(log_msg);
+        drop_client(i);
+    } else {
+        log_error("Error reading from client.");
+        drop_client(i);
+    }
+}
 
 int main(int argc, char *argv[]) {
     if (argc < 5) {
-        fprintf(stderr, "Usage: %s <peer_ip> <p2p_port> <client_listen_port> <SS|SL>\n", argv[0]);
+        fprintf(stderr, "Usage: %s <peer_ip> <p2p_port> <client_listen_port> <SS|SL|SLR> [--udp] [--io-uring] [--risk-feed <path>]\n"
+                        "       [--backlog <n>] [--admit-rate <conn/s>] [--admit-burst <n>] [--capture <file>] [--trace <file>]\n"
+                        "       [--p2p-shm | --p2p-thread] [--shed-deadline <ms>] [--backoff-delay <ms>] [--seed <n>]\n"
+                        "       [--risk-max <value>] [--risk-min <value>] [--risk-rate <per second>]\n", argv[0]);
         fprintf(stderr, "Example: %s 127.0.0.1 60000 61000 SS\n", argv[0]);
+        fprintf(stderr, "  <peer_ip> and <client_listen_port> also accept unix:<path> for Unix domain sockets.\n");
+        fprintf(stderr, "  SLR runs a read replica of the SL: <peer_ip> <p2p_port> are then the primary SL's client\n");
+        fprintf(stderr, "  address and port, and only REQ_SENSLOC and REQ_LOCLIST are served.\n");
+        fprintf(stderr, "  --udp       Also answer status/location queries as UDP datagrams on <client_listen_port>.\n");
+        fprintf(stderr, "  --io-uring  Use the io_uring I/O backend (falls back to select() if unsupported).\n");
+        fprintf(stderr, "  --risk-feed <path>  (SS) Accept batched '<SensorID> <0|1>' risk updates as datagrams\n");
+        fprintf(stderr, "                      on a Unix domain socket at <path>.\n");
+        fprintf(stderr, "  --backlog <n>       Pending connection queue of the client listener (default %d).\n", SERVER_BACKLOG);
+        fprintf(stderr, "  --admit-rate <n>    New connections per second allowed from one address (default %d, 0 = no limit).\n",
+                ADMISSION_DEFAULT_RATE);
+        fprintf(stderr, "  --admit-burst <n>   New connections one address may open at once (default %d).\n",
+                ADMISSION_DEFAULT_BURST);
+        fprintf(stderr, "  --shed-deadline <ms> Queue delay after which bulk requests (REQ_LOCLIST, REQ_REGIONSUM,\n");
+        fprintf(stderr, "                      REQ_ALERTLIST, REQ_HISTORY) are answered ERROR(%02d) (default %d,\n",
+                SERVER_OVERLOADED, SHED_DEFAULT_DEADLINE_MS);
+        fprintf(stderr, "                      0 = never shed).\n");
+        fprintf(stderr, "  --backoff-delay <ms> Average queue delay from which replies are preceded by a BACKOFF_HINT\n");
+        fprintf(stderr, "                      asking the client to pause (default %d, 0 = never).\n", BACKOFF_DEFAULT_DELAY_MS);
+        fprintf(stderr, "  --capture <file>    Record all inbound traffic to <file> for the replay tool.\n");
+        fprintf(stderr, "  --trace <file>      Record spans of traced requests and export them to <file> (Chrome JSON)\n");
+        fprintf(stderr, "                      on exit or on the 'trace' command.\n");
+        fprintf(stderr, "  --seed <n>          Seed of the random risk statuses and locations (fixed by default).\n");
+        fprintf(stderr, "  --p2p-shm           Carry P2P messages through shared memory when the SS and SL share a host\n");
+        fprintf(stderr, "                      (needs the option on both servers; falls back to the socket otherwise).\n");
+        fprintf(stderr, "  --risk-max <value>  (SS) Sensors whose latest reading is above <value> are at risk.\n");
+        fprintf(stderr, "  --risk-min <value>  (SS) Sensors whose latest reading is below <value> are at risk.\n");
+        fprintf(stderr, "  --risk-rate <value> (SS) Sensors whose reading changes faster than <value> per second are at risk.\n");
+        fprintf(stderr, "  --p2p-thread        Run the P2P socket on its own thread, linked to the event loop by rings.\n");
         exit(EXIT_FAILURE);
     }
 
     // Argument parsing
     char *peer_ip = argv[1];
-    int peer_port = atoi(argv[2]);
+    peer_port = atoi(argv[2]);
+    char *client_listen_addr = argv[3]; // Port number or "unix:<path>"
     int client_listen_port = atoi(argv[3]);
     char *role_arg = argv[4];
 
@@ -62,133 +3095,240 @@ int main(int argc, char *argv[]) {
     } else if (strcmp(role_arg, "SL") == 0) {
         current_server_role = SERVER_TYPE_LOCATION;
         log_info("Server configured as LOCATION SERVER (SL).");
+    } else if (strcmp(role_arg, "SLR") == 0) {
+        current_server_role = SERVER_TYPE_LOCATION_REPLICA;
+        primary_addr = peer_ip;
+        primary_port = peer_port;
+        log_info("Server configured as LOCATION SERVER READ REPLICA (SLR).");
     } else {
-        fprintf(stderr, "Error: Invalid server type '%s'. Use 'SS' or 'SL'.\n", role_arg);
+        fprintf(stderr, "Error: Invalid server type '%s'. Use 'SS', 'SL' or 'SLR'.\n", role_arg);
+        exit(EXIT_FAILURE);
+    }
+    init_message_handlers();
+
+    // Optional flags
+    int udp_enabled = 0;
+    int uring_requested = 0;
+    const char *risk_feed_path = NULL;
+    int client_backlog = SERVER_BACKLOG;
+    const char *capture_path = NULL;
+    for (int a = 5; a < argc; a++) {
+        if (strcmp(argv[a], "--udp") == 0) {
+            udp_enabled = 1;
+        } else if (strcmp(argv[a], "--io-uring") == 0) {
+            uring_requested = 1;
+        } else if (strcmp(argv[a], "--risk-feed") == 0 && a + 1 < argc) {
+            risk_feed_path = argv[++a];
+        } else if (strcmp(argv[a], "--backlog") == 0 && a + 1 < argc && atoi(argv[a + 1]) > 0) {
+            client_backlog = atoi(argv[++a]);
+        } else if (strcmp(argv[a], "--admit-rate") == 0 && a + 1 < argc && atoi(argv[a + 1]) >= 0) {
+            admission_rate = atoi(argv[++a]);
+        } else if (strcmp(argv[a], "--admit-burst") == 0 && a + 1 < argc && atoi(argv[a + 1]) > 0) {
+            admission_burst = atoi(argv[++a]);
+        } else if (strcmp(argv[a], "--shed-deadline") == 0 && a + 1 < argc && atoi(argv[a + 1]) >= 0) {
+            shed_deadline_ms = atoi(argv[++a]);
+        } else if (strcmp(argv[a], "--backoff-delay") == 0 && a + 1 < argc && atoi(argv[a + 1]) >= 0) {
+            backoff_delay_ms = atoi(argv[++a]);
+        } else if (strcmp(argv[a], "--capture") == 0 && a + 1 < argc) {
+            capture_path = argv[++a];
+        } else if (strcmp(argv[a], "--trace") == 0 && a + 1 < argc) {
+            trace_path = argv[++a];
+            trace_enable(role_arg);
+        } else if (strcmp(argv[a], "--p2p-shm") == 0) {
+            p2p_shm_enabled = 1;
+        } else if (strcmp(argv[a], "--p2p-thread") == 0) {
+            p2p_thread_enabled = 1;
+        } else if (strcmp(argv[a], "--risk-max") == 0 && a + 1 < argc) {
+            risk_rules.max_value = strtof(argv[++a], NULL);
+            risk_rules.has_max = 1;
+        } else if (strcmp(argv[a], "--risk-min") == 0 && a + 1 < argc) {
+            risk_rules.min_value = strtof(argv[++a], NULL);
+            risk_rules.has_min = 1;
+        } else if (strcmp(argv[a], "--risk-rate") == 0 && a + 1 < argc) {
+            risk_rules.max_rate = strtof(argv[++a], NULL);
+            risk_rules.has_rate = 1;
+        } else if (strcmp(argv[a], "--seed") == 0 && a + 1 < argc) {
+            rng_seed(strtoull(argv[++a], NULL, 10));
+        } else {
+            fprintf(stderr, "Error: Unknown option '%s'.\n", argv[a]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (p2p_shm_enabled && p2p_thread_enabled) {
+        fprintf(stderr, "Error: --p2p-shm and --p2p-thread cannot be combined.\n");
         exit(EXIT_FAILURE);
     }
 
-        int client_master_fd, new_client_fd;
-    int peer_listen_fd = -1;
+        int client_master_fd;
+    int udp_fd = -1;
+    int risk_feed_fd = -1;
+    int shutdown_requested = 0;
 
-    struct sockaddr_in addr_clients, addr_peer_listen, addr_peer_target;
-    socklen_t client_addr_len = sizeof(struct sockaddr_in);
+    // Peer listener address: the same Unix socket path the peer would connect to, or any IPv4 interface
+    peer_listen_addr = transport_is_unix(peer_ip) ? peer_ip : NULL;
 
     char buffer[MAX_MSG_SIZE + 1];
     char log_msg[150];
-    int client_fds[MAX_CLIENTS];
 
     // Initialize client structures
     for (int i = 0; i < MAX_CLIENTS; i++) {
         client_fds[i] = 0;
         connected_clients[i].socket_fd = 0;
-        connected_clients[i].client_id[0] = '\0';
+        connected_clients[i].sensor_key = SENSOR_KEY_NONE;
         connected_clients[i].assigned_slot = 0;
         connected_clients[i].location_id = 0;
         connected_clients[i].risk_status = -1;
     }
+    if (ts_pool_init(&history_pool, HISTORY_POOL_BLOCKS) < 0) {
+        log_error("Failed to allocate the sensor history pool");
+        exit(EXIT_FAILURE);
+    }
 
-    fd_set read_fds;
-    int max_fd;
+    // Replication epoch: differs between runs of the SL (never 0, the "no replica" epoch of the SS)
+    repl_epoch = ((unsigned)time(NULL) ^ ((unsigned)getpid() << 16)) | 1;
 
-    // --- CLIENT SOCKET SETUP ---
-    if ((client_master_fd = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
-        log_error("Failed to create client master socket.");
-        exit(EXIT_FAILURE);
+    // Timers
+    loop_now_ms = monotonic_ms();
+    timer_wheel_init(&timer_wheel, loop_now_ms, TIMER_TICK_MS);
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        timer_init(&client_idle_timers[i], client_idle_expired, (void *)(intptr_t)i);
+    }
+    for (int n = 0; n < MAX_PEERS; n++) {
+        peer_links[n].socket_fd = -1;
+        peer_links[n].shm_handoff_fd = -1;
+        timer_init(&peer_links[n].timer, peer_timer_expired, &peer_links[n]);
+    }
+    timer_init(&admission_report_timer, admission_report_expired, NULL);
+    timer_init(&capture_flush_timer, capture_flush_expired, NULL);
+    timer_init(&location_flush_timer, location_flush_expired, NULL);
+    timer_init(&shed_report_timer, shed_report_expired, NULL);
+    timer_init(&backoff_report_timer, backoff_report_expired, NULL);
+    timer_init(&primary_retry_timer, primary_retry_expired, NULL);
+    timer_init(&export_poll_timer, export_poll_expired, NULL);
+    timer_init(&risk_eval_timer, risk_eval_expired, NULL);
+    if (current_server_role == SERVER_TYPE_STATUS && risk_rules_enabled(&risk_rules)) {
+        timer_schedule(&timer_wheel, &risk_eval_timer, loop_now_ms, RISK_EVAL_MS);
     }
-    log_info("Client master socket created.");
 
-    int opt = 1;
-    if (setsockopt(client_master_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
-        log_error("Failed to set socket options for client master socket.");
-        close(client_master_fd);
-        exit(EXIT_FAILURE);
+    if (capture_path != NULL) {
+        if (capture_open(&capture, capture_path, role_arg) < 0) {
+            log_error("Failed to open capture file");
+            exit(EXIT_FAILURE);
+        }
+        timer_schedule(&timer_wheel, &capture_flush_timer, loop_now_ms, CAPTURE_FLUSH_MS);
+        sprintf(log_msg, "Capturing traffic to %s.", capture_path);
+        log_info(log_msg);
     }
 
-    addr_clients.sin_family = AF_INET;
-    addr_clients.sin_addr.s_addr = INADDR_ANY;
-    addr_clients.sin_port = htons(client_listen_port);
+    fd_set read_fds;
+    fd_set write_fds;
+    int max_fd;
 
-    if (bind(client_master_fd, (struct sockaddr *)&addr_clients, sizeof(addr_clients)) < 0) {
-        close(client_master_fd);
+    // --- CLIENT SOCKET SETUP ---
+    // The kernel caps the backlog at net.core.somaxconn
+    if ((client_master_fd = transport_listen(client_listen_addr, client_listen_port, client_backlog)) == -1) {
+        sprintf(log_msg, "Failed to set up client master socket on %s", client_listen_addr);
+        log_error(log_msg);
         exit(EXIT_FAILURE);
     }
+    // Non-blocking, so a wakeup can drain the accept queue until it is empty
+    fcntl(client_master_fd, F_SETFL, fcntl(client_master_fd, F_GETFL) | O_NONBLOCK);
 
-    sprintf(log_msg, "Client master socket bound to port %d.", client_listen_port);
+    sprintf(log_msg, "Server listening for clients on %s (backlog %d)...", client_listen_addr, client_backlog);
     log_info(log_msg);
 
-    if (listen(client_master_fd, SERVER_BACKLOG) < 0) {
-        close(client_master_fd);
-        exit(EXIT_FAILURE);
+    // --- I/O BACKEND SELECTION ---
+    if (uring_requested) {
+        if (uring_backend_start(client_master_fd) == 0) {
+            log_info("Using io_uring I/O backend (multishot accept/recv, batched sends).");
+        } else {
+            sprintf(log_msg, "io_uring not supported (%s). Falling back to select().", strerror(errno));
+            log_info(log_msg);
+        }
     }
 
-    sprintf(log_msg, "Server listening for clients on port %d...", client_listen_port);
-    log_info(log_msg);
-
-    // --- ACTIVE P2P CONNECTION ATTEMPT ---
-    log_info("Attempting active connection to peer...");
-    if ((peer_socket_fd = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
-        log_error("Failed to create socket for active P2P connection.");
-    } else {
-        addr_peer_target.sin_family = AF_INET;
-        addr_peer_target.sin_port = htons(peer_port);
+    // --- UDP FAST PATH SETUP ---
+    if (udp_enabled && transport_is_unix(client_listen_addr)) {
+        log_info("UDP fast path is only available for TCP client listeners. Ignoring --udp.");
+    } else if (udp_enabled) {
+        struct sockaddr_in addr_udp;
+        memset(&addr_udp, 0, sizeof(addr_udp));
+        addr_udp.sin_family = AF_INET;
+        addr_udp.sin_addr.s_addr = INADDR_ANY;
+        addr_udp.sin_port = htons(client_listen_port);
+
+        if ((udp_fd = socket(AF_INET, SOCK_DGRAM, 0)) == -1) {
+            log_error("Failed to create UDP query socket.");
+        } else if (bind(udp_fd, (struct sockaddr *)&addr_udp, sizeof(addr_udp)) < 0) {
+            log_error("Failed to bind UDP query socket.");
+            close(udp_fd);
+            udp_fd = -1;
+        } else {
+            sprintf(log_msg, "Server answering UDP queries on port %d.", client_listen_port);
+            log_info(log_msg);
+        }
+    }
 
-        if (inet_pton(AF_INET, peer_ip, &addr_peer_target.sin_addr) <= 0) {
-            log_error("Invalid peer IP address for P2P connection.");
-            close(peer_socket_fd);
-            peer_socket_fd = -1;
+    // --- RISK FEED SETUP (SS only) ---
+    if (risk_feed_path != NULL && current_server_role != SERVER_TYPE_STATUS) {
+        log_info("The risk feed is only available on the STATUS SERVER (SS). Ignoring --risk-feed.");
+    } else if (risk_feed_path != NULL) {
+        struct sockaddr_un addr_feed;
+        memset(&addr_feed, 0, sizeof(addr_feed));
+        addr_feed.sun_family = AF_UNIX;
+        if (strlen(risk_feed_path) >= sizeof(addr_feed.sun_path)) {
+            log_error("Risk feed path too long.");
+        } else if ((risk_feed_fd = socket(AF_UNIX, SOCK_DGRAM, 0)) == -1) {
+            log_error("Failed to create risk feed socket.");
         } else {
-            if (connect(peer_socket_fd, (struct sockaddr *)&addr_peer_target, sizeof(addr_peer_target)) < 0) {
-                sprintf(log_msg, "Failed to connect to peer %s:%d. %s.", peer_ip, peer_port, strerror(errno));
+            strcpy(addr_feed.sun_path, risk_feed_path);
+            unlink(risk_feed_path);
+            if (bind(risk_feed_fd, (struct sockaddr *)&addr_feed, sizeof(addr_feed)) < 0) {
+                log_error("Failed to bind risk feed socket.");
+                close(risk_feed_fd);
+                risk_feed_fd = -1;
+            } else {
+                sprintf(log_msg, "Accepting risk update batches on %s.", risk_feed_path);
                 log_info(log_msg);
-                close(peer_socket_fd);
-                peer_socket_fd = -1;
-
-                // Fallback to passive P2P listening
-                log_info("No peer found, starting passive P2P listener...");
-                if ((peer_listen_fd = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
-                    log_error("Failed to create socket for passive P2P.");
-                    peer_listen_fd = -1;
-                } else {
-                    if (setsockopt(peer_listen_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
-                        log_error("Failed to set socket options for passive P2P.");
-                        close(peer_listen_fd);
-                        peer_listen_fd = -1;
-                        return -1;
-                    }
-
-                    addr_peer_listen.sin_family = AF_INET;
-                    addr_peer_listen.sin_addr.s_addr = INADDR_ANY;
-                    addr_peer_listen.sin_port = htons(peer_port);
+            }
+        }
+    }
 
-                    if (bind(peer_listen_fd, (struct sockaddr *)&addr_peer_listen, sizeof(addr_peer_listen)) < 0) {
-                        close(peer_listen_fd);
-                        peer_listen_fd = -1;
-                    } else if (listen(peer_listen_fd, 1) < 0) {
-                        close(peer_listen_fd);
-                        peer_listen_fd = -1;
-                    } else {
-                        sprintf(log_msg, "Server listening for P2P connections on port %d...", peer_port);
-                        log_info(log_msg);
-                    }
-                }
+    // --- ACTIVE P2P CONNECTION ATTEMPT (a read replica subscribes to its primary SL instead) ---
+    if (current_server_role == SERVER_TYPE_LOCATION_REPLICA) {
+        connect_primary();
+    } else {
+        PeerLink *link = &peer_links[0];
+        log_info("Attempting active connection to peer...");
+        if ((link->socket_fd = transport_connect(peer_ip, peer_port)) == -1) {
+            sprintf(log_msg, "Failed to connect to peer %s:%d. %s.", peer_ip, peer_port, strerror(errno));
+            log_info(log_msg);
+
+            // Fallback to passive P2P listening
+            log_info("No peer found, starting passive P2P listener...");
+            if ((peer_listen_fd = transport_listen(peer_listen_addr, peer_port, 1)) == -1) {
+                log_error("Failed to set up passive P2P listener.");
             } else {
-                sprintf(log_msg, "Connected to peer %s:%d on P2P socket %d. Sending REQ_CONNPEER...",
-                        peer_ip, peer_port, peer_socket_fd);
+                sprintf(log_msg, "Server listening for P2P connections on port %d...", peer_port);
                 log_info(log_msg);
-                p2p_current_state = P2P_ACTIVE_CONNECTING;
-
-                char msg_buf[MAX_MSG_SIZE];
-                build_control_message(msg_buf, sizeof(msg_buf), REQ_CONNPEER, NULL);
-
-                if (write(peer_socket_fd, msg_buf, strlen(msg_buf)) < 0) {
-                    log_error("Failed to send REQ_CONNPEER.");
-                    close(peer_socket_fd);
-                    peer_socket_fd = -1;
-                    p2p_current_state = P2P_DISCONNECTED;
-                } else {
-                    log_info("REQ_CONNPEER sent.");
-                    p2p_current_state = P2P_REQ_SENT;
-                }
+            }
+        } else {
+            sprintf(log_msg, "Connected to peer %s:%d on P2P socket %d. Sending REQ_CONNPEER...",
+                    peer_ip, peer_port, link->socket_fd);
+            log_info(log_msg);
+            link->state = P2P_ACTIVE_CONNECTING;
+
+            char msg_buf[MAX_MSG_SIZE];
+            build_control_message(msg_buf, sizeof(msg_buf), REQ_CONNPEER, NULL);
+
+            if (peer_write_socket(link, msg_buf, strlen(msg_buf)) < 0) {
+                log_error("Failed to send REQ_CONNPEER.");
+                close_peer_socket(link);
+                link->state = P2P_DISCONNECTED;
+            } else {
+                log_info("REQ_CONNPEER sent.");
+                link->state = P2P_REQ_SENT;
+                refresh_peer_timer(link);
             }
         }
     }
@@ -196,12 +3336,15 @@ int main(int argc, char *argv[]) {
     log_info("Waiting for client/P2P connections or keyboard input...");
 
         printf("Available commands:\n");
-    printf("  kill                      - Sends REQ_DISCPEER to the peer if connected.\n");
+    printf("  kill                      - Sends REQ_DISCPEER to the connected peers.\n");
     printf("  exit                      - Terminates the server.\n");
     printf("  set_risk <SensorID> <0|1> - Updates risk status of a sensor (only for SS).\n");
+    printf("  trace                     - Exports the recorded trace spans (with --trace).\n");
+    printf("  export <file|unix:path> [csv|bin] - Writes a snapshot of the registered sensors.\n");
 
     while (1) {
         FD_ZERO(&read_fds);
+        FD_ZERO(&write_fds);
 
         FD_SET(STDIN_FILENO, &read_fds);
         max_fd = STDIN_FILENO;
@@ -209,29 +3352,110 @@ int main(int argc, char *argv[]) {
         FD_SET(client_master_fd, &read_fds);
         if (client_master_fd > max_fd) max_fd = client_master_fd;
 
+        if (udp_fd > 0) {
+            FD_SET(udp_fd, &read_fds);
+            if (udp_fd > max_fd) max_fd = udp_fd;
+        }
+
+        if (risk_feed_fd > 0) {
+            FD_SET(risk_feed_fd, &read_fds);
+            if (risk_feed_fd > max_fd) max_fd = risk_feed_fd;
+        }
+
         if (peer_listen_fd > 0) {
             FD_SET(peer_listen_fd, &read_fds);
             if (peer_listen_fd > max_fd) max_fd = peer_listen_fd;
         }
 
-        if (peer_socket_fd > 0) {
-            FD_SET(peer_socket_fd, &read_fds);
-            if (peer_socket_fd > max_fd) max_fd = peer_socket_fd;
+        if (primary_fd > 0) {
+            FD_SET(primary_fd, &read_fds);
+            if (primary_fd > max_fd) max_fd = primary_fd;
+        }
+
+        int peer_ring_pending = 0;
+        int tx_pending = 0;
+        for (int n = 0; n < MAX_PEERS; n++) {
+            PeerLink *link = &peer_links[n];
+            if (link->socket_fd <= 0 && link->shm.region != NULL) {
+                close_peer_shm(link); // The peer socket was closed while handling a message
+            }
+            if (link->socket_fd > 0 && !link->thread.running) {
+                FD_SET(link->socket_fd, &read_fds);
+                if (link->socket_fd > max_fd) max_fd = link->socket_fd;
+            }
+            if (link->shm_handoff_fd >= 0) {
+                FD_SET(link->shm_handoff_fd, &read_fds);
+                if (link->shm_handoff_fd > max_fd) max_fd = link->shm_handoff_fd;
+            }
+            if (link->shm_active) {
+                FD_SET(link->shm.rx_eventfd, &read_fds);
+                if (link->shm.rx_eventfd > max_fd) max_fd = link->shm.rx_eventfd;
+                if (shm_link_pending(&link->shm)) peer_ring_pending = 1;
+            }
+        }
+
+        for (int n = 0; n < MAX_REPL_SUBSCRIBERS; n++) {
+            ReplSubscriber *sub = &repl_subscribers[n];
+            if (sub->fd <= 0) continue;
+            FD_SET(sub->fd, &read_fds);
+            if (sub->fd > max_fd) max_fd = sub->fd;
+            if (sub->tx_len > 0) {
+                FD_SET(sub->fd, &write_fds);
+                tx_pending = 1;
+            }
         }
 
         for (int i = 0; i < MAX_CLIENTS; i++) {
-            if (client_fds[i] > 0) {
+            if (client_fds[i] > 0 && client_queued[i] < CLIENT_QUEUE_LIMIT) {
                 FD_SET(client_fds[i], &read_fds);
                 if (client_fds[i] > max_fd) max_fd = client_fds[i];
             }
+            if (client_fds[i] > 0 && client_tx_len[i] > 0) {
+                FD_SET(client_fds[i], &write_fds);
+                if (client_fds[i] > max_fd) max_fd = client_fds[i];
+                tx_pending = 1;
+            }
         }
 
-        int activity = select(max_fd + 1, &read_fds, NULL, NULL, NULL);
+        // Sleep until the next timer is due at the latest, or not at all if a peer's ring has data
+        int timeout_ms = timer_wheel_next_timeout_ms(&timer_wheel, monotonic_ms());
+        if (peer_ring_pending || requests_pending()) timeout_ms = 0;
+        // The io_uring polls only watch for input, so held replies are retried every millisecond there
+        if (tx_pending && io_backend == IO_BACKEND_URING && (timeout_ms < 0 || timeout_ms > 1)) timeout_ms = 1;
+        struct timeval tv = { .tv_sec = timeout_ms / 1000, .tv_usec = (timeout_ms % 1000) * 1000 };
+
+        int activity;
+        if (io_backend == IO_BACKEND_URING) {
+            int control_fds[URING_CONTROL_FDS];
+            int num_control_fds = 0;
+            control_fds[num_control_fds++] = STDIN_FILENO;
+            if (peer_listen_fd > 0) control_fds[num_control_fds++] = peer_listen_fd;
+            if (primary_fd > 0) control_fds[num_control_fds++] = primary_fd;
+            if (udp_fd > 0) control_fds[num_control_fds++] = udp_fd;
+            if (risk_feed_fd > 0) control_fds[num_control_fds++] = risk_feed_fd;
+            for (int n = 0; n < MAX_PEERS; n++) {
+                PeerLink *link = &peer_links[n];
+                if (link->socket_fd > 0 && !link->thread.running) control_fds[num_control_fds++] = link->socket_fd;
+                if (link->shm_handoff_fd >= 0) control_fds[num_control_fds++] = link->shm_handoff_fd;
+                if (link->shm_active) control_fds[num_control_fds++] = link->shm.rx_eventfd;
+            }
+            for (int n = 0; n < MAX_REPL_SUBSCRIBERS; n++) {
+                if (repl_subscribers[n].fd > 0) control_fds[num_control_fds++] = repl_subscribers[n].fd;
+            }
+            activity = uring_wait_events(client_master_fd, control_fds, num_control_fds, &read_fds, timeout_ms);
+        } else {
+            activity = select(max_fd + 1, &read_fds, &write_fds, NULL, timeout_ms >= 0 ? &tv : NULL);
+        }
+        loop_now_ms = monotonic_ms();
+        uint64_t loop_wake_us = monotonic_us();
         if ((activity < 0) && (errno != EINTR)) {
             log_error("select() error.");
             continue;
         }
 
+        // --- TIMERS (idle clients, heartbeats, P2P request timeouts) ---
+        timer_wheel_advance(&timer_wheel, loop_now_ms);
+
         // --- STDIN (keyboard input) ---
         if (FD_ISSET(STDIN_FILENO, &read_fds)) {
             char cmd_buf[MAX_MSG_SIZE];
@@ -246,47 +3470,61 @@ int main(int argc, char *argv[]) {
                 log_info(log_msg);
 
                 if (strcmp(cmd_buf, "kill") == 0) {
-                    if (p2p_current_state == P2P_FULLY_ESTABLISHED && peer_socket_fd > 0) {
-                        sprintf(log_msg, "'kill' command received. Sending REQ_DISCPEER to peer %s...", my_pids_for_peer);
+                    int disconnecting = 0;
+                    for (int n = 0; n < MAX_PEERS; n++) {
+                        PeerLink *link = &peer_links[n];
+                        if (link->state != P2P_FULLY_ESTABLISHED || link->socket_fd <= 0) continue;
+                        sprintf(log_msg, "'kill' command received. Sending REQ_DISCPEER to peer %s...", link->my_pids);
                         log_info(log_msg);
 
                         char disconnect_msg[MAX_MSG_SIZE];
-                        build_control_message(disconnect_msg, sizeof(disconnect_msg), REQ_DISCPEER, my_pids_for_peer);
+                        build_control_message(disconnect_msg, sizeof(disconnect_msg), REQ_DISCPEER, link->my_pids);
 
-                        if (write(peer_socket_fd, disconnect_msg, strlen(disconnect_msg)) < 0) {
+                        if (peer_write_socket(link, disconnect_msg, strlen(disconnect_msg)) < 0) {
                             log_error("Failed to send REQ_DISCPEER.");
-                            close(peer_socket_fd);
-                            peer_socket_fd = -1;
-                            p2p_current_state = P2P_DISCONNECTED;
+                            close_peer_socket(link);
+                            link->state = P2P_DISCONNECTED;
                         } else {
                             log_info("REQ_DISCPEER sent.");
-                            p2p_current_state = P2P_DISCONNECT_REQ_SENT;
+                            link->state = P2P_DISCONNECT_REQ_SENT;
+                            refresh_peer_timer(link);
+                            disconnecting = 1;
                         }
-                    } else {
+                    }
+                    if (!disconnecting) {
                         log_info("No active P2P connection to disconnect. (Use 'exit' to terminate the server)");
                     }
                 } else if (strcmp(cmd_buf, "exit") == 0) {
                     log_info("'exit' command received. Shutting down server...");
                     break;
+                } else if (strcmp(cmd_buf, "trace") == 0) {
+                    if (trace_path != NULL) {
+                        export_trace();
+                    } else {
+                        log_info("trace: Tracing is not enabled (start the server with --trace <file>).");
+                    }
+                } else if (strncmp(cmd_buf, "export", 6) == 0 && (cmd_buf[6] == ' ' || cmd_buf[6] == '\0')) {
+                    char target[MAX_MSG_SIZE];
+                    char format_str[8] = "csv";
+                    if (sscanf(cmd_buf + 6, "%499s %7s", target, format_str) >= 1 &&
+                        (strcmp(format_str, "csv") == 0 || strcmp(format_str, "bin") == 0)) {
+                        start_registry_export(target, strcmp(format_str, "bin") == 0 ? EXPORT_BINARY : EXPORT_CSV);
+                    } else {
+                        log_info("export: Usage: export <file|unix:path> [csv|bin]");
+                    }
                 } else if (sscanf(cmd_buf, "%19s %49s %d", command, sensor_id, &new_status) == 3 &&
                            strcmp(command, "set_risk") == 0) {
                     if (current_server_role == SERVER_TYPE_STATUS) {
                         if (new_status == 0 || new_status == 1) {
-                            int found = 0;
-                            for (int i = 0; i < MAX_CLIENTS; i++) {
-                                if (connected_clients[i].socket_fd > 0 &&
-                                    strcmp(connected_clients[i].client_id, sensor_id) == 0) {
-                                    connected_clients[i].risk_status = new_status;
-                                    found = 1;
-                                    sprintf(log_msg, "Risk status of sensor %s (Slot %d) updated to %d.",
-                                            connected_clients[i].client_id,
-                                            connected_clients[i].assigned_slot,
-                                            new_status);
-                                    log_info(log_msg);
-                                    break;
-                                }
-                            }
-                            if (!found) {
+                            int i = sensor_index_find(sensor_id_parse(sensor_id));
+                            if (i >= 0) {
+                                set_sensor_risk(i, new_status);
+                                sprintf(log_msg, "Risk status of sensor %s (Slot %d) updated to %d.",
+                                        sensor_id,
+                                        connected_clients[i].assigned_slot,
+                                        new_status);
+                                log_info(log_msg);
+                            } else {
                                 sprintf(log_msg, "set_risk: Sensor '%s' not found or inactive.", sensor_id);
                                 log_info(log_msg);
                             }
@@ -308,257 +3546,129 @@ int main(int argc, char *argv[]) {
 
         // --- NEW CLIENT CONNECTION ---
         if (FD_ISSET(client_master_fd, &read_fds)) {
-            struct sockaddr_in client_addr;
-            socklen_t client_addr_len = sizeof(client_addr);
-
-            if ((new_client_fd = accept(client_master_fd, (struct sockaddr *)&client_addr, &client_addr_len)) < 0) {
-                log_error("Failed to accept new client connection.");
-            } else {
-                char client_ip[INET_ADDRSTRLEN];
-                inet_ntop(AF_INET, &client_addr.sin_addr, client_ip, INET_ADDRSTRLEN);
-
-                int assigned_slot = -1;
-                for (int i = 0; i < MAX_CLIENTS; i++) {
-                    if (client_fds[i] == 0) {
-                        client_fds[i] = new_client_fd;
-                        connected_clients[i].socket_fd = new_client_fd;
-
-                        sprintf(log_msg, "New client connected from %s:%d on socket %d, assigned to slot %d.",
-                                client_ip, ntohs(client_addr.sin_port), new_client_fd, i + 1);
-                        log_info(log_msg);
-
-                        assigned_slot = i;
-                        break;
-                    }
-                }
+            accept_pending_clients(client_master_fd);
+        }
 
-                if (assigned_slot == -1) {
-                    log_info("Client limit reached. Rejecting new connection.");
-                    char err_payload[10];
-                    sprintf(err_payload, "%02d", SENSOR_LIMIT_EXCEEDED);
-                    char err_msg[MAX_MSG_SIZE];
-                    build_control_message(err_msg, sizeof(err_msg), ERROR_MSG, err_payload);
+        // --- UDP QUERIES ---
+        if (udp_fd > 0 && FD_ISSET(udp_fd, &read_fds)) {
+            handle_udp_query(udp_fd);
+        }
 
-                    if (write(new_client_fd, err_msg, strlen(err_msg)) < 0) {
-                        log_error("Failed to send error message to new client.");
-                    }
-                    close(new_client_fd);
-                }
-            }
+        // --- RISK UPDATE BATCHES ---
+        if (risk_feed_fd > 0 && FD_ISSET(risk_feed_fd, &read_fds)) {
+            handle_risk_feed(risk_feed_fd);
         }
 
         // --- PASSIVE P2P CONNECTION ---
         if (peer_listen_fd > 0 && FD_ISSET(peer_listen_fd, &read_fds)) {
-            struct sockaddr_in peer_addr;
-            socklen_t peer_addr_len = sizeof(peer_addr);
-
-            int new_peer_fd = accept(peer_listen_fd, (struct sockaddr *)&peer_addr, &peer_addr_len);
+            int new_peer_fd = accept(peer_listen_fd, NULL, NULL);
+            PeerLink *link = free_peer_link();
             if (new_peer_fd < 0) {
                 log_error("Failed to accept new P2P connection.");
+            } else if (link == NULL) {
+                log_info("No free P2P link. Connection refused.");
+                close(new_peer_fd);
             } else {
-                peer_socket_fd = new_peer_fd;
-                close(peer_listen_fd);  // only accept one peer
-                peer_listen_fd = -1;
-                p2p_current_state = P2P_PASSIVE_LISTENING;
-                sprintf(log_msg, "New P2P connection accepted on socket %d. State: PASSIVE_LISTENING.", peer_socket_fd);
+                link->socket_fd = new_peer_fd;
+                message_buffer_reset(&link->rx);
+                link->state = P2P_PASSIVE_LISTENING;
+                sprintf(log_msg, "New P2P connection accepted on socket %d. State: PASSIVE_LISTENING.", link->socket_fd);
                 log_info(log_msg);
+                refresh_peer_timer(link);
+            }
+            if (free_peer_link() == NULL) {
+                close(peer_listen_fd);  // Reopened when a link is free again
+                transport_cleanup(peer_listen_addr);
+                peer_listen_fd = -1;
             }
         }
 
-        // --- P2P MESSAGE PROCESSING ---
-        if (peer_socket_fd > 0 && FD_ISSET(peer_socket_fd, &read_fds)) {
-            ssize_t bytes_read = read(peer_socket_fd, buffer, MAX_MSG_SIZE);
-            if (bytes_read > 0) {
-                buffer[bytes_read] = '\0';
-                sprintf(log_msg, "Raw data received from peer: [%s]", buffer);
-                log_info(log_msg);
-
-                int code;
-                char payload[MAX_MSG_SIZE];
-
-                if (parse_message(buffer, &code, payload, sizeof(payload))) {
-                    sprintf(log_msg, "P2P message received: Code=%d, Payload='%s'", code, payload);
+        // --- P2P MESSAGE PROCESSING (each link: socket, then shared-memory ring) ---
+        for (int n = 0; n < MAX_PEERS && !shutdown_requested; n++) {
+            PeerLink *link = &peer_links[n];
+            if (link->socket_fd > 0 && !link->thread.running && FD_ISSET(link->socket_fd, &read_fds)) {
+                // Never block the loop on a peer: a spurious readiness report just reads nothing
+                ssize_t bytes_read = recv(link->socket_fd, buffer, MAX_MSG_SIZE, MSG_DONTWAIT);
+                if (bytes_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                    // Nothing to read
+                } else if (bytes_read > 0) {
+                    if (process_peer_data(link, buffer, bytes_read) < 0) {
+                        shutdown_requested = 1;
+                        break;
+                    }
+                } else if (bytes_read == 0) {
+                    sprintf(log_msg, "Peer %s disconnected.", link->my_pids);
                     log_info(log_msg);
+                    reset_peer_connection(link);
+                    start_passive_p2p_listener();
+                } else {
+                    log_error("Error reading from peer.");
+                    reset_peer_connection(link);
+                    start_passive_p2p_listener();
+                }
+            }
 
-                    char msg_out[MAX_MSG_SIZE];
-                    char payload_out[10];
-
-                    if (p2p_current_state == P2P_PASSIVE_LISTENING && code == REQ_CONNPEER) {
-                        snprintf(my_pids_for_peer, sizeof(my_pids_for_peer), "Peer%d_Active", peer_socket_fd);
-                        sprintf(log_msg, "Connected peer assigned ID: %s", my_pids_for_peer);
-                        log_info(log_msg);
-
-                        build_control_message(msg_out, sizeof(msg_out), RES_CONNPEER, my_pids_for_peer);
-                        if (write(peer_socket_fd, msg_out, strlen(msg_out)) < 0) {
-                            log_error("Failed to send RES_CONNPEER.");
-                            close(peer_socket_fd);
-                            peer_socket_fd = -1;
-                            p2p_current_state = P2P_DISCONNECTED;
-                        } else {
-                            log_info("RES_CONNPEER sent.");
-                            p2p_current_state = P2P_RES_SENT_AWAITING_RES;
-                        }
-
-                    } else if (p2p_current_state == P2P_REQ_SENT && code == RES_CONNPEER) {
-                        strncpy(peer_pids_for_me, payload, sizeof(peer_pids_for_me) - 1);
-                        peer_pids_for_me[sizeof(peer_pids_for_me) - 1] = '\0';
-
-                        snprintf(my_pids_for_peer, sizeof(my_pids_for_peer), "Peer%d_Passive", peer_socket_fd);
-                        log_info("P2P handshake complete (active side). Sending confirmation...");
-
-                        build_control_message(msg_out, sizeof(msg_out), RES_CONNPEER, my_pids_for_peer);
-                        if (write(peer_socket_fd, msg_out, strlen(msg_out)) < 0) {
-                            log_error("Failed to send RES_CONNPEER confirmation.");
-                            close(peer_socket_fd);
-                            peer_socket_fd = -1;
-                            p2p_current_state = P2P_DISCONNECTED;
-                        } else {
-                            p2p_current_state = P2P_FULLY_ESTABLISHED;
-                            sprintf(log_msg, "P2P connection with peer %s (ID: %s) fully established.",
-                                    my_pids_for_peer, peer_pids_for_me);
-                            log_info(log_msg);
-                        }
-
-                    } else if (p2p_current_state == P2P_RES_SENT_AWAITING_RES && code == RES_CONNPEER) {
-                        strncpy(peer_pids_for_me, payload, sizeof(peer_pids_for_me) - 1);
-                        peer_pids_for_me[sizeof(peer_pids_for_me) - 1] = '\0';
-
-                        p2p_current_state = P2P_FULLY_ESTABLISHED;
-                        sprintf(log_msg, "P2P connection with peer %s (ID: %s) fully established.",
-                                my_pids_for_peer, peer_pids_for_me);
-                        log_info(log_msg);
-                    } else if (code == REQ_DISCPEER) {
-                        if (strcmp(payload, peer_pids_for_me) == 0) {
-                            sprintf(log_msg, "REQ_DISCPEER received from peer %s (ID: %s). Confirming.", my_pids_for_peer, peer_pids_for_me);
-                            log_info(log_msg);
-
-                            sprintf(payload_out, "%02d", OK_SUCCESSFUL_DISCONNECT);
-                            build_control_message(msg_out, sizeof(msg_out), OK_MSG, payload_out);
-
-                            if (write(peer_socket_fd, msg_out, strlen(msg_out)) < 0) {
-                                log_error("Failed to send OK(01) to peer.");
-                            } else {
-                                log_info("OK(01) sent to peer.");
-                            }
-
-                            sprintf(log_msg, "Peer %s disconnected.", my_pids_for_peer);
-                            log_info(log_msg);
-
-                            close(peer_socket_fd);
-                            peer_socket_fd = -1;
-                            p2p_current_state = P2P_DISCONNECTED;
-                            my_pids_for_peer[0] = '\0';
-                            peer_pids_for_me[0] = '\0';
-
-                            log_info("Switching to passive P2P listening...");
-
-                            if (peer_listen_fd <= 0) {
-                                if ((peer_listen_fd = socket(AF_INET, SOCK_STREAM, 0)) != -1) {
-                                    int opt = 1;
-                                    setsockopt(peer_listen_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
-                                    addr_peer_listen.sin_family = AF_INET;
-                                    addr_peer_listen.sin_addr.s_addr = INADDR_ANY;
-                                    addr_peer_listen.sin_port = htons(peer_port);
-
-                                    if (bind(peer_listen_fd, (struct sockaddr *)&addr_peer_listen, sizeof(addr_peer_listen)) == 0 &&
-                                        listen(peer_listen_fd, 1) == 0) {
-                                        sprintf(log_msg, "Now listening for new P2P connections on port %d...", peer_port);
-                                        log_info(log_msg);
-                                    } else {
-                                        log_error("Failed to restart passive P2P listening.");
-                                        close(peer_listen_fd);
-                                        peer_listen_fd = -1;
-                                    }
-                                }
-                            }
-                        } else {
-                            sprintf(log_msg, "REQ_DISCPEER received with mismatched ID '%s'. Expected '%s'. Sending ERROR(02).", payload, peer_pids_for_me);
-                            log_info(log_msg);
-
-                            sprintf(payload_out, "%02d", PEER_NOT_FOUND);
-                            build_control_message(msg_out, sizeof(msg_out), ERROR_MSG, payload_out);
-
-                            if (write(peer_socket_fd, msg_out, strlen(msg_out)) < 0) {
-                                log_error("Failed to send ERROR(02) to peer.");
-                            }
-                        }
-
-                    } else if (code == OK_MSG && atoi(payload) == OK_SUCCESSFUL_DISCONNECT) {
-                        log_info("OK(01) 'Successful disconnect' received from peer.");
-                        sprintf(log_msg, "Peer %s disconnected.", my_pids_for_peer);
-                        log_info(log_msg);
-
-                        close(peer_socket_fd);
-                        peer_socket_fd = -1;
-                        p2p_current_state = P2P_DISCONNECTED;
-                        my_pids_for_peer[0] = '\0';
-                        peer_pids_for_me[0] = '\0';
-
-                        log_info("Server shutting down after peer disconnection.");
-                        close(client_master_fd);
+            if (link->shm_handoff_fd >= 0 && FD_ISSET(link->shm_handoff_fd, &read_fds)) {
+                if (shm_handoff_send(link->shm_handoff_fd, &link->shm) < 0) {
+                    log_error("Failed to hand the shared-memory P2P link over to the SL.");
+                }
+                close(link->shm_handoff_fd);
+                link->shm_handoff_fd = -1;
+            }
+            if (link->shm_active && (FD_ISSET(link->shm.rx_eventfd, &read_fds) || shm_link_pending(&link->shm))) {
+                shm_link_clear_wakeup(&link->shm);
+                size_t len;
+                while (link->shm_active && (len = shm_link_recv(&link->shm, buffer, MAX_MSG_SIZE)) > 0) {
+                    if (process_peer_data(link, buffer, len) < 0) {
+                        shutdown_requested = 1;
                         break;
-
-                    } else if (code == ERROR_MSG && atoi(payload) == PEER_NOT_FOUND) {
-                        log_info("ERROR(02) 'Peer not found' received from peer.");
-                        close(peer_socket_fd);
-                        peer_socket_fd = -1;
-                        p2p_current_state = P2P_DISCONNECTED;
-
-                    } else if (code == REQ_CHECKALERT && current_server_role == SERVER_TYPE_LOCATION) {
-                        char sensor_id[MAX_PIDS_LENGTH];
-                        strncpy(sensor_id, payload, sizeof(sensor_id) - 1);
-                        sensor_id[sizeof(sensor_id) - 1] = '\0';
-
-                        sprintf(log_msg, "[SL] REQ_CHECKALERT for sensor %s", sensor_id);
-                        log_info(log_msg);
-
-                        int found_loc_id = -1;
-                        for (int i = 0; i < MAX_CLIENTS; i++) {
-                            if (connected_clients[i].socket_fd > 0 &&
-                                strcmp(connected_clients[i].client_id, sensor_id) == 0) {
-                                found_loc_id = connected_clients[i].location_id;
-                                break;
-                            }
-                        }
-
-                        if (found_loc_id > 0) {
-                            sprintf(payload_out, "%d", found_loc_id);
-                            build_control_message(msg_out, sizeof(msg_out), RES_CHECKALERT, payload_out);
-                            sprintf(log_msg, "[SL] Found location %d for sensor %s. Sending RES_CHECKALERT.", found_loc_id, sensor_id);
-                            log_info(log_msg);
-                        } else {
-                            sprintf(payload_out, "%02d", SENSOR_NOT_FOUND);
-                            build_control_message(msg_out, sizeof(msg_out), ERROR_MSG, payload_out);
-                            sprintf(log_msg, "[SL] Sensor %s not found. Sending ERROR(10).", sensor_id);
-                            log_info(log_msg);
-                        }
-
-                        if (write(peer_socket_fd, msg_out, strlen(msg_out)) < 0) {
-                            log_error("SL: Failed to send response to REQ_CHECKALERT.");
-                        }
-
-                    } else {
-                        sprintf(log_msg, "Unexpected P2P message (Code=%d) or invalid state (%d).", code, p2p_current_state);
-                        log_info(log_msg);
                     }
-                } else {
-                    log_error("Failed to parse P2P message.");
-                    close(peer_socket_fd);
-                    peer_socket_fd = -1;
-                    p2p_current_state = P2P_DISCONNECTED;
                 }
-            } else if (bytes_read == 0) {
-                log_info("Peer disconnected.");
-                close(peer_socket_fd);
-                peer_socket_fd = -1;
-                p2p_current_state = P2P_DISCONNECTED;
-                my_pids_for_peer[0] = '\0';
-                peer_pids_for_me[0] = '\0';
+                if (shutdown_requested) break;
+                if (p2p_thread_closed(&link->thread) && !shm_link_pending(&link->shm)) {
+                    sprintf(log_msg, "Peer %s disconnected.", link->my_pids);
+                    log_info(log_msg);
+                    reset_peer_connection(link);
+                    start_passive_p2p_listener();
+                }
+            }
+        }
+        if (shutdown_requested) break;
+
+        // --- PRIMARY SL CHANGE STREAM (SLR only) ---
+        if (primary_fd > 0 && FD_ISSET(primary_fd, &read_fds)) {
+            ssize_t bytes_read = recv(primary_fd, buffer, MAX_MSG_SIZE, MSG_DONTWAIT);
+            if (bytes_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                // Nothing to read
+            } else if (bytes_read <= 0 || message_buffer_append(&primary_rx, buffer, bytes_read) < 0) {
+                log_info("Lost connection to the primary SL. Reconnecting...");
+                close_primary();
             } else {
-                log_error("Error reading from peer.");
-                close(peer_socket_fd);
-                peer_socket_fd = -1;
-                p2p_current_state = P2P_DISCONNECTED;
+                char message[MAX_MSG_SIZE + 1];
+                while (primary_fd > 0 && message_buffer_next(&primary_rx, message, sizeof(message))) {
+                    capture_write(&capture, CAPTURE_PEER_CONN, CAPTURE_RECV, message, strlen(message));
+                    current_trace_id = trace_strip(message);
+                    current_trace_start_us = current_trace_id != 0 ? monotonic_us() : 0;
+                    handle_primary_message(message);
+                    if (current_trace_id != 0) {
+                        trace_span(current_trace_id, "primary", atoi(message), current_trace_start_us, monotonic_us());
+                        current_trace_id = 0;
+                    }
+                }
+            }
+        }
+
+        // --- READ REPLICA SUBSCRIBERS (SL only) ---
+        for (int n = 0; n < MAX_REPL_SUBSCRIBERS; n++) {
+            ReplSubscriber *sub = &repl_subscribers[n];
+            if (sub->fd > 0 && FD_ISSET(sub->fd, &read_fds)) {
+                ssize_t bytes_read = recv(sub->fd, buffer, MAX_MSG_SIZE, MSG_DONTWAIT);
+                if (bytes_read >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+                    handle_repl_subscriber_data(sub, buffer, bytes_read);
+                }
+            }
+            if (sub->fd > 0 && sub->tx_len > 0 && flush_tx(sub->fd, sub->tx, &sub->tx_len) < 0) {
+                close_repl_subscriber(sub);
             }
         }
 
@@ -568,392 +3678,49 @@ int main(int argc, char *argv[]) {
 
             if (client_fd > 0 && FD_ISSET(client_fd, &read_fds)) {
                 ssize_t bytes_read = read(client_fd, buffer, MAX_MSG_SIZE);
-                if (bytes_read > 0) {
-                    buffer[bytes_read] = '\0';
-
-                    int code;
-                    char payload[MAX_MSG_SIZE];
-
-                    struct sockaddr_in cli_addr;
-                    socklen_t cli_len = sizeof(cli_addr);
-                    getpeername(client_fd, (struct sockaddr *)&cli_addr, &cli_len);
-                    sprintf(log_msg, "Data received from client %s:%d (socket %d)",
-                            inet_ntoa(cli_addr.sin_addr), ntohs(cli_addr.sin_port), client_fd);
-                    log_info(log_msg);
-
-                    if (parse_message(buffer, &code, payload, sizeof(payload))) {
-                        //sprintf(log_msg, "Parsed client message: Code=%d, Payload='%s'", code, payload);
-                        //log_info(log_msg);
-
-                        // --- SENSOR REGISTRATION ---
-                        if (code == REQ_CONNSEN) {
-                            char sensor_id[MAX_PIDS_LENGTH];
-                            char loc_id_str[10];
-                            int loc_id;
-                            int valid = 0;
-
-                            char *comma = strchr(payload, ',');
-                            if (comma != NULL) {
-                                size_t id_len = comma - payload;
-                                if (id_len > 0 && id_len < MAX_PIDS_LENGTH) {
-                                    strncpy(sensor_id, payload, id_len);
-                                    sensor_id[id_len] = '\0';
-
-                                    strncpy(loc_id_str, comma + 1, sizeof(loc_id_str) - 1);
-                                    loc_id_str[sizeof(loc_id_str) - 1] = '\0';
-
-                                    if (strlen(loc_id_str) > 0) {
-                                        loc_id = atoi(loc_id_str);
-                                        if (loc_id == -1) {
-                                            // Generate random location between 1 and 10
-                                            loc_id = (rand() % 10) + 1;
-                                        }
-                                        if (strlen(sensor_id) == 10) {
-                                            valid = 1;
-                                            sprintf(log_msg, "REQ_CONNSEN parsed: ID='%s', LocId=%d", sensor_id, loc_id);
-                                            log_info(log_msg);
-                                        } else {
-                                            log_error("REQ_CONNSEN: Sensor ID must be exactly 10 characters.");
-                                        }
-                                    } else {
-                                        log_error("REQ_CONNSEN: Missing LocId.");
-                                    }
-                                } else {
-                                    log_error("REQ_CONNSEN: Invalid sensor ID length.");
-                                }
-                            } else {
-                                log_error("REQ_CONNSEN: Invalid format, expected 'ID,LocId'.");
-                            }
-
-                            if (!valid) {
-                                char err_payload[10];
-                                sprintf(err_payload, "%02d", INVALID_PAYLOAD_ERROR);
-                                char msg_err[MAX_MSG_SIZE];
-                                build_control_message(msg_err, sizeof(msg_err), ERROR_MSG, err_payload);
-                                write(client_fd, msg_err, strlen(msg_err));
-                                close(client_fd);
-                                client_fds[i] = 0;
-                                connected_clients[i].socket_fd = 0;
-                                continue;
-                            }
-
-                            if (connected_clients[i].socket_fd != client_fd) {
-                                sprintf(log_msg, "Mismatch in client slot %d: socket %d != %d. Closing connection.",
-                                        i, connected_clients[i].socket_fd, client_fd);
-                                log_error(log_msg);
-                                close(client_fd);
-                                client_fds[i] = 0;
-                                if (connected_clients[i].client_id[0] != '\0') num_connected_clients--;
-                                connected_clients[i] = (ClientInfo){0};
-                                continue;
-                            }
-
-                            if (connected_clients[i].client_id[0] == '\0') {
-                                int id_in_use = 0;
-                                for (int k = 0; k < MAX_CLIENTS; k++) {
-                                    if (connected_clients[k].socket_fd > 0 &&
-                                        strcmp(connected_clients[k].client_id, sensor_id) == 0) {
-                                        id_in_use = 1;
-                                        sprintf(log_msg, "Sensor ID '%s' already in use (slot %d). Rejecting.", sensor_id, k + 1);
-                                        log_error(log_msg);
-
-                                        char err_payload[10];
-                                        sprintf(err_payload, "%02d", SENSOR_ID_ALREADY_EXISTS_ERROR);
-                                        char msg_err[MAX_MSG_SIZE];
-                                        build_control_message(msg_err, sizeof(msg_err), ERROR_MSG, err_payload);
-                                        write(client_fd, msg_err, strlen(msg_err));
-                                        close(client_fd);
-                                        client_fds[i] = 0;
-                                        connected_clients[i].socket_fd = 0;
-                                        break;
-                                    }
-                                }
-
-                                if (id_in_use) continue;
-
-                                if (num_connected_clients >= MAX_CLIENTS) {
-                                    log_info("Sensor limit reached. Sending ERROR(09).");
-                                    char err_payload[10];
-                                    sprintf(err_payload, "%02d", SENSOR_LIMIT_EXCEEDED);
-                                    char msg_err[MAX_MSG_SIZE];
-                                    build_control_message(msg_err, sizeof(msg_err), ERROR_MSG, err_payload);
-                                    write(client_fd, msg_err, strlen(msg_err));
-                                    close(client_fd);
-                                    client_fds[i] = 0;
-                                    connected_clients[i].socket_fd = 0;
-                                    continue;
-                                }
-
-                                strncpy(connected_clients[i].client_id, sensor_id, MAX_PIDS_LENGTH - 1);
-                                connected_clients[i].location_id = loc_id;
-                                connected_clients[i].assigned_slot = i + 1;
-                                if (current_server_role == SERVER_TYPE_STATUS) {
-                                    connected_clients[i].risk_status = rand() % 2; // Random risk status for SS
-                                    // Log the risk status
-                                    sprintf(log_msg, "Client %s added (Status%d)",
-                                            connected_clients[i].client_id,
-                                            connected_clients[i].risk_status);
-                                    log_info(log_msg);
-                                } else {
-                                    if (connected_clients[i].location_id == -1) {
-                                    // If location_id is -1, assign a random location between 1 and 15
-                                    connected_clients[i].location_id = (rand() % 15) + 1;
-                                    }
-                                    printf(log_msg, "Client %s added (Loc %d)",
-                                            connected_clients[i].client_id,
-                                            connected_clients[i].location_id);
-                                }
-                                num_connected_clients++;
-
-                                sprintf(log_msg, "Client registered: ID='%s', Slot=%d, LocId=%d",
-                                        sensor_id, connected_clients[i].assigned_slot, loc_id);
-                                log_info(log_msg);
-
-                                char slot_str[10];
-                                sprintf(slot_str, "%d", connected_clients[i].assigned_slot);
-                                char res_msg[MAX_MSG_SIZE];
-                                build_control_message(res_msg, sizeof(res_msg), RES_CONNSEN, slot_str);
-                                write(client_fd, res_msg, strlen(res_msg));
-
-                            } else {
-                                if (strcmp(connected_clients[i].client_id, sensor_id) == 0) {
-                                    sprintf(log_msg, "Client %s re-sent REQ_CONNSEN. Re-sending RES_CONNSEN.", sensor_id);
-                                    log_info(log_msg);
-                                    char res_msg[MAX_MSG_SIZE];
-                                    build_control_message(res_msg, sizeof(res_msg), RES_CONNSEN, sensor_id);
-                                    write(client_fd, res_msg, strlen(res_msg));
-                                } else {
-                                    sprintf(log_msg, "Client slot %d already registered with ID %s. Ignoring conflicting REQ_CONNSEN with ID %s.",
-                                            i + 1, connected_clients[i].client_id, sensor_id);
-                                    log_error(log_msg);
-                                }
-                            }
-
-                        // --- SENSOR DISCONNECTION ---
-                        } else if (code == REQ_DISCSEN) {
-                            char slot_str[10];
-                            strncpy(slot_str, payload, sizeof(slot_str) - 1);
-                            slot_str[sizeof(slot_str) - 1] = '\0';
-                            int received_slot = atoi(slot_str);
-
-                            if (connected_clients[i].socket_fd == client_fd &&
-                                connected_clients[i].assigned_slot == received_slot &&
-                                connected_clients[i].client_id[0] != '\0') {
-
-                                sprintf(log_msg, "Client (ID: %s, Slot: %d) disconnected.",
-                                        connected_clients[i].client_id, connected_clients[i].assigned_slot);
-                                log_info(log_msg);
-
-                                char ok_payload[10];
-                                sprintf(ok_payload, "%02d", OK_SUCCESSFUL_DISCONNECT);
-                                char msg_ok[MAX_MSG_SIZE];
-                                build_control_message(msg_ok, sizeof(msg_ok), OK_MSG, ok_payload);
-                                write(client_fd, msg_ok, strlen(msg_ok));
-
-                                close(client_fd);
-                                client_fds[i] = 0;
-                                if (connected_clients[i].client_id[0] != '\0') num_connected_clients--;
-                                connected_clients[i] = (ClientInfo){0};
-                            } else {
-                                sprintf(log_msg, "Invalid REQ_DISCSEN: slot '%s' mismatch or client not registered. Sending ERROR(10).",
-                                        slot_str);
-                                log_info(log_msg);
-
-                                char err_payload[10];
-                                sprintf(err_payload, "%02d", SENSOR_NOT_FOUND);
-                                char msg_err[MAX_MSG_SIZE];
-                                build_control_message(msg_err, sizeof(msg_err), ERROR_MSG, err_payload);
-                                write(client_fd, msg_err, strlen(msg_err));
-                            }
-                        // --- SENSOR STATUS REQUEST (SS only) ---
-                        } else if (code == REQ_SENSSTATUS && current_server_role == SERVER_TYPE_STATUS) {
-                            int slot_id = atoi(payload);
-
-                            if (connected_clients[i].socket_fd == client_fd &&
-                                connected_clients[i].assigned_slot == slot_id &&
-                                connected_clients[i].client_id[0] != '\0') {
-
-                                sprintf(log_msg, "REQ_SENSSTATUS from sensor %s (Slot: %d)",
-                                        connected_clients[i].client_id, connected_clients[i].assigned_slot);
-                                log_info(log_msg);
-
-                                if (connected_clients[i].risk_status == 1) {
-                                    if (peer_socket_fd > 0 && p2p_current_state == P2P_FULLY_ESTABLISHED) {
-                                        sprintf(log_msg, "Sending REQ_CHECKALERT %s to SL...", connected_clients[i].client_id);
-                                        log_info(log_msg);
-
-                                        char msg_to_sl[MAX_MSG_SIZE];
-                                        build_control_message(msg_to_sl, sizeof(msg_to_sl), REQ_CHECKALERT, connected_clients[i].client_id);
-                                        if (write(peer_socket_fd, msg_to_sl, strlen(msg_to_sl)) < 0) {
-                                            log_error("SS: Failed to send REQ_CHECKALERT to SL.");
-                                        } else {
-                                            char sl_response[MAX_MSG_SIZE];
-                                            ssize_t sl_read = read(peer_socket_fd, sl_response, sizeof(sl_response) - 1);
-                                            if (sl_read > 0) {
-                                                sl_response[sl_read] = '\0';
-                                                int sl_code;
-                                                char sl_payload[MAX_MSG_SIZE];
-                                                if (parse_message(sl_response, &sl_code, sl_payload, sizeof(sl_payload))) {
-                                                    char msg_to_client[MAX_MSG_SIZE];
-                                                    if (sl_code == RES_CHECKALERT) {
-                                                        sprintf(log_msg, "SL responded with RES_CHECKALERT %s", sl_payload);
-                                                        log_info(log_msg);
-                                                        sprintf(log_msg, "Sensor %s status = 1 (failure detected)", connected_clients[i].client_id);
-                                                        log_info(log_msg);
-                                                        build_control_message(msg_to_client, sizeof(msg_to_client), RES_SENSSTATUS, sl_payload);
-                                                        write(client_fd, msg_to_client, strlen(msg_to_client));
-                                                    } else if (sl_code == ERROR_MSG && atoi(sl_payload) == SENSOR_NOT_FOUND) {
-                                                        log_info("SL returned SENSOR_NOT_FOUND.");
-                                                        build_control_message(msg_to_client, sizeof(msg_to_client), ERROR_MSG, sl_payload);
-                                                        write(client_fd, msg_to_client, strlen(msg_to_client));
-                                                    } else {
-                                                        sprintf(log_msg, "Unexpected SL response: Code=%d, Payload=%s", sl_code, sl_payload);
-                                                        log_error(log_msg);
-                                                    }
-                                                } else {
-                                                    log_error("Failed to parse SL response.");
-                                                }
-                                            } else if (sl_read == 0) {
-                                                log_error("SL disconnected before responding.");
-                                            } else {
-                                                log_error("Error reading SL response.");
-                                            }
-                                        }
-                                    } else {
-                                        log_error("No active P2P connection to SL.");
-                                    }
-                                } else {
-                                    log_info("Sensor status is normal (0), no alert.");
-                                    char msg_normal[MAX_MSG_SIZE];
-                                    build_control_message(msg_normal, sizeof(msg_normal), RES_SENSSTATUS, "-1");
-                                    write(client_fd, msg_normal, strlen(msg_normal));
-                                }
-                            } else {
-                                sprintf(log_msg, "Invalid REQ_SENSSTATUS from client. Slot mismatch or not registered.");
-                                log_error(log_msg);
-                                char err_payload[10];
-                                sprintf(err_payload, "%02d", SENSOR_NOT_FOUND);
-                                char msg_err[MAX_MSG_SIZE];
-                                build_control_message(msg_err, sizeof(msg_err), ERROR_MSG, err_payload);
-                                write(client_fd, msg_err, strlen(msg_err));
-                            }
-
-                        // --- SENSOR LOCATION REQUEST (SL only) ---
-                        } else if (code == REQ_SENSLOC && current_server_role == SERVER_TYPE_LOCATION) {
-                            char sensor_id[MAX_PIDS_LENGTH];
-                            strncpy(sensor_id, payload, sizeof(sensor_id) - 1);
-                            sensor_id[sizeof(sensor_id) - 1] = '\0';
-
-                            int loc_id_found = -1;
-                            for (int k = 0; k < MAX_CLIENTS; k++) {
-                                if (connected_clients[k].socket_fd > 0 &&
-                                    strcmp(connected_clients[k].client_id, sensor_id) == 0) {
-                                    loc_id_found = connected_clients[k].location_id;
-                                    break;
-                                }
-                            }
-
-                            char msg_out[MAX_MSG_SIZE];
-                            if (loc_id_found != -1) {
-                                sprintf(log_msg, "Sensor %s found with LocId=%d", sensor_id, loc_id_found);
-                                log_info(log_msg);
-                                char loc_str[10];
-                                sprintf(loc_str, "%d", loc_id_found);
-                                build_control_message(msg_out, sizeof(msg_out), RES_SENSLOC, loc_str);
-                            } else {
-                                log_info("Sensor not found. Sending ERROR(10).");
-                                char err_payload[10];
-                                sprintf(err_payload, "%02d", SENSOR_NOT_FOUND);
-                                build_control_message(msg_out, sizeof(msg_out), ERROR_MSG, err_payload);
-                            }
-                            write(client_fd, msg_out, strlen(msg_out));
-
-                        // --- LIST SENSORS AT LOCATION (SL only) ---
-                        } else if (code == REQ_LOCLIST && current_server_role == SERVER_TYPE_LOCATION) {
-                            char requester_slot_str[10], target_loc_str[10];
-                            int target_loc_id = -1;
-                            int valid = 0;
-
-                            char *comma = strchr(payload, ',');
-                            if (comma != NULL) {
-                                size_t slot_len = comma - payload;
-                                if (slot_len > 0 && slot_len < sizeof(requester_slot_str)) {
-                                    strncpy(requester_slot_str, payload, slot_len);
-                                    requester_slot_str[slot_len] = '\0';
-                                    strncpy(target_loc_str, comma + 1, sizeof(target_loc_str) - 1);
-                                    target_loc_str[sizeof(target_loc_str) - 1] = '\0';
-                                    target_loc_id = atoi(target_loc_str);
-                                    valid = 1;
-                                }
-                            }
-
-                            if (!valid || target_loc_id < 1 || target_loc_id > 10) {
-                                log_error("REQ_LOCLIST: Invalid format or location.");
-                                char err_payload[10];
-                                sprintf(err_payload, "%02d", SENSOR_NOT_FOUND);
-                                char msg_err[MAX_MSG_SIZE];
-                                build_control_message(msg_err, sizeof(msg_err), ERROR_MSG, err_payload);
-                                write(client_fd, msg_err, strlen(msg_err));
-                                continue;
-                            }
-
-                            char sensor_list[MAX_MSG_SIZE] = "";
-                            int count = 0;
-                            for (int k = 0; k < MAX_CLIENTS; k++) {
-                                if (connected_clients[k].socket_fd > 0 &&
-                                    connected_clients[k].location_id == target_loc_id) {
-                                    if (count++ > 0) strcat(sensor_list, ",");
-                                    strcat(sensor_list, connected_clients[k].client_id);
-                                }
-                            }
-
-                            char msg_out[MAX_MSG_SIZE];
-                            if (count > 0) {
-                                sprintf(log_msg, "Found %d sensors at location %d", count, target_loc_id);
-                                log_info(log_msg);
-                                build_control_message(msg_out, sizeof(msg_out), RES_LOCLIST, sensor_list);
-                            } else {
-                                sprintf(log_msg, "No sensors found at location %d. Sending ERROR(10).", target_loc_id);
-                                log_info(log_msg);
-                                char err_payload[10];
-                                sprintf(err_payload, "%02d", SENSOR_NOT_FOUND);
-                                build_control_message(msg_out, sizeof(msg_out), ERROR_MSG, err_payload);
-                            }
+                process_client_data(i, buffer, bytes_read);
+            }
+        }
 
-                            write(client_fd, msg_out, strlen(msg_out));
+        // --- QUEUED CLIENT REQUESTS ---
+        serve_request_queues();
 
-                        } else {
-                            sprintf(log_msg, "Unknown or unexpected client message code: %d", code);
-                            log_info(log_msg);
-                        }
-                    } else {
-                        log_error("Failed to parse client message.");
-                    }
-                } else if (bytes_read == 0) {
-                    sprintf(log_msg, "Client (socket %d) disconnected.", client_fd);
-                    log_info(log_msg);
-                    close(client_fd);
-                    client_fds[i] = 0;
-                    if (connected_clients[i].socket_fd != 0) {
-                        connected_clients[i] = (ClientInfo){0};
-                        if (num_connected_clients > 0) num_connected_clients--;
-                    }
-                } else {
-                    log_error("Error reading from client.");
-                    close(client_fd);
-                    client_fds[i] = 0;
-                    if (connected_clients[i].socket_fd != 0) {
-                        connected_clients[i] = (ClientInfo){0};
-                        if (num_connected_clients > 0) num_connected_clients--;
-                    }
-                }
+        // --- HELD CLIENT REPLIES ---
+        for (int i = 0; i < MAX_CLIENTS; i++) {
+            if (client_fds[i] > 0 && client_tx_len[i] > 0 && flush_tx(client_fds[i], client_tx[i], &client_tx_len[i]) < 0) {
+                sprintf(log_msg, "Failed to send held replies to client %s. Disconnecting it.", client_addr_desc[i]);
+                log_error(log_msg);
+                drop_client(i);
             }
         }
+        loop_latency_avg_us = (3 * loop_latency_avg_us + (monotonic_us() - loop_wake_us)) / 4;
     } // end of main loop
     log_info("Shutting down and cleaning up...");
     close(client_master_fd);
-    if (peer_socket_fd > 0) close(peer_socket_fd);
-    if (peer_listen_fd > 0) close(peer_listen_fd);
+    transport_cleanup(client_listen_addr);
+    for (int n = 0; n < MAX_PEERS; n++) {
+        close_peer_socket(&peer_links[n]);
+    }
+    if (peer_listen_fd > 0) {
+        close(peer_listen_fd);
+        transport_cleanup(peer_listen_addr);
+    }
+    if (udp_fd > 0) close(udp_fd);
+    if (primary_fd > 0) close(primary_fd);
+    for (int n = 0; n < MAX_REPL_SUBSCRIBERS; n++) {
+        if (repl_subscribers[n].fd > 0) close(repl_subscribers[n].fd);
+    }
+    if (risk_feed_fd > 0) {
+        close(risk_feed_fd);
+        unlink(risk_feed_path);
+    }
+    if (io_backend == IO_BACKEND_URING) uring_destroy(&uring);
+    if (capture.file != NULL) {
+        sprintf(log_msg, "Capture closed with %llu records.", (unsigned long long)capture.records);
+        log_info(log_msg);
+        capture_close(&capture);
+    }
+    if (trace_path != NULL) export_trace();
 
     for (int i = 0; i < MAX_CLIENTS; i++) {
         connected_clients[i] = (ClientInfo){0};
@@ -0,0 +1,199 @@
+#define _GNU_SOURCE // For memfd_create and accept4
+#include "common.h"
+#include "shmring.h"
+#include <errno.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+
+#define SHM_REGION_SIZE (2 * sizeof(ShmRing))
+
+static unsigned shm_handoff_counter = 0;
+
+// Maps the region of the memfd in fds[0] and assigns the rings and wakeups of one side of the link
+static int shm_link_map(ShmLink *link, const int fds[SHM_LINK_FDS], int creator) {
+    link->region = mmap(NULL, SHM_REGION_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+    if (link->region == MAP_FAILED) {
+        link->region = NULL;
+        return -1;
+    }
+    ShmRing *rings = link->region;
+    for (int i = 0; i < SHM_LINK_FDS; i++) link->fds[i] = fds[i];
+    link->tx = creator ? &rings[0] : &rings[1];
+    link->rx = creator ? &rings[1] : &rings[0];
+    link->tx_eventfd = creator ? fds[1] : fds[2];
+    link->rx_eventfd = creator ? fds[2] : fds[1];
+    return 0;
+}
+
+// Creates a new link: the memfd holding both rings and the two eventfds. Returns 0 on success, -1 on error.
+int shm_link_create(ShmLink *link) {
+    int fds[SHM_LINK_FDS] = { -1, -1, -1 };
+    memset(link, 0, sizeof(*link));
+
+    fds[0] = memfd_create("p2p-shm", MFD_CLOEXEC);
+    fds[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    fds[2] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (fds[0] >= 0 && fds[1] >= 0 && fds[2] >= 0 &&
+        ftruncate(fds[0], SHM_REGION_SIZE) == 0 && shm_link_map(link, fds, 1) == 0) {
+        return 0; // A new memfd is zero-filled, so both rings start empty
+    }
+    for (int i = 0; i < SHM_LINK_FDS; i++) {
+        if (fds[i] >= 0) close(fds[i]);
+    }
+    return -1;
+}
+
+// Attaches to a link created by the peer, from the descriptors received with shm_handoff_receive.
+// Takes ownership of the descriptors. Returns 0 on success, -1 on error.
+int shm_link_attach(ShmLink *link, const int fds[SHM_LINK_FDS]) {
+    memset(link, 0, sizeof(*link));
+    if (shm_link_map(link, fds, 0) == 0) return 0;
+    for (int i = 0; i < SHM_LINK_FDS; i++) close(fds[i]);
+    return -1;
+}
+
+void shm_link_close(ShmLink *link) {
+    if (link->region == NULL) return;
+    munmap(link->region, SHM_REGION_SIZE);
+    for (int i = 0; i < SHM_LINK_FDS; i++) close(link->fds[i]);
+    memset(link, 0, sizeof(*link));
+}
+
+// Pushes len bytes to the peer. Returns 0 on success, -1 if the ring has no room for all of them
+// (nothing is written then, so messages are never split by a full ring).
+int shm_link_send(ShmLink *link, const char *data, size_t len) {
+    ShmRing *ring = link->tx;
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    if (SHM_RING_SIZE - (head - tail) < len) return -1;
+
+    size_t offset = head & (SHM_RING_SIZE - 1);
+    size_t first = len < SHM_RING_SIZE - offset ? len : SHM_RING_SIZE - offset;
+    memcpy(ring->data + offset, data, first);
+    memcpy(ring->data, data + first, len - first);
+    atomic_store_explicit(&ring->head, head + len, memory_order_seq_cst);
+
+    // The consumer stores its tail before it last checks the head, so either it sees these bytes
+    // or its tail equals our old head here and it may be asleep: only then is a wakeup needed
+    if (atomic_load_explicit(&ring->tail, memory_order_seq_cst) == head) {
+        uint64_t one = 1;
+        if (write(link->tx_eventfd, &one, sizeof(one)) < 0 && errno != EAGAIN) return -1;
+    }
+    return 0;
+}
+
+// Takes up to out_size bytes sent by the peer. Returns the number of bytes copied, 0 if the ring is empty.
+size_t shm_link_recv(ShmLink *link, char *out, size_t out_size) {
+    ShmRing *ring = link->rx;
+    uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_seq_cst);
+    size_t len = head - tail < out_size ? (size_t)(head - tail) : out_size;
+    if (len == 0) return 0;
+
+    size_t offset = tail & (SHM_RING_SIZE - 1);
+    size_t first = len < SHM_RING_SIZE - offset ? len : SHM_RING_SIZE - offset;
+    memcpy(out, ring->data + offset, first);
+    memcpy(out + first, ring->data, len - first);
+    atomic_store_explicit(&ring->tail, tail + len, memory_order_seq_cst);
+    return len;
+}
+
+// Returns 1 if the peer has pushed bytes that were not received yet
+int shm_link_pending(const ShmLink *link) {
+    return atomic_load_explicit(&link->rx->head, memory_order_acquire) !=
+           atomic_load_explicit(&link->rx->tail, memory_order_relaxed);
+}
+
+// Resets the wakeup eventfd; called before draining the ring
+void shm_link_clear_wakeup(ShmLink *link) {
+    uint64_t count;
+    if (read(link->rx_eventfd, &count, sizeof(count)) < 0) {
+        // EAGAIN: no wakeup was pending
+    }
+}
+
+static socklen_t shm_handoff_address(struct sockaddr_un *addr, const char *name) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    size_t len = strlen(name);
+    if (len > sizeof(addr->sun_path) - 1) len = sizeof(addr->sun_path) - 1;
+    memcpy(addr->sun_path + 1, name, len); // Abstract namespace: leading NUL, nothing on disk
+    return (socklen_t)(offsetof(struct sockaddr_un, sun_path) + 1 + len);
+}
+
+// Opens the one-shot abstract Unix socket the peer fetches the link descriptors from.
+// Writes its name to name. Returns the listening socket, or -1 on error.
+int shm_handoff_listen(char *name, size_t name_size) {
+    struct sockaddr_un addr;
+    snprintf(name, name_size, "srv-p2p-shm-%d-%u", (int)getpid(), ++shm_handoff_counter);
+    socklen_t addr_len = shm_handoff_address(&addr, name);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    if (bind(fd, (struct sockaddr *)&addr, addr_len) < 0 || listen(fd, 1) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Accepts the peer on the handoff socket and sends it the link descriptors with SCM_RIGHTS.
+// Returns 0 on success, -1 on error.
+int shm_handoff_send(int listen_fd, const ShmLink *link) {
+    int conn_fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+    if (conn_fd < 0) return -1;
+
+    char byte = 'S';
+    struct iovec iov = { .iov_base = &byte, .iov_len = 1 };
+    union {
+        struct cmsghdr header;
+        char buffer[CMSG_SPACE(sizeof(int) * SHM_LINK_FDS)];
+    } control;
+    memset(&control, 0, sizeof(control));
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1,
+                          .msg_control = control.buffer, .msg_controllen = sizeof(control.buffer) };
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * SHM_LINK_FDS);
+    memcpy(CMSG_DATA(cmsg), link->fds, sizeof(int) * SHM_LINK_FDS);
+
+    ssize_t sent = sendmsg(conn_fd, &msg, MSG_NOSIGNAL);
+    close(conn_fd);
+    return sent == 1 ? 0 : -1;
+}
+
+// Connects to the peer's handoff socket and receives the link descriptors, waiting at most
+// SHM_HANDOFF_TIMEOUT_MS. Returns 0 on success, -1 on error.
+int shm_handoff_receive(const char *name, int fds[SHM_LINK_FDS]) {
+    struct sockaddr_un addr;
+    socklen_t addr_len = shm_handoff_address(&addr, name);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    if (connect(fd, (struct sockaddr *)&addr, addr_len) < 0 || poll(&pfd, 1, SHM_HANDOFF_TIMEOUT_MS) <= 0) {
+        close(fd);
+        return -1;
+    }
+
+    char byte;
+    struct iovec iov = { .iov_base = &byte, .iov_len = 1 };
+    union {
+        struct cmsghdr header;
+        char buffer[CMSG_SPACE(sizeof(int) * SHM_LINK_FDS)];
+    } control;
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1,
+                          .msg_control = control.buffer, .msg_controllen = sizeof(control.buffer) };
+    ssize_t received = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+    close(fd);
+
+    struct cmsghdr *cmsg = received == 1 ? CMSG_FIRSTHDR(&msg) : NULL;
+    if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS ||
+        cmsg->cmsg_len != CMSG_LEN(sizeof(int) * SHM_LINK_FDS)) {
+        return -1;
+    }
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * SHM_LINK_FDS);
+    return 0;
+}
@@ -0,0 +1,46 @@
+#ifndef SHMRING_H
+#define SHMRING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+// Shared-memory transport for co-located SS and SL. A memfd holds one single-producer,
+// single-consumer byte ring per direction, carrying the same "code payload\n" stream as the
+// P2P socket. Each direction has an eventfd the producer signals only when the consumer may
+// have found the ring empty, so a busy link exchanges messages without any system call.
+// The memfd and the eventfds are handed over with SCM_RIGHTS on a one-shot abstract Unix socket.
+#define SHM_RING_SIZE (64 * 1024)   // Bytes per direction (power of two)
+#define SHM_HANDOFF_TIMEOUT_MS 1000 // Time the accepting side waits for the descriptors
+#define SHM_LINK_FDS 3              // memfd, eventfd of ring 0, eventfd of ring 1
+
+typedef struct {
+    _Atomic uint64_t head;          // Bytes written, advanced by the producer
+    char pad_head[56];              // Keeps producer and consumer counters on separate cache lines
+    _Atomic uint64_t tail;          // Bytes read, advanced by the consumer
+    char pad_tail[56];
+    char data[SHM_RING_SIZE];
+} ShmRing;
+
+typedef struct {
+    void *region;                   // Two ShmRings; ring 0 carries creator -> attacher
+    ShmRing *tx;
+    ShmRing *rx;
+    int fds[SHM_LINK_FDS];          // Kept open while the link lives, so they can be handed over
+    int tx_eventfd;                 // Signalled when data is pushed to tx
+    int rx_eventfd;                 // Readable when rx may hold data
+} ShmLink;
+
+int shm_link_create(ShmLink *link);
+int shm_link_attach(ShmLink *link, const int fds[SHM_LINK_FDS]);
+void shm_link_close(ShmLink *link);
+int shm_link_send(ShmLink *link, const char *data, size_t len);
+size_t shm_link_recv(ShmLink *link, char *out, size_t out_size);
+int shm_link_pending(const ShmLink *link);
+void shm_link_clear_wakeup(ShmLink *link);
+
+int shm_handoff_listen(char *name, size_t name_size);
+int shm_handoff_send(int listen_fd, const ShmLink *link);
+int shm_handoff_receive(const char *name, int fds[SHM_LINK_FDS]);
+
+#endif // SHMRING_H
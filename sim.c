@@ -0,0 +1,501 @@
+#include "common.h"
+#include "timerwheel.h"
+
+// Deterministic in-process protocol simulator. An SS, an SL and any number of sensors run in a
+// single process on a virtual clock: every message is built and parsed in the wire format and
+// handed over through virtual sockets (function calls), and all randomness comes from the seeded
+// generator, so equal arguments give an identical run and an identical digest. It checks the
+// registration and query sequences (slot agreement, duplicate IDs, error replies); it is not a load
+// or memory test of the server, whose registry is capped at MAX_CLIENTS connections.
+
+#define SIM_DEFAULT_SENSORS 10000
+#define SIM_DEFAULT_OPS 10          // Requests each sensor sends between registering and disconnecting
+#define SIM_DEFAULT_INTERVAL_MS 1000 // Mean virtual time between two requests of a sensor
+#define SIM_TICK_MS 1               // Resolution of the virtual clock
+
+// Operation mix of a registered sensor, in percent
+#define SIM_PCT_STATUS 40
+#define SIM_PCT_LOCATE 25           // The remainder moves the sensor (REQ_LOCUPDATE)
+
+typedef enum { NODE_SS, NODE_SL } SimNodeRole;
+
+// One registered sensor of a node, at its slot
+typedef struct {
+    uint64_t key;                   // SENSOR_KEY_NONE when the slot is free
+    int location_id;
+    int risk_status;
+} SimEntry;
+
+// Protocol-level SS or SL
+typedef struct {
+    SimNodeRole role;
+    const char *name;
+    SimEntry *entries;
+    uint32_t capacity;
+    uint32_t *free_slots;           // Stack of free slot indexes, lowest on top
+    uint32_t num_free;
+    uint32_t *index;                // Open addressing, linear probing: key -> slot + 1 (0 = empty)
+    uint32_t index_mask;
+    uint32_t *location_head;        // Per location (0: out of range), slot + 1 of the first sensor
+    uint32_t *location_next;        // Per slot, slot + 1 links of the location lists
+    uint32_t *location_prev;
+    uint64_t messages;
+    uint64_t errors;
+} SimNode;
+
+typedef enum { SENSOR_REGISTER_SS, SENSOR_REGISTER_SL, SENSOR_ACTIVE, SENSOR_DONE } SimSensorState;
+
+typedef struct {
+    Timer timer;
+    uint64_t key;
+    int ss_slot;                    // Slot per connection, 0 until registered
+    int sl_slot;
+    int location_id;
+    int ops_left;
+    SimSensorState state;
+} SimSensor;
+
+TimerWheel wheel;
+uint64_t virtual_now_ms = 0;
+SimNode ss_node, sl_node;
+SimSensor *sensors = NULL;
+uint32_t num_sensors = SIM_DEFAULT_SENSORS;
+uint32_t sensors_done = 0;
+int ops_per_sensor = SIM_DEFAULT_OPS;
+unsigned interval_ms = SIM_DEFAULT_INTERVAL_MS;
+
+uint64_t messages_total = 0;
+uint64_t duplicate_ids = 0;         // Registrations retried with a new ID after ERROR(04)
+uint64_t slot_mismatches = 0;       // Sensors given different slots by the SS and the SL
+uint64_t unexpected_replies = 0;
+uint64_t digest = 0xcbf29ce484222325ull; // FNV-1a over every reply, in order
+
+static void digest_update(const char *message) {
+    for (const char *p = message; *p != '\0'; p++) {
+        digest ^= (unsigned char)*p;
+        digest *= 0x100000001b3ull;
+    }
+}
+
+static uint32_t key_hash(uint64_t key) {
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdull;
+    key ^= key >> 33;
+    return (uint32_t)key;
+}
+
+// Allocates the tables of a node for capacity sensors. Returns 0 on success, -1 if out of memory.
+int sim_node_init(SimNode *node, SimNodeRole role, const char *name, uint32_t capacity) {
+    uint32_t index_size = 1;
+    while (index_size < 2 * capacity) index_size <<= 1; // Load factor at most 1/2
+
+    memset(node, 0, sizeof(*node));
+    node->role = role;
+    node->name = name;
+    node->capacity = capacity;
+    node->index_mask = index_size - 1;
+    node->entries = calloc(capacity, sizeof(node->entries[0]));
+    node->free_slots = malloc(capacity * sizeof(node->free_slots[0]));
+    node->index = calloc(index_size, sizeof(node->index[0]));
+    node->location_head = calloc(NUM_LOCATIONS + 1, sizeof(node->location_head[0]));
+    node->location_next = calloc(capacity, sizeof(node->location_next[0]));
+    node->location_prev = calloc(capacity, sizeof(node->location_prev[0]));
+    if (node->entries == NULL || node->free_slots == NULL || node->index == NULL ||
+        node->location_head == NULL || node->location_next == NULL || node->location_prev == NULL) {
+        return -1;
+    }
+    for (uint32_t i = 0; i < capacity; i++) node->free_slots[i] = capacity - 1 - i;
+    node->num_free = capacity;
+    return 0;
+}
+
+// Returns the slot of a registered key, or -1
+static int node_find(const SimNode *node, uint64_t key) {
+    for (uint32_t h = key_hash(key) & node->index_mask; node->index[h] != 0; h = (h + 1) & node->index_mask) {
+        if (node->entries[node->index[h] - 1].key == key) return (int)node->index[h] - 1;
+    }
+    return -1;
+}
+
+static void node_index_insert(SimNode *node, uint32_t slot) {
+    uint32_t h = key_hash(node->entries[slot].key) & node->index_mask;
+    while (node->index[h] != 0) h = (h + 1) & node->index_mask;
+    node->index[h] = slot + 1;
+}
+
+// Removes a slot from the index, shifting back the entries of its probe run (no tombstones)
+static void node_index_remove(SimNode *node, uint32_t slot) {
+    uint32_t h = key_hash(node->entries[slot].key) & node->index_mask;
+    while (node->index[h] != slot + 1) h = (h + 1) & node->index_mask;
+    uint32_t hole = h;
+    for (h = (h + 1) & node->index_mask; node->index[h] != 0; h = (h + 1) & node->index_mask) {
+        uint32_t home = key_hash(node->entries[node->index[h] - 1].key) & node->index_mask;
+        if (((h - home) & node->index_mask) >= ((h - hole) & node->index_mask)) {
+            node->index[hole] = node->index[h];
+            hole = h;
+        }
+    }
+    node->index[hole] = 0;
+}
+
+static uint32_t location_bucket(int loc_id) {
+    return loc_id >= 1 && loc_id <= NUM_LOCATIONS ? (uint32_t)loc_id : 0;
+}
+
+static void node_location_link(SimNode *node, uint32_t slot) {
+    uint32_t b = location_bucket(node->entries[slot].location_id);
+    node->location_prev[slot] = 0;
+    node->location_next[slot] = node->location_head[b];
+    if (node->location_head[b] != 0) node->location_prev[node->location_head[b] - 1] = slot + 1;
+    node->location_head[b] = slot + 1;
+}
+
+static void node_location_unlink(SimNode *node, uint32_t slot) {
+    uint32_t b = location_bucket(node->entries[slot].location_id);
+    if (node->location_prev[slot] != 0) node->location_next[node->location_prev[slot] - 1] = node->location_next[slot];
+    else node->location_head[b] = node->location_next[slot];
+    if (node->location_next[slot] != 0) node->location_prev[node->location_next[slot] - 1] = node->location_prev[slot];
+}
+
+static void error_reply(SimNode *node, char *reply, size_t reply_size, int error_code) {
+    char err_payload[10];
+    sprintf(err_payload, "%02d", error_code);
+    build_control_message(reply, reply_size, ERROR_MSG, err_payload);
+    node->errors++;
+}
+
+// Handles a P2P message from the other node (REQ_CHECKALERT on the SL). Returns 1 if reply holds an answer.
+int sim_node_peer_message(SimNode *node, const char *message, char *reply, size_t reply_size) {
+    int code;
+    char payload[MAX_MSG_SIZE];
+    node->messages++;
+    if (!parse_message(message, &code, payload, sizeof(payload))) return 0;
+
+    if (code == REQ_CHECKALERT && node->role == NODE_SL) {
+        int slot = node_find(node, sensor_id_parse(payload));
+        if (slot >= 0) {
+            char loc_str[12];
+            sprintf(loc_str, "%d", node->entries[slot].location_id);
+            build_control_message(reply, reply_size, RES_CHECKALERT, loc_str);
+        } else {
+            error_reply(node, reply, reply_size, SENSOR_NOT_FOUND);
+        }
+        return 1;
+    }
+    error_reply(node, reply, reply_size, INVALID_MSG_CODE_ERROR);
+    return 1;
+}
+
+// Handles a message of a sensor connection. conn_slot is the slot the connection registered
+// (0 if none), as the server keeps it per socket. Returns 1 if reply holds an answer.
+int sim_node_client_message(SimNode *node, int *conn_slot, const char *message, char *reply, size_t reply_size) {
+    int code;
+    char payload[MAX_MSG_SIZE];
+    node->messages++;
+    if (!parse_message(message, &code, payload, sizeof(payload))) {
+        error_reply(node, reply, reply_size, INVALID_PAYLOAD_ERROR);
+        return 1;
+    }
+
+    if (code == REQ_CONNSEN) {
+        char *comma = strchr(payload, ',');
+        uint64_t key = comma != NULL ? sensor_id_decode(payload, comma - payload) : SENSOR_KEY_NONE;
+        if (key == SENSOR_KEY_NONE || comma[1] == '\0') {
+            error_reply(node, reply, reply_size, INVALID_PAYLOAD_ERROR);
+            return 1;
+        }
+        if (node_find(node, key) >= 0) {
+            error_reply(node, reply, reply_size, SENSOR_ID_ALREADY_EXISTS_ERROR);
+            return 1;
+        }
+        if (node->num_free == 0) {
+            error_reply(node, reply, reply_size, SENSOR_LIMIT_EXCEEDED);
+            return 1;
+        }
+        int loc_id = atoi(comma + 1);
+        if (loc_id == -1) loc_id = rng_below(10) + 1;
+
+        uint32_t slot = node->free_slots[--node->num_free];
+        SimEntry *entry = &node->entries[slot];
+        entry->key = key;
+        entry->location_id = loc_id;
+        entry->risk_status = node->role == NODE_SS ? rng_below(2) : 0;
+        node_index_insert(node, slot);
+        node_location_link(node, slot);
+        *conn_slot = (int)slot + 1;
+
+        char slot_str[12];
+        sprintf(slot_str, "%u", slot + 1);
+        build_control_message(reply, reply_size, RES_CONNSEN, slot_str);
+        return 1;
+
+    } else if (code == REQ_DISCSEN) {
+        if (*conn_slot == 0 || atoi(payload) != *conn_slot) {
+            error_reply(node, reply, reply_size, SENSOR_NOT_FOUND);
+            return 1;
+        }
+        uint32_t slot = (uint32_t)*conn_slot - 1;
+        node_location_unlink(node, slot);
+        node_index_remove(node, slot);
+        node->entries[slot].key = SENSOR_KEY_NONE;
+        node->free_slots[node->num_free++] = slot;
+        *conn_slot = 0;
+        build_control_message(reply, reply_size, OK_MSG, "01");
+        return 1;
+
+    } else if (code == REQ_SENSSTATUS && node->role == NODE_SS) {
+        if (*conn_slot == 0 || atoi(payload) != *conn_slot) {
+            error_reply(node, reply, reply_size, SENSOR_NOT_FOUND);
+            return 1;
+        }
+        const SimEntry *entry = &node->entries[*conn_slot - 1];
+        if (entry->risk_status != 1) {
+            build_control_message(reply, reply_size, RES_SENSSTATUS, "-1");
+            return 1;
+        }
+        // Virtual P2P link: the alerting sensor is located with a REQ_CHECKALERT round trip to the SL
+        char sensor_id[SENSOR_ID_STR_SIZE], request[MAX_MSG_SIZE], answer[MAX_MSG_SIZE];
+        char answer_payload[MAX_MSG_SIZE];
+        int answer_code;
+        sensor_id_format(entry->key, sensor_id, sizeof(sensor_id));
+        build_control_message(request, sizeof(request), REQ_CHECKALERT, sensor_id);
+        messages_total++;
+        if (sim_node_peer_message(&sl_node, request, answer, sizeof(answer)) &&
+            parse_message(answer, &answer_code, answer_payload, sizeof(answer_payload)) &&
+            answer_code == RES_CHECKALERT) {
+            build_control_message(reply, reply_size, RES_SENSSTATUS, answer_payload);
+        } else {
+            error_reply(node, reply, reply_size, SENSOR_NOT_FOUND);
+        }
+        messages_total++;
+        return 1;
+
+    } else if (code == REQ_SENSLOC && node->role == NODE_SL) {
+        int slot = node_find(node, sensor_id_parse(payload));
+        if (slot < 0) {
+            error_reply(node, reply, reply_size, SENSOR_NOT_FOUND);
+            return 1;
+        }
+        char loc_str[12];
+        sprintf(loc_str, "%d", node->entries[slot].location_id);
+        build_control_message(reply, reply_size, RES_SENSLOC, loc_str);
+        return 1;
+
+    } else if (code == REQ_LOCUPDATE && node->role == NODE_SL) {
+        int loc_id = atoi(payload);
+        if (*conn_slot == 0) {
+            error_reply(node, reply, reply_size, SENSOR_NOT_FOUND);
+            return 1;
+        }
+        if (loc_id < 1 || loc_id > NUM_LOCATIONS) {
+            error_reply(node, reply, reply_size, INVALID_PAYLOAD_ERROR);
+            return 1;
+        }
+        uint32_t slot = (uint32_t)*conn_slot - 1;
+        node_location_unlink(node, slot);
+        node->entries[slot].location_id = loc_id;
+        node_location_link(node, slot);
+        return 0; // Only errors are answered
+    }
+
+    error_reply(node, reply, reply_size, INVALID_MSG_CODE_ERROR);
+    return 1;
+}
+
+// Virtual socket of a sensor: delivers one request to a node and parses the reply, if any.
+// Returns 1 if the node answered.
+static int sensor_exchange(SimNode *node, int *conn_slot, int code, const char *payload,
+                           int *reply_code, char *reply_payload, size_t reply_payload_size) {
+    char request[MAX_MSG_SIZE], reply[MAX_MSG_SIZE];
+    build_control_message(request, sizeof(request), code, payload);
+    messages_total++;
+    if (!sim_node_client_message(node, conn_slot, request, reply, sizeof(reply))) return 0;
+    messages_total++;
+    digest_update(reply);
+    if (!parse_message(reply, reply_code, reply_payload, reply_payload_size)) {
+        unexpected_replies++;
+        return 0;
+    }
+    return 1;
+}
+
+// Draws a new random sensor ID, the way the sensor does
+static uint64_t random_sensor_key(void) {
+    char id[SENSOR_ID_STR_SIZE];
+    for (int i = 0; i < SENSOR_ID_DIGITS; i++) id[i] = '0' + rng_below(10);
+    id[SENSOR_ID_DIGITS] = '\0';
+    return sensor_id_parse(id);
+}
+
+static void sensor_register(SimSensor *s, SimNode *node, int *conn_slot, int loc_id) {
+    char id[SENSOR_ID_STR_SIZE], payload[MAX_MSG_SIZE], reply_payload[MAX_MSG_SIZE];
+    int reply_code;
+    sensor_id_format(s->key, id, sizeof(id));
+    snprintf(payload, sizeof(payload), "%s,%d", id, loc_id);
+    if (!sensor_exchange(node, conn_slot, REQ_CONNSEN, payload, &reply_code, reply_payload, sizeof(reply_payload))) {
+        unexpected_replies++;
+        return;
+    }
+    if (reply_code == ERROR_MSG && atoi(reply_payload) == SENSOR_ID_ALREADY_EXISTS_ERROR) {
+        duplicate_ids++;
+        s->key = random_sensor_key(); // Registered again with the new ID on the next step
+        if (node == &sl_node) {
+            // Leave the SS too, so both servers see the new ID
+            char slot_str[12];
+            sprintf(slot_str, "%d", s->ss_slot);
+            sensor_exchange(&ss_node, &s->ss_slot, REQ_DISCSEN, slot_str, &reply_code, reply_payload, sizeof(reply_payload));
+            s->state = SENSOR_REGISTER_SS;
+        }
+    } else if (reply_code != RES_CONNSEN) {
+        unexpected_replies++;
+    } else if (node == &ss_node) {
+        s->state = SENSOR_REGISTER_SL;
+    } else {
+        if (s->sl_slot != s->ss_slot) slot_mismatches++;
+        s->location_id = sl_node.entries[s->sl_slot - 1].location_id;
+        s->state = SENSOR_ACTIVE;
+    }
+}
+
+static void sensor_disconnect(SimSensor *s) {
+    char slot_str[12], reply_payload[MAX_MSG_SIZE];
+    int reply_code;
+    sprintf(slot_str, "%d", s->ss_slot);
+    if (!sensor_exchange(&ss_node, &s->ss_slot, REQ_DISCSEN, slot_str, &reply_code, reply_payload, sizeof(reply_payload)) ||
+        reply_code != OK_MSG) {
+        unexpected_replies++;
+    }
+    sprintf(slot_str, "%d", s->sl_slot);
+    if (!sensor_exchange(&sl_node, &s->sl_slot, REQ_DISCSEN, slot_str, &reply_code, reply_payload, sizeof(reply_payload)) ||
+        reply_code != OK_MSG) {
+        unexpected_replies++;
+    }
+    s->state = SENSOR_DONE;
+    sensors_done++;
+}
+
+// Sends one request of the operation mix
+static void sensor_operation(SimSensor *s) {
+    char payload[MAX_MSG_SIZE], reply_payload[MAX_MSG_SIZE];
+    int reply_code;
+    int pick = rng_below(100);
+
+    if (pick < SIM_PCT_STATUS) {
+        sprintf(payload, "%d", s->ss_slot);
+        if (!sensor_exchange(&ss_node, &s->ss_slot, REQ_SENSSTATUS, payload, &reply_code, reply_payload, sizeof(reply_payload)) ||
+            reply_code != RES_SENSSTATUS) {
+            unexpected_replies++;
+        }
+    } else if (pick < SIM_PCT_STATUS + SIM_PCT_LOCATE) {
+        // Any sensor ID: some are not (or no longer) registered and get ERROR(10)
+        const SimSensor *target = &sensors[rng_below((int)num_sensors)];
+        sensor_id_format(target->key, payload, sizeof(payload));
+        if (!sensor_exchange(&sl_node, &s->sl_slot, REQ_SENSLOC, payload, &reply_code, reply_payload, sizeof(reply_payload)) ||
+            (reply_code != RES_SENSLOC && !(reply_code == ERROR_MSG && atoi(reply_payload) == SENSOR_NOT_FOUND))) {
+            unexpected_replies++;
+        }
+    } else {
+        s->location_id = rng_below(NUM_LOCATIONS) + 1;
+        sprintf(payload, "%d", s->location_id);
+        if (sensor_exchange(&sl_node, &s->sl_slot, REQ_LOCUPDATE, payload, &reply_code, reply_payload, sizeof(reply_payload))) {
+            unexpected_replies++; // Accepted updates are not answered
+        }
+    }
+    s->ops_left--;
+}
+
+// Timer callback: the next step of a sensor's life
+static void sensor_step(Timer *timer, void *arg) {
+    SimSensor *s = arg;
+    (void)timer;
+
+    if (s->state == SENSOR_REGISTER_SS) {
+        // Back to back, as the sensor does, so both servers hand out slots in the same order
+        sensor_register(s, &ss_node, &s->ss_slot, -1);
+        if (s->state == SENSOR_REGISTER_SL) sensor_register(s, &sl_node, &s->sl_slot, -1);
+    } else if (s->ops_left > 0) {
+        sensor_operation(s);
+    } else {
+        sensor_disconnect(s);
+        return;
+    }
+    unsigned delay = s->state == SENSOR_ACTIVE ? interval_ms / 2 + (unsigned)rng_below((int)interval_ms + 1) : SIM_TICK_MS;
+    timer_schedule(&wheel, &s->timer, virtual_now_ms, delay);
+}
+
+static void print_usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [--sensors <n>] [--seed <n>] [--ops <n>] [--interval <ms>]\n", prog);
+    fprintf(stderr, "  --sensors <n>    Simulated sensors (default %d).\n", SIM_DEFAULT_SENSORS);
+    fprintf(stderr, "  --seed <n>       Seed of all random choices; equal seeds give equal runs (default 0).\n");
+    fprintf(stderr, "  --ops <n>        Requests per sensor between registering and disconnecting (default %d).\n",
+            SIM_DEFAULT_OPS);
+    fprintf(stderr, "  --interval <ms>  Mean virtual time between two requests of a sensor (default %d).\n",
+            SIM_DEFAULT_INTERVAL_MS);
+}
+
+int main(int argc, char *argv[]) {
+    char log_msg[300];
+    uint64_t seed = 0;
+
+    for (int a = 1; a < argc; a++) {
+        if (strcmp(argv[a], "--sensors") == 0 && a + 1 < argc) {
+            num_sensors = (uint32_t)strtoul(argv[++a], NULL, 10);
+        } else if (strcmp(argv[a], "--seed") == 0 && a + 1 < argc) {
+            seed = strtoull(argv[++a], NULL, 10);
+        } else if (strcmp(argv[a], "--ops") == 0 && a + 1 < argc) {
+            ops_per_sensor = atoi(argv[++a]);
+        } else if (strcmp(argv[a], "--interval") == 0 && a + 1 < argc) {
+            interval_ms = (unsigned)atoi(argv[++a]);
+        } else {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    if (num_sensors == 0 || ops_per_sensor < 0 || interval_ms == 0) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    rng_seed(seed);
+    sensors = calloc(num_sensors, sizeof(sensors[0]));
+    if (sensors == NULL || sim_node_init(&ss_node, NODE_SS, "SS", num_sensors) < 0 ||
+        sim_node_init(&sl_node, NODE_SL, "SL", num_sensors) < 0) {
+        log_error("Out of memory for the simulated cluster.");
+        return 1;
+    }
+
+    // Sensors start over the first interval, as if launched one after the other
+    timer_wheel_init(&wheel, 0, SIM_TICK_MS);
+    for (uint32_t i = 0; i < num_sensors; i++) {
+        SimSensor *s = &sensors[i];
+        s->key = random_sensor_key();
+        s->ops_left = ops_per_sensor;
+        s->state = SENSOR_REGISTER_SS;
+        timer_init(&s->timer, sensor_step, s);
+        timer_schedule(&wheel, &s->timer, 0, (uint64_t)rng_below((int)interval_ms));
+    }
+
+    sprintf(log_msg, "Simulating 1 SS, 1 SL and %u sensors (seed %llu, %d requests each).",
+            num_sensors, (unsigned long long)seed, ops_per_sensor);
+    log_info(log_msg);
+
+    while (sensors_done < num_sensors && wheel.num_pending > 0) {
+        int idle = timer_wheel_next_timeout_ms(&wheel, virtual_now_ms);
+        virtual_now_ms += idle > 0 ? (uint64_t)idle : SIM_TICK_MS;
+        timer_wheel_advance(&wheel, virtual_now_ms);
+    }
+
+    sprintf(log_msg, "Virtual time %.3f s, %llu messages (%llu SS, %llu SL).",
+            virtual_now_ms / 1000.0, (unsigned long long)messages_total,
+            (unsigned long long)ss_node.messages, (unsigned long long)sl_node.messages);
+    log_info(log_msg);
+    sprintf(log_msg, "Errors: %llu SS, %llu SL; %llu duplicate IDs re-drawn, %llu slot mismatches, %llu unexpected replies.",
+            (unsigned long long)ss_node.errors, (unsigned long long)sl_node.errors,
+            (unsigned long long)duplicate_ids, (unsigned long long)slot_mismatches,
+            (unsigned long long)unexpected_replies);
+    log_info(log_msg);
+    sprintf(log_msg, "Reply digest: %016llx", (unsigned long long)digest);
+    log_info(log_msg);
+
+    return slot_mismatches == 0 && unexpected_replies == 0 ? 0 : 1;
+}
@@ -0,0 +1,193 @@
+#include "timerwheel.h"
+
+#define SLOT_MASK (TIMER_WHEEL_SLOTS - 1)
+
+static void list_init(Timer *head) {
+    head->next = head;
+    head->prev = head;
+}
+
+// Links a timer into the slot matching its expiry, relative to the next tick to process
+static void place_timer(TimerWheel *tw, Timer *timer) {
+    uint64_t expires = timer->expires_tick;
+    if (expires < tw->next_tick) expires = tw->next_tick; // Already due: run on the next tick
+
+    uint64_t delta = expires - tw->next_tick;
+    int level = 0;
+    while (level < TIMER_WHEEL_LEVELS - 1 &&
+           delta >= ((uint64_t)1 << (TIMER_WHEEL_BITS * (level + 1)))) {
+        level++;
+    }
+    uint64_t max_delta = ((uint64_t)1 << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) - 1;
+    if (delta > max_delta) {
+        expires = tw->next_tick + max_delta; // Re-cascaded until it is really due
+    }
+
+    int slot = (int)((expires >> (TIMER_WHEEL_BITS * level)) & SLOT_MASK);
+    Timer *head = &tw->slots[level][slot];
+    timer->slot = level * TIMER_WHEEL_SLOTS + slot;
+    timer->next = head;
+    timer->prev = head->prev;
+    head->prev->next = timer;
+    head->prev = timer;
+    tw->occupied[level] |= (uint64_t)1 << slot;
+}
+
+// Unlinks a timer and clears the slot bit if its slot became empty
+static void unlink_timer(TimerWheel *tw, Timer *timer) {
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->next = NULL;
+    timer->prev = NULL;
+
+    int level = timer->slot / TIMER_WHEEL_SLOTS;
+    int slot = timer->slot % TIMER_WHEEL_SLOTS;
+    Timer *head = &tw->slots[level][slot];
+    if (head->next == head) {
+        tw->occupied[level] &= ~((uint64_t)1 << slot);
+    }
+}
+
+// Moves every timer of one upper-level slot down to where it now belongs.
+// Returns the slot index so the caller knows whether the next level also wrapped.
+static int cascade(TimerWheel *tw, int level, int slot) {
+    Timer *head = &tw->slots[level][slot];
+    Timer pending;
+    list_init(&pending);
+    if (head->next != head) {
+        pending.next = head->next;
+        pending.prev = head->prev;
+        pending.next->prev = &pending;
+        pending.prev->next = &pending;
+        list_init(head);
+    }
+    tw->occupied[level] &= ~((uint64_t)1 << slot);
+
+    while (pending.next != &pending) {
+        Timer *timer = pending.next;
+        pending.next = timer->next;
+        timer->next->prev = &pending;
+        place_timer(tw, timer);
+    }
+    return slot;
+}
+
+void timer_wheel_init(TimerWheel *tw, uint64_t now_ms, unsigned tick_ms) {
+    for (int level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+        for (int slot = 0; slot < TIMER_WHEEL_SLOTS; slot++) {
+            list_init(&tw->slots[level][slot]);
+        }
+        tw->occupied[level] = 0;
+    }
+    tw->next_tick = 0;
+    tw->start_ms = now_ms;
+    tw->tick_ms = tick_ms > 0 ? tick_ms : 1;
+    tw->num_pending = 0;
+}
+
+void timer_init(Timer *timer, TimerCallback callback, void *arg) {
+    timer->next = NULL;
+    timer->prev = NULL;
+    timer->expires_tick = 0;
+    timer->slot = 0;
+    timer->callback = callback;
+    timer->arg = arg;
+}
+
+int timer_pending(const Timer *timer) {
+    return timer->next != NULL;
+}
+
+// (Re)schedules a timer to fire delay_ms after now_ms (rounded up to the next tick)
+void timer_schedule(TimerWheel *tw, Timer *timer, uint64_t now_ms, uint64_t delay_ms) {
+    if (timer_pending(timer)) {
+        unlink_timer(tw, timer);
+        tw->num_pending--;
+    }
+    uint64_t elapsed = now_ms > tw->start_ms ? now_ms - tw->start_ms : 0;
+    timer->expires_tick = (elapsed + delay_ms + tw->tick_ms - 1) / tw->tick_ms;
+    place_timer(tw, timer);
+    tw->num_pending++;
+}
+
+void timer_cancel(TimerWheel *tw, Timer *timer) {
+    if (timer_pending(timer)) {
+        unlink_timer(tw, timer);
+        tw->num_pending--;
+    }
+}
+
+// Processes every tick up to now_ms, running the callbacks of expired timers.
+// Callbacks may schedule or cancel any timer, including their own.
+void timer_wheel_advance(TimerWheel *tw, uint64_t now_ms) {
+    uint64_t elapsed = now_ms > tw->start_ms ? now_ms - tw->start_ms : 0;
+    uint64_t target_tick = elapsed / tw->tick_ms;
+
+    if (tw->num_pending == 0) {
+        if (target_tick >= tw->next_tick) tw->next_tick = target_tick + 1;
+        return;
+    }
+
+    while (tw->next_tick <= target_tick) {
+        int index = (int)(tw->next_tick & SLOT_MASK);
+        if (index == 0) {
+            for (int level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+                int slot = (int)((tw->next_tick >> (TIMER_WHEEL_BITS * level)) & SLOT_MASK);
+                if (cascade(tw, level, slot) != 0) break;
+            }
+        }
+
+        // Detach the due list so callbacks can freely reschedule
+        Timer *head = &tw->slots[0][index];
+        Timer due;
+        list_init(&due);
+        if (head->next != head) {
+            due.next = head->next;
+            due.prev = head->prev;
+            due.next->prev = &due;
+            due.prev->next = &due;
+            list_init(head);
+        }
+        tw->occupied[0] &= ~((uint64_t)1 << index);
+        tw->next_tick++;
+
+        while (due.next != &due) {
+            Timer *timer = due.next;
+            due.next = timer->next;
+            timer->next->prev = &due;
+            timer->next = NULL;
+            timer->prev = NULL;
+            tw->num_pending--;
+            timer->callback(timer, timer->arg);
+        }
+
+        if (tw->num_pending == 0 && tw->next_tick <= target_tick) {
+            tw->next_tick = target_tick + 1;
+        }
+    }
+}
+
+// Returns how long the caller may sleep before the wheel needs to advance again,
+// or -1 if no timer is pending.
+int timer_wheel_next_timeout_ms(const TimerWheel *tw, uint64_t now_ms) {
+    if (tw->num_pending == 0) return -1;
+
+    int offset = (int)(tw->next_tick & SLOT_MASK);
+    uint64_t ticks_ahead = (TIMER_WHEEL_SLOTS - offset) & SLOT_MASK; // Next wrap, where upper levels cascade
+    int upper_occupied = 0;
+    for (int level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+        if (tw->occupied[level] != 0) upper_occupied = 1;
+    }
+    if (!upper_occupied) ticks_ahead = TIMER_WHEEL_SLOTS;
+    uint64_t level0 = tw->occupied[0];
+    if (level0 != 0) {
+        uint64_t rotated = offset == 0 ? level0 : (level0 >> offset) | (level0 << (TIMER_WHEEL_SLOTS - offset));
+        uint64_t first = (uint64_t)__builtin_ctzll(rotated);
+        if (first < ticks_ahead) ticks_ahead = first;
+    }
+
+    uint64_t deadline_ms = tw->start_ms + (tw->next_tick + ticks_ahead) * tw->tick_ms;
+    if (deadline_ms <= now_ms) return 0;
+    uint64_t wait_ms = deadline_ms - now_ms;
+    return wait_ms > 0x7FFFFFFF ? 0x7FFFFFFF : (int)wait_ms;
+}
@@ -0,0 +1,44 @@
+#ifndef TIMERWHEEL_H
+#define TIMERWHEEL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Hierarchical timer wheel: 4 levels of 64 slots. Level L holds timers expiring within 64^(L+1) ticks,
+// and its slots are cascaded into the level below when that level wraps around.
+// Scheduling and cancelling are O(1); each tick only touches the timers that expire (or cascade) in it.
+#define TIMER_WHEEL_LEVELS 4
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+
+typedef struct Timer Timer;
+typedef void (*TimerCallback)(Timer *timer, void *arg);
+
+// Intrusive timer, embedded in the object it belongs to
+struct Timer {
+    Timer *next;
+    Timer *prev;
+    uint64_t expires_tick;
+    int slot;             // Flat index (level * TIMER_WHEEL_SLOTS + slot) of the list holding it
+    TimerCallback callback;
+    void *arg;
+};
+
+typedef struct {
+    Timer slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS]; // List heads
+    uint64_t occupied[TIMER_WHEEL_LEVELS];              // Bitmap of non-empty slots per level
+    uint64_t next_tick;                                 // Next tick to be processed
+    uint64_t start_ms;
+    unsigned tick_ms;
+    size_t num_pending;
+} TimerWheel;
+
+void timer_wheel_init(TimerWheel *tw, uint64_t now_ms, unsigned tick_ms);
+void timer_init(Timer *timer, TimerCallback callback, void *arg);
+int timer_pending(const Timer *timer);
+void timer_schedule(TimerWheel *tw, Timer *timer, uint64_t now_ms, uint64_t delay_ms);
+void timer_cancel(TimerWheel *tw, Timer *timer);
+void timer_wheel_advance(TimerWheel *tw, uint64_t now_ms);
+int timer_wheel_next_timeout_ms(const TimerWheel *tw, uint64_t now_ms);
+
+#endif // TIMERWHEEL_H
@@ -0,0 +1,87 @@
+#include "common.h"
+#include "trace.h"
+
+static TraceSpan trace_ring[TRACE_RING_SIZE];
+static uint64_t trace_count = 0;      // Spans recorded since tracing was enabled
+static int trace_on = 0;
+static char trace_process[32] = "";
+static uint64_t trace_id_counter = 0;
+
+// Starts recording spans. process_name labels this process in the exported trace.
+void trace_enable(const char *process_name) {
+    snprintf(trace_process, sizeof(trace_process), "%s", process_name);
+    trace_on = 1;
+}
+
+int trace_enabled(void) {
+    return trace_on;
+}
+
+// Returns a new non-zero trace ID, unique across the processes of a host
+uint64_t trace_new_id(void) {
+    uint64_t id = ((uint64_t)getpid() << 40) ^ (monotonic_us() << 8) ^ ++trace_id_counter;
+    return id != 0 ? id : 1;
+}
+
+// Records one span of a traced request. Does nothing while tracing is disabled.
+void trace_span(uint64_t trace_id, const char *name, int code, uint64_t start_us, uint64_t end_us) {
+    if (!trace_on) return;
+    TraceSpan *span = &trace_ring[trace_count++ % TRACE_RING_SIZE];
+    span->trace_id = trace_id;
+    span->start_us = start_us;
+    span->end_us = end_us;
+    span->name = name;
+    span->code = code;
+}
+
+// Writes the spans in the ring as a Chrome trace-event JSON file. Spans of different processes
+// share the monotonic clock, so their files can be merged by concatenating the traceEvents arrays.
+// Returns the number of spans written, or -1 if the file cannot be created.
+int trace_export_chrome(const char *path) {
+    FILE *file = fopen(path, "w");
+    if (file == NULL) return -1;
+
+    int pid = (int)getpid();
+    fprintf(file, "{\"traceEvents\":[\n");
+    fprintf(file, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":0,\"args\":{\"name\":\"%s\"}}",
+            pid, trace_process);
+
+    uint64_t first = trace_count > TRACE_RING_SIZE ? trace_count - TRACE_RING_SIZE : 0;
+    for (uint64_t n = first; n < trace_count; n++) {
+        const TraceSpan *span = &trace_ring[n % TRACE_RING_SIZE];
+        fprintf(file, ",\n{\"name\":\"%s %d\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%llu,\"dur\":%llu,"
+                      "\"pid\":%d,\"tid\":0,\"args\":{\"trace_id\":\"%016llx\"}}",
+                span->name, span->code, trace_process, (unsigned long long)span->start_us,
+                (unsigned long long)(span->end_us - span->start_us), pid, (unsigned long long)span->trace_id);
+    }
+    fprintf(file, "\n],\"displayTimeUnit\":\"ms\"}\n");
+    fclose(file);
+    return (int)(trace_count - first);
+}
+
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    return -1;
+}
+
+// Removes the trace prefix of a received message in place.
+// Returns the trace ID, or 0 if the message is not traced (it is then left unchanged).
+uint64_t trace_strip(char *message) {
+    if (message[0] != TRACE_PREFIX_CHAR) return 0;
+
+    uint64_t id = 0;
+    for (int i = 1; i < TRACE_PREFIX_LEN - 1; i++) {
+        int v = hex_value(message[i]);
+        if (v < 0) return 0;
+        id = (id << 4) | (uint64_t)v;
+    }
+    if (message[TRACE_PREFIX_LEN - 1] != ' ') return 0;
+    memmove(message, message + TRACE_PREFIX_LEN, strlen(message + TRACE_PREFIX_LEN) + 1);
+    return id;
+}
+
+// Writes message with the trace prefix of trace_id in front of it
+void trace_prefix(char *out, size_t out_size, uint64_t trace_id, const char *message) {
+    snprintf(out, out_size, "%c%016llx %s", TRACE_PREFIX_CHAR, (unsigned long long)trace_id, message);
+}
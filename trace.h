@@ -0,0 +1,33 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Request tracing. A traced message carries its trace ID as a "@<16 hex digits> " prefix in front
+// of the usual "code payload"; every hop strips the prefix, propagates it on the messages it sends
+// for that request and records spans (monotonic microsecond timestamps) into a per-process ring.
+// The ring can be exported in Chrome trace-event JSON (chrome://tracing, Perfetto).
+// Untraced messages only pay for the check of their first character.
+#define TRACE_PREFIX_CHAR '@'
+#define TRACE_PREFIX_LEN 18         // '@', 16 hex digits and a space
+#define TRACE_RING_SIZE 8192        // Spans kept; older spans are overwritten
+
+typedef struct {
+    uint64_t trace_id;
+    uint64_t start_us;
+    uint64_t end_us;
+    const char *name;               // Static string
+    int code;                       // Message code the span belongs to
+} TraceSpan;
+
+void trace_enable(const char *process_name);
+int trace_enabled(void);
+uint64_t trace_new_id(void);
+void trace_span(uint64_t trace_id, const char *name, int code, uint64_t start_us, uint64_t end_us);
+int trace_export_chrome(const char *path);
+
+uint64_t trace_strip(char *message);
+void trace_prefix(char *out, size_t out_size, uint64_t trace_id, const char *message);
+
+#endif // TRACE_H
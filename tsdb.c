@@ -0,0 +1,228 @@
+#include "tsdb.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Allocates the pool of num_blocks blocks. Returns 0 on success, -1 if out of memory.
+int ts_pool_init(TsPool *pool, size_t num_blocks) {
+    memset(pool, 0, sizeof(*pool));
+    pool->blocks = calloc(num_blocks, sizeof(TsBlock));
+    if (pool->blocks == NULL) return -1;
+    pool->num_blocks = num_blocks;
+    for (size_t i = num_blocks; i > 0; i--) {
+        pool->blocks[i - 1].next = pool->free_list;
+        pool->free_list = &pool->blocks[i - 1];
+    }
+    return 0;
+}
+
+void ts_series_init(TsSeries *series) {
+    memset(series, 0, sizeof(*series));
+}
+
+static void pool_unlink(TsPool *pool, TsBlock *block) {
+    if (block->pool_prev != NULL) block->pool_prev->pool_next = block->pool_next;
+    else pool->oldest = block->pool_next;
+    if (block->pool_next != NULL) block->pool_next->pool_prev = block->pool_prev;
+    else pool->newest = block->pool_prev;
+}
+
+static void pool_release(TsPool *pool, TsBlock *block) {
+    pool_unlink(pool, block);
+    block->series = NULL;
+    block->next = pool->free_list;
+    pool->free_list = block;
+}
+
+// Returns the points of a series to the pool
+void ts_series_clear(TsPool *pool, TsSeries *series) {
+    TsBlock *block = series->head;
+    while (block != NULL) {
+        TsBlock *next = block->next;
+        pool_release(pool, block);
+        block = next;
+    }
+    ts_series_init(series);
+}
+
+// Takes a free block, or the oldest block of the pool (the oldest one of its series)
+static TsBlock *pool_take(TsPool *pool) {
+    TsBlock *block = pool->free_list;
+    if (block != NULL) {
+        pool->free_list = block->next;
+    } else {
+        block = pool->oldest;
+        if (block == NULL) return NULL;
+        TsSeries *owner = block->series;
+        owner->head = block->next;
+        if (owner->tail == block) owner->tail = NULL;
+        pool_unlink(pool, block);
+        pool->evicted++;
+    }
+    memset(block, 0, sizeof(*block));
+    block->pool_prev = pool->newest;
+    if (pool->newest != NULL) pool->newest->pool_next = block;
+    else pool->oldest = block;
+    pool->newest = block;
+    return block;
+}
+
+static void put_bits(TsBlock *block, uint64_t value, int n) {
+    for (int i = n - 1; i >= 0; i--) {
+        if ((value >> i) & 1) block->data[block->bits >> 3] |= (uint8_t)(0x80 >> (block->bits & 7));
+        block->bits++;
+    }
+}
+
+static uint64_t double_bits(double value) {
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    return bits;
+}
+
+// Delta-of-delta classes: '0', then '10', '110', '1110' with a two's-complement 7, 9 or 12-bit field
+// (-64..63, -256..255, -2048..2047), else '1111' + 64 bits
+static void put_timestamp(TsBlock *block, int64_t dod) {
+    if (dod == 0) {
+        put_bits(block, 0, 1);
+    } else if (dod >= -64 && dod <= 63) {
+        put_bits(block, 0x2, 2);
+        put_bits(block, (uint64_t)dod & 0x7F, 7);
+    } else if (dod >= -256 && dod <= 255) {
+        put_bits(block, 0x6, 3);
+        put_bits(block, (uint64_t)dod & 0x1FF, 9);
+    } else if (dod >= -2048 && dod <= 2047) {
+        put_bits(block, 0xE, 4);
+        put_bits(block, (uint64_t)dod & 0xFFF, 12);
+    } else {
+        put_bits(block, 0xF, 4);
+        put_bits(block, (uint64_t)dod, 64);
+    }
+}
+
+// XOR classes: '0' same value, '10' meaningful bits inside the previous window, '11' + 5-bit leading
+// zero count + 6-bit length (0 meaning 64) + the meaningful bits
+static void put_value(TsSeries *series, TsBlock *block, uint64_t value) {
+    uint64_t x = value ^ series->prev_value;
+    if (x == 0) {
+        put_bits(block, 0, 1);
+        return;
+    }
+    int leading = __builtin_clzll(x);
+    int trailing = __builtin_ctzll(x);
+    if (leading > 31) leading = 31;
+    if (series->prev_leading >= 0 && leading >= series->prev_leading && trailing >= series->prev_trailing) {
+        int len = 64 - series->prev_leading - series->prev_trailing;
+        put_bits(block, 0x2, 2);
+        put_bits(block, x >> series->prev_trailing, len);
+    } else {
+        int len = 64 - leading - trailing;
+        put_bits(block, 0x3, 2);
+        put_bits(block, (uint64_t)leading, 5);
+        put_bits(block, (uint64_t)(len & 63), 6);
+        put_bits(block, x >> trailing, len);
+        series->prev_leading = leading;
+        series->prev_trailing = trailing;
+    }
+}
+
+// Appends a point; ts must not be older than the last point. Returns 0 on success, -1 if the pool has no blocks.
+int ts_append(TsPool *pool, TsSeries *series, uint64_t ts, double value) {
+    TsBlock *block = series->tail;
+    if (block != NULL && ts < block->last_ts) ts = block->last_ts;
+    uint64_t bits = double_bits(value);
+
+    if (block == NULL || block->bits + TS_POINT_MAX_BITS > TS_BLOCK_DATA_BYTES * 8 || block->count == UINT16_MAX) {
+        block = pool_take(pool);
+        if (block == NULL) return -1;
+        block->series = series;
+        if (series->tail != NULL) series->tail->next = block;
+        else series->head = block;
+        series->tail = block;
+
+        block->first_ts = block->last_ts = ts;
+        block->count = 1;
+        put_bits(block, ts, 64);
+        put_bits(block, bits, 64);
+        series->prev_ts = ts;
+        series->prev_delta = 0;
+        series->prev_value = bits;
+        series->prev_leading = -1;
+        series->prev_trailing = 0;
+        return 0;
+    }
+
+    int64_t delta = (int64_t)(ts - series->prev_ts);
+    put_timestamp(block, delta - series->prev_delta);
+    put_value(series, block, bits);
+    series->prev_ts = ts;
+    series->prev_delta = delta;
+    series->prev_value = bits;
+    block->last_ts = ts;
+    block->count++;
+    return 0;
+}
+
+typedef struct {
+    const TsBlock *block;
+    unsigned pos;
+} BitReader;
+
+static uint64_t get_bits(BitReader *r, int n) {
+    uint64_t value = 0;
+    for (int i = 0; i < n; i++) {
+        value = (value << 1) | ((r->block->data[r->pos >> 3] >> (7 - (r->pos & 7))) & 1);
+        r->pos++;
+    }
+    return value;
+}
+
+static int64_t sign_extend(uint64_t value, int n) {
+    uint64_t sign = (uint64_t)1 << (n - 1);
+    return (int64_t)((value ^ sign) - sign);
+}
+
+static int64_t get_timestamp_dod(BitReader *r) {
+    if (get_bits(r, 1) == 0) return 0;
+    if (get_bits(r, 1) == 0) return sign_extend(get_bits(r, 7), 7);
+    if (get_bits(r, 1) == 0) return sign_extend(get_bits(r, 9), 9);
+    if (get_bits(r, 1) == 0) return sign_extend(get_bits(r, 12), 12);
+    return (int64_t)get_bits(r, 64);
+}
+
+// Copies the points with from_ts <= ts <= to_ts, oldest first, into out (at most max_points).
+// Only the blocks overlapping the range are decoded. Returns the number of points copied.
+size_t ts_query(const TsSeries *series, uint64_t from_ts, uint64_t to_ts, TsPoint *out, size_t max_points) {
+    size_t n = 0;
+    for (const TsBlock *block = series->head; block != NULL && n < max_points; block = block->next) {
+        if (block->last_ts < from_ts) continue;
+        if (block->first_ts > to_ts) break;
+
+        BitReader r = { block, 0 };
+        uint64_t ts = get_bits(&r, 64);
+        uint64_t value = get_bits(&r, 64);
+        int64_t delta = 0;
+        int leading = 0, trailing = 0;
+        for (unsigned i = 0; i < block->count && n < max_points; i++) {
+            if (i > 0) {
+                delta += get_timestamp_dod(&r);
+                ts += (uint64_t)delta;
+                if (get_bits(&r, 1) == 1) {
+                    if (get_bits(&r, 1) == 1) {
+                        leading = (int)get_bits(&r, 5);
+                        int len = (int)get_bits(&r, 6);
+                        if (len == 0) len = 64;
+                        trailing = 64 - leading - len;
+                    }
+                    value ^= get_bits(&r, 64 - leading - trailing) << trailing;
+                }
+            }
+            if (ts > to_ts) break;
+            if (ts >= from_ts) {
+                out[n].ts = ts;
+                memcpy(&out[n].value, &value, sizeof(value));
+                n++;
+            }
+        }
+    }
+    return n;
+}
@@ -0,0 +1,61 @@
+#ifndef TSDB_H
+#define TSDB_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Compressed in-memory time series (Gorilla encoding). Points are (unix ms, double) pairs appended
+// in time order. Each block starts with a raw point; later timestamps are stored as delta-of-deltas
+// and values as the XOR with the previous value, so a regular series costs a few bits per point.
+// Blocks come from a fixed pool: when it runs out, the oldest block of the whole pool is reused,
+// so memory stays bounded and the history kept is the most recent one.
+#define TS_BLOCK_DATA_BYTES 200     // Encoded bytes per block
+#define TS_POINT_MAX_BITS 145       // Worst case of one point: 4 + 64 timestamp bits, 2 + 5 + 6 + 64 value bits
+
+typedef struct TsSeries TsSeries;
+typedef struct TsBlock TsBlock;
+
+struct TsBlock {
+    TsBlock *next;                  // Next (newer) block of the series, or next free block
+    TsBlock *pool_prev;             // Allocation order across the pool, oldest first
+    TsBlock *pool_next;
+    TsSeries *series;
+    uint64_t first_ts;
+    uint64_t last_ts;
+    uint16_t count;                 // Points in the block
+    uint16_t bits;                  // Bits of data in use
+    uint8_t data[TS_BLOCK_DATA_BYTES];
+};
+
+typedef struct {
+    TsBlock *blocks;
+    size_t num_blocks;
+    TsBlock *free_list;
+    TsBlock *oldest;                // Allocated blocks, oldest first
+    TsBlock *newest;
+    uint64_t evicted;               // Blocks reused while still holding history
+} TsPool;
+
+struct TsSeries {
+    TsBlock *head;                  // Oldest block
+    TsBlock *tail;                  // Block being appended to
+    // Encoder state of the tail block
+    uint64_t prev_ts;
+    int64_t prev_delta;
+    uint64_t prev_value;            // Bits of the previous double
+    int prev_leading;
+    int prev_trailing;
+};
+
+typedef struct {
+    uint64_t ts;
+    double value;
+} TsPoint;
+
+int ts_pool_init(TsPool *pool, size_t num_blocks);
+void ts_series_init(TsSeries *series);
+void ts_series_clear(TsPool *pool, TsSeries *series);
+int ts_append(TsPool *pool, TsSeries *series, uint64_t ts, double value);
+size_t ts_query(const TsSeries *series, uint64_t from_ts, uint64_t to_ts, TsPoint *out, size_t max_points);
+
+#endif // TSDB_H
@@ -0,0 +1,53 @@
+#include "tsdb.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+// Round-trip checks of the time series encoding, run by 'make check'.
+
+// Appends the timestamps to a fresh series and reads them back.
+// Returns 0 if every point reads back unchanged, -1 otherwise.
+static int check_round_trip(const char *name, const uint64_t *ts, size_t n) {
+    TsPoint out[64];
+    TsPool pool;
+    TsSeries series;
+
+    if (n > sizeof(out) / sizeof(out[0]) || ts_pool_init(&pool, 2) < 0) return -1;
+    ts_series_init(&series);
+    int result = 0;
+    for (size_t i = 0; i < n && result == 0; i++) {
+        result = ts_append(&pool, &series, ts[i], i * 1.5);
+    }
+    if (result == 0 && ts_query(&series, 0, UINT64_MAX, out, n) != n) result = -1;
+    for (size_t i = 0; i < n && result == 0; i++) {
+        if (out[i].ts != ts[i] || out[i].value != i * 1.5) {
+            fprintf(stderr, "%s: point %zu read back as %llu, expected %llu\n", name, i,
+                    (unsigned long long)out[i].ts, (unsigned long long)ts[i]);
+            result = -1;
+        }
+    }
+    free(pool.blocks);
+    printf("%s: %s\n", name, result == 0 ? "ok" : "FAILED");
+    return result;
+}
+
+int main(void) {
+    int failed = 0;
+
+    // Delta-of-deltas at both ends of every timestamp class and one past them
+    static const int64_t dods[] = { 100, 63, -64, 0, 255, -256, 2047, -2048, 64, -65, 256, -257, 2048, -2049 };
+    enum { NUM_POINTS = sizeof(dods) / sizeof(dods[0]) + 1 };
+    uint64_t ts[NUM_POINTS];
+    int64_t delta = 0;
+    ts[0] = 1000000;
+    for (int i = 1; i < NUM_POINTS; i++) {
+        delta += dods[i - 1];
+        ts[i] = ts[i - 1] + (uint64_t)delta;
+    }
+    failed |= check_round_trip("delta-of-delta class boundaries", ts, NUM_POINTS);
+
+    // Positive delta-of-deltas of exactly 64, 256 and 2048
+    static const uint64_t positive_edges[] = { 1000, 1100, 1264, 1428, 1800, 2428 };
+    failed |= check_round_trip("positive class edges", positive_edges, sizeof(positive_edges) / sizeof(positive_edges[0]));
+
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,333 @@
+#include "uring.h"
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#ifdef IORING_RECV_MULTISHOT // Multishot receives and provided buffer rings need Linux 6.0 headers
+#define URING_SUPPORTED 1
+#endif
+#endif
+#endif
+
+#ifdef URING_SUPPORTED
+
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+// Publishes the prepared SQEs to the kernel
+static void publish_sqes(Uring *ring) {
+    __atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+}
+
+// Returns a zeroed SQE, submitting pending ones first if the submission queue is full.
+static struct io_uring_sqe *get_sqe(Uring *ring) {
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (ring->sq_local_tail - head >= ring->sq_entries) {
+        if (uring_submit(ring, 0) < 0) return NULL;
+        head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+        if (ring->sq_local_tail - head >= ring->sq_entries) return NULL;
+    }
+
+    unsigned index = ring->sq_local_tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &((struct io_uring_sqe *)ring->sqes)[index];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[index] = index;
+    ring->sq_local_tail++;
+    return sqe;
+}
+
+// Hands one buffer back to the kernel through the provided buffer ring
+static void add_buffer(Uring *ring, unsigned short buf_id) {
+    struct io_uring_buf_ring *br = ring->buf_ring;
+    struct io_uring_buf *buf = &br->bufs[ring->buf_tail & (ring->buf_count - 1)];
+    buf->addr = (uint64_t)(uintptr_t)(ring->buf_base + (size_t)buf_id * ring->buf_size);
+    buf->len = (unsigned)ring->buf_size - 1; // Keep one byte for the null terminator
+    buf->bid = buf_id;
+    ring->buf_tail++;
+}
+
+// Sets up the rings and registers buf_count (a power of two) receive buffers of buf_size bytes.
+// Returns 0 on success, -1 if the kernel lacks the required io_uring features.
+int uring_init(Uring *ring, unsigned entries, unsigned buf_count, size_t buf_size, unsigned short buf_group) {
+    struct io_uring_params params;
+    memset(ring, 0, sizeof(*ring));
+    memset(&params, 0, sizeof(params));
+    ring->ring_fd = -1;
+
+    int fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+    if (fd < 0) return -1;
+    ring->ring_fd = fd;
+
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (!(params.features & IORING_FEAT_EXT_ARG)) { // Needed for waits with a timeout
+        uring_destroy(ring);
+        return -1;
+    }
+    int single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single_mmap && ring->cq_ring_size > ring->sq_ring_size) ring->sq_ring_size = ring->cq_ring_size;
+
+    ring->sq_ring_ptr = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                             fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring_ptr == MAP_FAILED) {
+        ring->sq_ring_ptr = NULL;
+        uring_destroy(ring);
+        return -1;
+    }
+    if (single_mmap) {
+        ring->cq_ring_ptr = ring->sq_ring_ptr;
+    } else {
+        ring->cq_ring_ptr = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                 fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ring_ptr == MAP_FAILED) {
+            ring->cq_ring_ptr = NULL;
+            uring_destroy(ring);
+            return -1;
+        }
+    }
+
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        ring->sqes = NULL;
+        uring_destroy(ring);
+        return -1;
+    }
+
+    char *sq = ring->sq_ring_ptr;
+    char *cq = ring->cq_ring_ptr;
+    ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+    ring->sq_entries = params.sq_entries;
+    ring->sq_local_tail = *ring->sq_tail;
+    ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = cq + params.cq_off.cqes;
+
+    // Provided buffer ring for multishot receives
+    ring->buf_count = buf_count;
+    ring->buf_size = buf_size;
+    ring->buf_group = buf_group;
+    ring->buf_ring_size = buf_count * sizeof(struct io_uring_buf);
+    ring->buf_ring = mmap(NULL, ring->buf_ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring->buf_ring == MAP_FAILED) {
+        ring->buf_ring = NULL;
+        uring_destroy(ring);
+        return -1;
+    }
+    ring->buf_base = mmap(NULL, buf_count * buf_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring->buf_base == MAP_FAILED) {
+        ring->buf_base = NULL;
+        uring_destroy(ring);
+        return -1;
+    }
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)ring->buf_ring;
+    reg.ring_entries = buf_count;
+    reg.bgid = buf_group;
+    if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        uring_destroy(ring);
+        return -1;
+    }
+    for (unsigned i = 0; i < buf_count; i++) {
+        add_buffer(ring, (unsigned short)i);
+    }
+    __atomic_store_n(&((struct io_uring_buf_ring *)ring->buf_ring)->tail, ring->buf_tail, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+// Releases the rings and buffers
+void uring_destroy(Uring *ring) {
+    if (ring->buf_base != NULL) munmap(ring->buf_base, ring->buf_count * ring->buf_size);
+    if (ring->buf_ring != NULL) munmap(ring->buf_ring, ring->buf_ring_size);
+    if (ring->sqes != NULL) munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring_ptr != NULL && ring->cq_ring_ptr != ring->sq_ring_ptr) munmap(ring->cq_ring_ptr, ring->cq_ring_size);
+    if (ring->sq_ring_ptr != NULL) munmap(ring->sq_ring_ptr, ring->sq_ring_size);
+    if (ring->ring_fd >= 0) close(ring->ring_fd);
+    memset(ring, 0, sizeof(*ring));
+    ring->ring_fd = -1;
+}
+
+// Queues an accept that keeps producing one completion per new connection
+int uring_prep_multishot_accept(Uring *ring, int listen_fd, uint64_t user_data) {
+    struct io_uring_sqe *sqe = get_sqe(ring);
+    if (sqe == NULL) return -1;
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listen_fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC; // Same socket flags as accept4 in the select() loop
+    sqe->user_data = user_data;
+    return 0;
+}
+
+// Queues a receive that keeps delivering data in buffers taken from the provided buffer ring
+int uring_prep_multishot_recv(Uring *ring, int fd, uint64_t user_data) {
+    struct io_uring_sqe *sqe = get_sqe(ring);
+    if (sqe == NULL) return -1;
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = ring->buf_group;
+    sqe->user_data = user_data;
+    return 0;
+}
+
+// Queues a send. With link_to_previous, it only starts after the previously prepared SQE
+// completes, which keeps several sends to the same socket in order.
+int uring_prep_send(Uring *ring, int fd, const void *buf, size_t len, uint64_t user_data, int link_to_previous) {
+    unsigned unpublished = ring->sq_local_tail - *ring->sq_tail;
+    struct io_uring_sqe *prev = NULL;
+    if (link_to_previous && unpublished > 0) {
+        prev = &((struct io_uring_sqe *)ring->sqes)[(ring->sq_local_tail - 1) & *ring->sq_mask];
+    }
+
+    struct io_uring_sqe *sqe = get_sqe(ring);
+    if (sqe == NULL) return -1;
+    // get_sqe may have submitted the previous SQE already; only link while both are unpublished
+    if (prev != NULL && ring->sq_local_tail - *ring->sq_tail >= 2) {
+        prev->flags |= IOSQE_IO_LINK;
+    }
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)buf;
+    sqe->len = (unsigned)len;
+    // Client sockets are non-blocking: MSG_WAITALL has the kernel finish a short send itself rather than
+    // complete it partially and break the linked chain behind it
+    sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+    sqe->user_data = user_data;
+    return 0;
+}
+
+// Queues a one-shot readability poll
+int uring_prep_poll(Uring *ring, int fd, uint64_t user_data) {
+    struct io_uring_sqe *sqe = get_sqe(ring);
+    if (sqe == NULL) return -1;
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = user_data;
+    return 0;
+}
+
+// Queues the removal of a pending poll
+int uring_prep_poll_remove(Uring *ring, uint64_t target_user_data) {
+    struct io_uring_sqe *sqe = get_sqe(ring);
+    if (sqe == NULL) return -1;
+    sqe->opcode = IORING_OP_POLL_REMOVE;
+    sqe->fd = -1;
+    sqe->addr = target_user_data;
+    sqe->user_data = 0;
+    return 0;
+}
+
+// Queues the cancellation of a pending (e.g. multishot) request
+int uring_prep_cancel(Uring *ring, uint64_t target_user_data) {
+    struct io_uring_sqe *sqe = get_sqe(ring);
+    if (sqe == NULL) return -1;
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = target_user_data;
+    sqe->user_data = 0;
+    return 0;
+}
+
+// Submits every prepared SQE and, if wait_nr > 0, waits until that many completions are ready.
+// This is the only system call the backend makes per loop iteration.
+int uring_submit(Uring *ring, unsigned wait_nr) {
+    return uring_submit_timeout(ring, wait_nr, -1);
+}
+
+// Like uring_submit, but stops waiting after timeout_ms milliseconds (-1 waits indefinitely).
+// A wait that times out is not an error and returns 0.
+int uring_submit_timeout(Uring *ring, unsigned wait_nr, int timeout_ms) {
+    publish_sqes(ring);
+    unsigned to_submit = ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (wait_nr > 0 && *ring->cq_head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        wait_nr = 0; // Completions already pending, no need to block
+    }
+    if (to_submit == 0 && wait_nr == 0) return 0;
+
+    unsigned flags = wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0;
+    int ret;
+    if (wait_nr > 0 && timeout_ms >= 0) {
+        struct __kernel_timespec ts;
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = (long long)(timeout_ms % 1000) * 1000000;
+        struct io_uring_getevents_arg arg;
+        memset(&arg, 0, sizeof(arg));
+        arg.ts = (uint64_t)(uintptr_t)&ts;
+        ret = (int)syscall(__NR_io_uring_enter, ring->ring_fd, to_submit, wait_nr,
+                           flags | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+        if (ret < 0 && errno == ETIME) return 0;
+    } else {
+        ret = (int)syscall(__NR_io_uring_enter, ring->ring_fd, to_submit, wait_nr, flags, NULL, 0);
+    }
+    return ret < 0 ? -1 : ret;
+}
+
+// Copies the next completion, if any, and releases its CQ slot.
+// Returns 1 if a completion was reaped, 0 if the completion queue is empty.
+int uring_next_completion(Uring *ring, UringCompletion *completion) {
+    unsigned head = *ring->cq_head;
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) return 0;
+
+    struct io_uring_cqe *cqe = &((struct io_uring_cqe *)ring->cqes)[head & *ring->cq_mask];
+    completion->user_data = cqe->user_data;
+    completion->res = cqe->res;
+    completion->more = (cqe->flags & IORING_CQE_F_MORE) != 0;
+    completion->has_buffer = (cqe->flags & IORING_CQE_F_BUFFER) != 0;
+    completion->buf_id = (unsigned short)(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+    __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+// Returns the data area of a provided buffer
+char *uring_buffer(Uring *ring, unsigned short buf_id) {
+    return ring->buf_base + (size_t)buf_id * ring->buf_size;
+}
+
+// Returns a consumed provided buffer to the kernel
+void uring_recycle_buffer(Uring *ring, unsigned short buf_id) {
+    add_buffer(ring, buf_id);
+    __atomic_store_n(&((struct io_uring_buf_ring *)ring->buf_ring)->tail, ring->buf_tail, __ATOMIC_RELEASE);
+}
+
+#else // !URING_SUPPORTED
+
+int uring_init(Uring *ring, unsigned entries, unsigned buf_count, size_t buf_size, unsigned short buf_group) {
+    (void)entries; (void)buf_count; (void)buf_size; (void)buf_group;
+    memset(ring, 0, sizeof(*ring));
+    ring->ring_fd = -1;
+    errno = ENOSYS;
+    return -1;
+}
+void uring_destroy(Uring *ring) { (void)ring; }
+int uring_prep_multishot_accept(Uring *ring, int listen_fd, uint64_t user_data) { (void)ring; (void)listen_fd; (void)user_data; return -1; }
+int uring_prep_multishot_recv(Uring *ring, int fd, uint64_t user_data) { (void)ring; (void)fd; (void)user_data; return -1; }
+int uring_prep_send(Uring *ring, int fd, const void *buf, size_t len, uint64_t user_data, int link_to_previous) {
+    (void)ring; (void)fd; (void)buf; (void)len; (void)user_data; (void)link_to_previous;
+    return -1;
+}
+int uring_prep_poll(Uring *ring, int fd, uint64_t user_data) { (void)ring; (void)fd; (void)user_data; return -1; }
+int uring_prep_poll_remove(Uring *ring, uint64_t target_user_data) { (void)ring; (void)target_user_data; return -1; }
+int uring_prep_cancel(Uring *ring, uint64_t target_user_data) { (void)ring; (void)target_user_data; return -1; }
+int uring_submit(Uring *ring, unsigned wait_nr) { (void)ring; (void)wait_nr; return -1; }
+int uring_submit_timeout(Uring *ring, unsigned wait_nr, int timeout_ms) { (void)ring; (void)wait_nr; (void)timeout_ms; return -1; }
+int uring_next_completion(Uring *ring, UringCompletion *completion) { (void)ring; (void)completion; return 0; }
+char *uring_buffer(Uring *ring, unsigned short buf_id) { (void)ring; (void)buf_id; return NULL; }
+void uring_recycle_buffer(Uring *ring, unsigned short buf_id) { (void)ring; (void)buf_id; }
+
+#endif // URING_SUPPORTED
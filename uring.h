@@ -0,0 +1,72 @@
+#ifndef URING_H
+#define URING_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Minimal io_uring wrapper built directly on the io_uring_setup/io_uring_enter/io_uring_register
+// system calls, so the server does not depend on liburing.
+// All functions return -1 when io_uring is not available on the build or running kernel.
+
+typedef struct {
+    int ring_fd;
+
+    // Submission queue
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    void *sqes;                // struct io_uring_sqe[]
+    unsigned sq_entries;
+    unsigned sq_local_tail;    // Tail including prepared but not yet published SQEs
+
+    // Completion queue
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    void *cqes;                // struct io_uring_cqe[]
+
+    // Ring mappings
+    void *sq_ring_ptr;
+    size_t sq_ring_size;
+    void *cq_ring_ptr;
+    size_t cq_ring_size;
+    size_t sqes_size;
+
+    // Provided buffer ring used by multishot receives
+    void *buf_ring;            // struct io_uring_buf_ring
+    size_t buf_ring_size;
+    char *buf_base;
+    size_t buf_size;
+    unsigned buf_count;
+    unsigned short buf_group;
+    unsigned short buf_tail;
+} Uring;
+
+// One reaped completion
+typedef struct {
+    uint64_t user_data;
+    int res;
+    int more;                  // The multishot request is still armed
+    int has_buffer;            // buf_id refers to a provided buffer holding the data
+    unsigned short buf_id;
+} UringCompletion;
+
+int uring_init(Uring *ring, unsigned entries, unsigned buf_count, size_t buf_size, unsigned short buf_group);
+void uring_destroy(Uring *ring);
+
+int uring_prep_multishot_accept(Uring *ring, int listen_fd, uint64_t user_data);
+int uring_prep_multishot_recv(Uring *ring, int fd, uint64_t user_data);
+int uring_prep_send(Uring *ring, int fd, const void *buf, size_t len, uint64_t user_data, int link_to_previous);
+int uring_prep_poll(Uring *ring, int fd, uint64_t user_data);
+int uring_prep_poll_remove(Uring *ring, uint64_t target_user_data);
+int uring_prep_cancel(Uring *ring, uint64_t target_user_data);
+
+int uring_submit(Uring *ring, unsigned wait_nr);
+int uring_submit_timeout(Uring *ring, unsigned wait_nr, int timeout_ms);
+int uring_next_completion(Uring *ring, UringCompletion *completion);
+
+char *uring_buffer(Uring *ring, unsigned short buf_id);
+void uring_recycle_buffer(Uring *ring, unsigned short buf_id);
+
+#endif // URING_H